@@ -25,6 +25,9 @@
 /*** MODULEINFO
 	<support_level>extended</support_level>
 	<depend>hiredis</depend>
+	<use type="external">hiredis_ssl</use>
+	<use type="external">lz4</use>
+	<use type="external">zstd</use>
  ***/
 
 
@@ -39,18 +42,34 @@ ASTERISK_FILE_VERSION("func_redis.c", "$Revision: 2 $")
 #include <asterisk/app.h>
 #include <asterisk/cli.h>
 #include <asterisk/config.h>
+#include <asterisk/linkedlists.h>
+#include <asterisk/lock.h>
+#include <asterisk/astobj2.h>
+#include <asterisk/manager.h>
+#include <asterisk/file.h>
+#include <asterisk/json.h>
+#include <asterisk/threadstorage.h>
 
 #ifndef AST_MODULE
 	#define AST_MODULE "func_redis"
 #endif
 
 #include <hiredis/hiredis.h>
+#ifdef HAVE_HIREDIS_SSL
+#include <hiredis/hiredis_ssl.h>
+#endif
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
 #include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <stdarg.h>
 
 
-#define redisLoggedCommand(redis, ...) redisCommand(redis, __VA_ARGS__); \
-ast_log(LOG_DEBUG, __VA_ARGS__);
-
 /*** DOCUMENTATION
 	<function name="REDIS" language="en_US">
 		<synopsis>
@@ -59,6 +78,39 @@ ast_log(LOG_DEBUG, __VA_ARGS__);
 		<syntax>
 			<parameter name="key" required="true" />
 			<parameter name="hash" required="false" />
+			<parameter name="options" required="false">
+				<para>Only used when writing.</para>
+				<optionlist>
+					<option name="a">
+						<para>Queue the write for the background writer and return without
+						waiting for the server.</para>
+					</option>
+					<option name="s">
+						<para>Wait for the server even if <literal>async_writes</literal> is
+						enabled.</para>
+					</option>
+					<option name="e">
+						<argument name="seconds" required="true" />
+						<para>Expire the key after <replaceable>seconds</replaceable>. On a
+						hash field this sets the expiry of the whole hash.</para>
+					</option>
+					<option name="p">
+						<argument name="milliseconds" required="true" />
+						<para>Expire the key after <replaceable>milliseconds</replaceable>.</para>
+					</option>
+					<option name="n">
+						<para>Only set the key or hash field if it does not exist yet.</para>
+					</option>
+					<option name="x">
+						<para>Only set the key if it already exists. Not supported for hash
+						fields.</para>
+					</option>
+					<option name="z">
+						<para>Compress the value even if <literal>compression</literal> is
+						off, with lz4 if built in and zstd otherwise.</para>
+					</option>
+				</optionlist>
+			</parameter>
 		</syntax>
 		<description>
 			<para>This function will read from or write a value to the Redis database.  On a
@@ -66,6 +118,42 @@ ast_log(LOG_DEBUG, __VA_ARGS__);
 			if it does not exist.  Reading a database value will also set the variable
 			REDIS_RESULT.  If you wish to find out if an entry exists, use the REDIS_EXISTS
 			function.</para>
+			<para>A <replaceable>key</replaceable> of the form
+			<literal>profile:key</literal>, where <replaceable>profile</replaceable> is a
+			section of <filename>func_redis.conf</filename>, uses that profile's database,
+			connections and key prefix. This applies to the keys of all of the REDIS
+			functions; those taking several keys use the profile of the first one.</para>
+			<para>When <literal>cache</literal> is enabled in <filename>func_redis.conf</filename>,
+			reads are served from a local cache that Redis keeps coherent through client side
+			caching invalidations. Writes, deletions, increments and expiry changes made
+			through the REDIS functions drop the cached copy of their key right away, so a
+			channel reads its own writes back. Keys found missing are remembered for
+			<literal>cache_negative_ttl</literal>. Concurrent reads of the same key or field
+			share a single request to the server, whether the cache is enabled or not.</para>
+			<para>With <literal>compression</literal> set, or the <literal>z</literal> option,
+			values of at least <literal>compress_threshold</literal> bytes are written
+			compressed. Reads of every REDIS function recognize compressed values and return
+			them decompressed, whatever the setting.</para>
+			<para>All of the REDIS functions set <variable>REDIS_STATUS</variable> to the
+			outcome of the call:</para>
+			<variablelist>
+				<variable name="REDIS_STATUS">
+					<value name="OK">The command succeeded.</value>
+					<value name="NOT_FOUND">The key or hash field does not exist.</value>
+					<value name="NOT_SET">A write with the <literal>n</literal> or
+					<literal>x</literal> option was skipped because its condition did not hold.</value>
+					<value name="ERROR">The command failed or the connection was lost.</value>
+					<value name="UNAVAILABLE">The server is unreachable and the call failed
+					without waiting for it.</value>
+					<value name="TIMEOUT">The call ran out of the time given by
+					<variable>REDIS_TIMEOUT_MS</variable>.</value>
+				</variable>
+			</variablelist>
+			<para>If the channel variable <variable>REDIS_TIMEOUT_MS</variable> is set, every
+			REDIS function gives up after that many milliseconds, including the wait for a
+			pooled connection and the connect of a new one, instead of the
+			<literal>connect_timeout</literal> and <literal>command_timeout</literal> of
+			<filename>func_redis.conf</filename>.</para>
 		</description>
 		<see-also>
 			<ref type="function">REDIS_DELETE</ref>
@@ -74,16 +162,18 @@ ast_log(LOG_DEBUG, __VA_ARGS__);
 	</function>
 	<function name="REDIS_EXISTS" language="en_US">
 		<synopsis>
-			Check to see if a key exists in the Redis database.
+			Check to see if keys exist in the Redis database.
 		</synopsis>
 		<syntax>
-			<parameter name="key" required="true" />
+			<parameter name="key1" required="true" />
+			<parameter name="key2" multiple="true" required="false" />
 		</syntax>
 		<description>
-			<para>This function will check to see if a key exists in the Redis
-			database. If it exists, the function will return <literal>1</literal>. If not,
-			it will return <literal>0</literal>.  Checking for existence of a database key will
-			also set the variable REDIS_RESULT to the key's value if it exists.</para>
+			<para>This function will check to see if keys exist in the Redis
+			database with a single EXISTS, and return how many of them do. For one
+			key that is <literal>1</literal> if it exists and <literal>0</literal> if
+			not. Up to 64 keys can be checked at once; a key given twice is counted
+			twice.</para>
 		</description>
 		<see-also>
 			<ref type="function">REDIS</ref>
@@ -108,11 +198,15 @@ ast_log(LOG_DEBUG, __VA_ARGS__);
 		</synopsis>
 		<syntax>
 			<parameter name="channel" required="true" />
+			<parameter name="options" required="false">
+				<para>Same as the <replaceable>options</replaceable> of
+				<literal>REDIS</literal>.</para>
+			</parameter>
 		</syntax>
 		<description>
 			<para>This function will publish a message in a redis channel,
 			the result of redis publish is stored in the channel variable
-			REDIS_PUBLISH_RESULT</para>
+			REDIS_PUBLISH_RESULT, except for async publishes.</para>
 		</description>
 		<see-also>
 			<ref type="function">REDIS</ref>
@@ -120,486 +214,9030 @@ ast_log(LOG_DEBUG, __VA_ARGS__);
 			<ref type="function">REDIS_EXISTS</ref>
 		</see-also>
 	</function>
+	<function name="REDIS_INCR" language="en_US">
+		<synopsis>
+			Atomically increment a counter and return its new value.
+		</synopsis>
+		<syntax>
+			<parameter name="key" required="true" />
+			<parameter name="increment" required="false">
+				<para>Defaults to <literal>1</literal>.</para>
+			</parameter>
+			<parameter name="ttl" required="false">
+				<para>Seconds until the counter expires, set when this call creates it.
+				Gives a fixed window limiter in one round trip. The increment and the
+				expiry are applied together by a short script, so a counter is never left
+				without its expiry.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>This function runs INCRBY and returns the new value. A key that
+			does not exist is treated as <literal>0</literal>.</para>
+			<para>Example: exten => s,n,GotoIf($[${REDIS_INCR(trunk:${TRUNK}:calls)} > 30]?busy)</para>
+		</description>
+		<see-also>
+			<ref type="function">REDIS_DECR</ref>
+			<ref type="function">REDIS_EXPIRE</ref>
+		</see-also>
+	</function>
+	<function name="REDIS_DECR" language="en_US">
+		<synopsis>
+			Atomically decrement a counter and return its new value.
+		</synopsis>
+		<syntax>
+			<parameter name="key" required="true" />
+			<parameter name="decrement" required="false">
+				<para>Defaults to <literal>1</literal>.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>This function runs DECRBY and returns the new value.</para>
+		</description>
+		<see-also>
+			<ref type="function">REDIS_INCR</ref>
+		</see-also>
+	</function>
+	<function name="REDIS_EXPIRE" language="en_US">
+		<synopsis>
+			Get or set the time to live of a key.
+		</synopsis>
+		<syntax>
+			<parameter name="key" required="true" />
+		</syntax>
+		<description>
+			<para>On a read, this function returns the seconds left before the key
+			expires, or <literal>-1</literal> if it never expires. A missing key sets
+			<variable>REDIS_STATUS</variable> to <literal>NOT_FOUND</literal>.</para>
+			<para>On a write, the key expires after the given number of seconds. An
+			empty value removes the expiry.</para>
+			<para>Example: exten => s,n,Set(REDIS_EXPIRE(session:${UNIQUEID})=3600)</para>
+		</description>
+		<see-also>
+			<ref type="function">REDIS_INCR</ref>
+		</see-also>
+	</function>
+	<function name="REDIS_XADD" language="en_US">
+		<synopsis>
+			Append an entry to a Redis stream.
+		</synopsis>
+		<syntax>
+			<parameter name="stream" required="true" />
+			<parameter name="maxlen" required="false">
+				<para>Trim the stream to about this many entries with
+				<literal>MAXLEN ~</literal>.</para>
+			</parameter>
+			<parameter name="options" required="false">
+				<para>Same as the <replaceable>options</replaceable> of
+				<literal>REDIS_PUBLISH</literal>.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>This function adds an entry to a stream, with the value written to it
+			as a comma separated list of up to 32 field/value pairs. Unlike a published message,
+			the entry stays in the stream for consumers that are not connected yet.</para>
+			<para>Async writes, with the <literal>a</literal> option or
+			<literal>async_writes</literal>, are pipelined together by the background
+			writer. A synchronous write sets <variable>REDIS_XADD_ID</variable> to the
+			id of the new entry.</para>
+			<para>Example: exten => h,1,Set(REDIS_XADD(calls,100000,a)=event,hangup,uniqueid,${UNIQUEID},cause,${HANGUPCAUSE})</para>
+		</description>
+		<see-also>
+			<ref type="function">REDIS_PUBLISH</ref>
+		</see-also>
+	</function>
+	<function name="REDIS_MGET" language="en_US">
+		<synopsis>
+			Read several keys from the Redis database in one round trip.
+		</synopsis>
+		<syntax>
+			<parameter name="key1" required="true" />
+			<parameter name="key2" multiple="true" required="false" />
+		</syntax>
+		<description>
+			<para>This function fetches up to 64 keys with a single MGET and sets
+			<variable>REDIS_RESULT_1</variable> to <variable>REDIS_RESULT_N</variable>
+			to their values, in the order given, leaving missing keys blank.
+			<variable>REDIS_RESULT_COUNT</variable> is set to the number of keys
+			requested. The function returns the number of keys that exist.</para>
+		</description>
+		<see-also>
+			<ref type="function">REDIS</ref>
+			<ref type="function">REDIS_HMGET</ref>
+		</see-also>
+	</function>
+	<function name="REDIS_HMGET" language="en_US">
+		<synopsis>
+			Read several fields of a hash from the Redis database in one round trip.
+		</synopsis>
+		<syntax>
+			<parameter name="key" required="true" />
+			<parameter name="field1" required="true" />
+			<parameter name="field2" multiple="true" required="false" />
+		</syntax>
+		<description>
+			<para>This function fetches up to 64 fields of a hash with a single HMGET
+			and sets the same variables as <literal>REDIS_MGET</literal>.</para>
+		</description>
+		<see-also>
+			<ref type="function">REDIS</ref>
+			<ref type="function">REDIS_MGET</ref>
+		</see-also>
+	</function>
+	<function name="REDIS_HGETALL" language="en_US">
+		<synopsis>
+			Read every field of a hash into channel variables in one round trip.
+		</synopsis>
+		<syntax>
+			<parameter name="key" required="true" />
+			<parameter name="prefix" required="false">
+				<para>Prepended to each field name to form its variable name. If
+				not given, <literal>HASH_</literal> is used; if given empty,
+				the variables are named after the fields.</para>
+			</parameter>
+			<parameter name="options" required="false">
+				<optionlist>
+					<option name="s">
+						<para>Iterate with <literal>HSCAN</literal> instead of a single
+						<literal>HGETALL</literal>, so a large hash doesn't block the
+						server, at the cost of a round trip per 100 fields.</para>
+					</option>
+				</optionlist>
+			</parameter>
+		</syntax>
+		<description>
+			<para>This function sets a variable for every field of the hash and returns
+			the number of fields. <variable>REDIS_STATUS</variable> is
+			<literal>NOT_FOUND</literal> if the hash doesn't exist.</para>
+			<para>Example: same => n,Set(FIELDS=${REDIS_HGETALL(sub:${CALLERID(num)},SUB_)})</para>
+		</description>
+		<see-also>
+			<ref type="function">REDIS_HMGET</ref>
+		</see-also>
+	</function>
+	<function name="REDIS_EVAL" language="en_US">
+		<synopsis>
+			Run a Lua script from the <literal>[scripts]</literal> section of func_redis.conf.
+		</synopsis>
+		<syntax>
+			<parameter name="script" required="true">
+				<para>Name of the script in func_redis.conf.</para>
+			</parameter>
+			<parameter name="numkeys" required="true">
+				<para>How many of the following arguments are keys.</para>
+			</parameter>
+			<parameter name="key1" multiple="true" required="false" />
+			<parameter name="arg1" multiple="true" required="false" />
+		</syntax>
+		<description>
+			<para>This function runs the script with EVALSHA, so only its SHA1 is sent.
+			If the server doesn't have the script, for example after a restart, it is
+			sent once with EVAL, which also caches it. The script runs atomically, so a
+			read-modify-write sequence takes a single round trip and can't race.</para>
+			<para>A string, number or status reply is returned as is. An array reply
+			sets <variable>REDIS_RESULT_1</variable> to <variable>REDIS_RESULT_N</variable>
+			and <variable>REDIS_RESULT_COUNT</variable>, and the function returns the
+			number of elements. With <literal>protocol=3</literal>, a map reply also sets
+			<variable>REDIS_FIELD_1</variable> to <variable>REDIS_FIELD_N</variable> to its
+			fields, and doubles and booleans are returned as numbers. <variable>REDIS_STATUS</variable> is set as for
+			<literal>REDIS</literal>.</para>
+			<para>Example: exten => s,n,Set(COUNT=${REDIS_EVAL(limit,1,calls:${TENANT},10)})</para>
+		</description>
+		<see-also>
+			<ref type="function">REDIS_FCALL</ref>
+		</see-also>
+	</function>
+	<function name="REDIS_FCALL" language="en_US">
+		<synopsis>
+			Call a function loaded on the Redis server (Redis 7 or later).
+		</synopsis>
+		<syntax>
+			<parameter name="function" required="true" />
+			<parameter name="numkeys" required="true" />
+			<parameter name="key1" multiple="true" required="false" />
+			<parameter name="arg1" multiple="true" required="false" />
+		</syntax>
+		<description>
+			<para>This function runs FCALL and returns its result like
+			<literal>REDIS_EVAL</literal>.</para>
+		</description>
+		<see-also>
+			<ref type="function">REDIS_EVAL</ref>
+		</see-also>
+	</function>
+	<function name="REDIS_BEGIN" language="en_US">
+		<synopsis>
+			Buffer the channel's writes until REDIS_COMMIT.
+		</synopsis>
+		<syntax>
+			<parameter name="options" required="false">
+				<optionlist>
+					<option name="p">
+						<para>Pipeline the writes on commit instead of wrapping them in
+						<literal>MULTI</literal> and <literal>EXEC</literal>.</para>
+					</option>
+				</optionlist>
+			</parameter>
+		</syntax>
+		<description>
+			<para>After REDIS_BEGIN, writes with <literal>REDIS</literal>,
+			<literal>REDIS_DELETE</literal>, <literal>REDIS_EXPIRE</literal>,
+			<literal>REDIS_PUBLISH</literal> and <literal>REDIS_XADD</literal> on this
+			channel are kept in the order they are made instead of being sent, and set
+			<variable>REDIS_STATUS</variable> to <literal>OK</literal> once buffered. Reads are
+			not affected and don't see the buffered writes. Writes that are never committed are
+			discarded when the channel goes away.</para>
+			<para>Example: exten => h,1,Set(REDIS_BEGIN()=)</para>
+		</description>
+		<see-also>
+			<ref type="function">REDIS_COMMIT</ref>
+		</see-also>
+	</function>
+	<function name="REDIS_COMMIT" language="en_US">
+		<synopsis>
+			Send the writes buffered since REDIS_BEGIN in one round trip.
+		</synopsis>
+		<syntax />
+		<description>
+			<para>This function sends the buffered writes as one <literal>MULTI</literal>/<literal>EXEC</literal>
+			transaction, so either all of them are applied or none, and returns how many succeeded.
+			A transaction must stay on one server: the keys of one profile, or in cluster mode
+			of one hash slot, which hash tags such as <literal>{call}:</literal> ensure. With the
+			<literal>p</literal> option of REDIS_BEGIN the writes are pipelined instead, split
+			by profile or node, without the all or nothing guarantee.</para>
+			<para><variable>REDIS_STATUS</variable> is <literal>OK</literal> only if every
+			write succeeded.</para>
+			<para>Example: exten => h,n,Set(WRITTEN=${REDIS_COMMIT()})</para>
+		</description>
+		<see-also>
+			<ref type="function">REDIS_BEGIN</ref>
+		</see-also>
+	</function>
+	<manager name="RedisStats" language="en_US">
+		<synopsis>
+			Show call counts and latencies of Redis commands.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+		</syntax>
+		<description>
+			<para>Sends one <literal>RedisStatsEntry</literal> event per command type with
+			its <literal>Count</literal>, <literal>Errors</literal>, <literal>Timeouts</literal>,
+			and <literal>P50</literal>, <literal>P99</literal> and <literal>Max</literal>
+			latencies in microseconds, followed by <literal>RedisStatsComplete</literal>.
+			Counters are cumulative since the module was loaded.</para>
+		</description>
+	</manager>
+	<manager name="RedisGet" language="en_US">
+		<synopsis>
+			Read a key or hash field, as REDIS() does.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Key" required="true">
+				<para>The key, with an optional <literal>profile:</literal>.</para>
+			</parameter>
+			<parameter name="Field">
+				<para>The hash field to read.</para>
+			</parameter>
+			<parameter name="Timeout">
+				<para>Milliseconds the call may take, as <variable>REDIS_TIMEOUT_MS</variable>.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Runs on the connections, cache and statistics of the dialplan functions.
+			The response has the <variable>REDIS_STATUS</variable> of the read as
+			<literal>Status</literal>, and the <literal>Value</literal> if it was found, with
+			backslashes, carriage returns and line feeds escaped as <literal>\\</literal>,
+			<literal>\r</literal> and <literal>\n</literal>. The action fails with the status
+			as its message if the read did not succeed.</para>
+		</description>
+		<see-also>
+			<ref type="function">REDIS</ref>
+		</see-also>
+	</manager>
+	<manager name="RedisSet" language="en_US">
+		<synopsis>
+			Write a key or hash field, as REDIS() does.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Key" required="true">
+				<para>The key, with an optional <literal>profile:</literal>.</para>
+			</parameter>
+			<parameter name="Field">
+				<para>The hash field to write.</para>
+			</parameter>
+			<parameter name="Value">
+				<para>The value, empty if not given.</para>
+			</parameter>
+			<parameter name="Options">
+				<para>The write options of REDIS(), such as <literal>e(3600)</literal> or
+				<literal>a</literal>.</para>
+			</parameter>
+			<parameter name="Timeout">
+				<para>Milliseconds the call may take, as <variable>REDIS_TIMEOUT_MS</variable>.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>The response has the <variable>REDIS_STATUS</variable> of the write as
+			<literal>Status</literal>, <literal>NOT_SET</literal> if a conditional write was
+			skipped.</para>
+		</description>
+		<see-also>
+			<ref type="function">REDIS</ref>
+		</see-also>
+	</manager>
+	<manager name="RedisMGet" language="en_US">
+		<synopsis>
+			Read several keys in one round trip, as REDIS_MGET() does.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Keys" required="true">
+				<para>Comma separated keys, at most 64, the profile of the first applying to all.
+				Only commas split the list; quotes and parentheses are part of the key.</para>
+			</parameter>
+			<parameter name="Timeout">
+				<para>Milliseconds the call may take, as <variable>REDIS_TIMEOUT_MS</variable>.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>Sends one <literal>RedisMGetEntry</literal> event per key, in the order
+			given, with its <literal>Key</literal> and <literal>Value</literal>, escaped as
+			by <literal>RedisGet</literal> and empty if the key was not found, followed by
+			<literal>RedisMGetComplete</literal> with the number of keys
+			<literal>Found</literal>.</para>
+		</description>
+		<see-also>
+			<ref type="function">REDIS_MGET</ref>
+		</see-also>
+	</manager>
+	<manager name="RedisPublish" language="en_US">
+		<synopsis>
+			Publish a message, as REDIS_PUBLISH() does.
+		</synopsis>
+		<syntax>
+			<xi:include xpointer="xpointer(/docs/manager[@name='Login']/syntax/parameter[@name='ActionID'])" />
+			<parameter name="Channel" required="true">
+				<para>The Redis channel to publish on.</para>
+			</parameter>
+			<parameter name="Message">
+				<para>The message, empty if not given.</para>
+			</parameter>
+			<parameter name="Options">
+				<para>The options of REDIS_PUBLISH(), <literal>a</literal> or
+				<literal>s</literal>.</para>
+			</parameter>
+			<parameter name="Timeout">
+				<para>Milliseconds the call may take, as <variable>REDIS_TIMEOUT_MS</variable>.</para>
+			</parameter>
+		</syntax>
+		<description>
+			<para>The response has the <variable>REDIS_STATUS</variable> as
+			<literal>Status</literal> and, unless the message was queued for the async
+			writer, the number of <literal>Receivers</literal>.</para>
+		</description>
+		<see-also>
+			<ref type="function">REDIS_PUBLISH</ref>
+		</see-also>
+	</manager>
+	<managerEvent language="en_US" name="RedisMessage">
+		<managerEventInstance class="EVENT_FLAG_USER">
+			<synopsis>Raised when a message arrives on a subscribed Redis channel.</synopsis>
+			<syntax>
+				<parameter name="Channel">
+					<para>The Redis channel the message was published on.</para>
+				</parameter>
+				<parameter name="Pattern">
+					<para>The <literal>psubscribe</literal> pattern it matched, empty for
+					<literal>subscribe</literal> channels.</para>
+				</parameter>
+				<parameter name="Message">
+					<para>The payload.</para>
+				</parameter>
+			</syntax>
+		</managerEventInstance>
+	</managerEvent>
  ***/
 
 #define REDIS_CONF "func_redis.conf"
 #define STR_CONF_SZ 256
+#define SUBSCRIBE_CONF_SZ 1024
+#define DEFAULT_POOL_SIZE 8
+#define DEFAULT_RECONNECT_MIN_MS 100
+#define DEFAULT_RECONNECT_MAX_MS 30000
+#define DEFAULT_KEEPALIVE 15
+#define DEFAULT_IDLE_PING_MS 30000
+#define DEFAULT_SENTINEL_PORT 26379
+#define MAX_SENTINELS 8
+/*! Most servers a pool spreads its connections over */
+#define MAX_POOL_ADDRS 16
+#define CLUSTER_SLOTS 16384
+#define MAX_CLUSTER_NODES 128
+/*! Most MOVED or ASK redirects followed for one command */
+#define CLUSTER_MAX_REDIRECTS 5
+#define DEFAULT_CACHE_SIZE 10000
+#define DEFAULT_CACHE_TTL_MS 30000
+#define DEFAULT_CACHE_NEGATIVE_TTL_MS 1000
+/*! How long the preload waits for the cache listener to subscribe */
+#define PRELOAD_WAIT_MS 10000
+#define CACHE_BUCKETS 1567
+#define REDIS_INVALIDATE_CHANNEL "__redis__:invalidate"
+#define DEFAULT_ASYNC_QUEUE_SIZE 10000
+/*! Most commands the async writer pipelines on a connection at once */
+#define ASYNC_BATCH_SIZE 256
+/*! Most keys or fields REDIS_MGET and REDIS_HMGET accept */
+#define MAX_BATCH_KEYS 64
+/*! Most writes a channel can buffer between REDIS_BEGIN and REDIS_COMMIT */
+#define MAX_BATCH_CMDS 1024
+/*! Scratch memory each thread parses replies into before falling back to the heap */
+#define REDIS_ARENA_SZ 8192
+/*! Initial size of a connection's command buffer, and the most it keeps between commands */
+#define REDIS_CMDBUF_SZ 512
+#define REDIS_CMDBUF_MAX 65536
+/*! Most arguments, including the command name, of a single command */
+#define REDIS_MAX_ARGS 128
+/*! Room in a command for keys with a prefix */
+#define REDIS_KEYBUF_SZ 4096
+/*! Most [profile] sections, each of which has its own pool */
+#define MAX_PROFILES 32
+/*! Smallest value compressed when compression is on, in bytes */
+#define DEFAULT_COMPRESS_THRESHOLD 1024
+/*! Header of a compressed value: magic, codec and the original length */
+#define REDIS_COMPRESS_MAGIC "\0RZ"
+#define REDIS_COMPRESS_HDR 8
+/*! Largest value compressed or decompressed, in bytes */
+#define REDIS_COMPRESS_MAX (16 * 1024 * 1024)
+/*! COUNT hint for SCAN and HSCAN, also the MGET batch size of redis show */
+#define SCAN_COUNT 100
+#define DEFAULT_SHOW_LIMIT 1000
+/*! Longest argument logged in full when debugging */
+#define LOG_ARG_MAX 64
+/*! Latency histogram buckets, the last one holds everything slower than about 18 minutes */
+#define STATS_BUCKETS 31
+/*! Keys redis bench spreads its calls over */
+#define BENCH_KEYS 1000
+#define BENCH_MAX_THREADS 64
+#define DEFAULT_BENCH_CALLS 10000
 
 AST_MUTEX_DEFINE_STATIC(redis_lock);
 
-redisContext * redis = NULL;
-redisReply * reply = NULL;
-
-static char hostname[STR_CONF_SZ] = "";
-static char database[STR_CONF_SZ] = "";
-static char password[STR_CONF_SZ] = "";
-static char bgsave[STR_CONF_SZ] = "";
-static int port = 6379;
-static struct timeval timeout;
+/*! \brief Address of one Redis server or sentinel */
+struct redis_addr {
+	char host[STR_CONF_SZ];
+	int port;
+};
 
-static int load_config(void)
-{
-	struct ast_config *config;
-	const char *conf_str;
-	struct ast_flags config_flags = { 0 };
+/*! \brief What a connection is opened with, besides its server */
+struct redis_conn_settings {
+	char database[STR_CONF_SZ];
+	char password[STR_CONF_SZ];
+	struct timeval connect_timeout;
+	struct timeval command_timeout;
+	int protocol;
+	/*! Bumped whenever the TLS settings change */
+	unsigned int tls_generation;
+};
 
-	config = ast_config_load(REDIS_CONF, config_flags);
+struct redis_pool;
 
-	if (config == CONFIG_STATUS_FILEMISSING || config == CONFIG_STATUS_FILEINVALID) {
-		ast_log(LOG_ERROR, "Unable to load config %s\n", REDIS_CONF);
-		return -1;
-	}
+/*! \brief A single connection to a Redis server, owned by a pool */
+struct redis_conn {
+	redisContext *ctx;
+	/*! Pool the connection is checked back in to */
+	struct redis_pool *pool;
+	/*! Server the connection is open to */
+	struct redis_addr addr;
+	/*! Pool generation this connection was opened for */
+	unsigned int generation;
+	/*! Client id of the invalidation listener this connection redirects tracking to, or 0 */
+	long long tracking_id;
+	/*! When the connection was last checked in, or opened */
+	struct timeval last_used;
+	/*! Timeout of each command, unless a dialplan deadline is closer */
+	struct timeval cmd_timeout;
+	/*! Set when a command ran out of its caller's deadline, which breaks the connection */
+	int deadline_hit;
+	/*! Commands are encoded here, reused from one command to the next */
+	char *cmdbuf;
+	size_t cmdbuf_size;
+	AST_LIST_ENTRY(redis_conn) list;
+};
 
-	ast_mutex_lock(&redis_lock);
+/*!
+ * \brief Pool of connections shared by the dialplan functions and CLI commands.
+ *
+ * A caller checks out a connection for the duration of one command (or a short
+ * sequence of commands), so the context and its replies are never shared between
+ * threads. Connections are opened lazily up to \ref pool_size, spread across
+ * the pool's servers in turn.
+ */
+struct redis_pool {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	/*! Connections ready to be checked out */
+	AST_LIST_HEAD_NOLOCK(, redis_conn) idle;
+	/*! Number of open connections, idle or checked out */
+	int total;
+	/*! Bumped on reload; connections of an older generation are closed on checkin */
+	unsigned int generation;
+	/*!
+	 * Set when the server is believed to be down. While open, checkouts fail
+	 * immediately instead of blocking on connect or command timeouts, and the
+	 * monitor thread keeps trying to reconnect in the background.
+	 */
+	int circuit_open;
+	/*! Delay before the next reconnect attempt, doubled after each failure */
+	int backoff_ms;
+	/*! When the monitor thread should next try to reconnect */
+	struct timeval next_attempt;
+	/*! Servers to connect to, none if the pool isn't in use */
+	struct redis_addr addrs[MAX_POOL_ADDRS];
+	int naddrs;
+	/*! Index into addrs of the server the next connection goes to */
+	unsigned int next_addr;
+	/*! Settings the connections of the current generation were opened with */
+	struct redis_conn_settings settings;
+	/*! The profile whose database the pool selects, NULL for [general] */
+	struct redis_profile *profile;
+	/*! Link in the cluster node list */
+	AST_LIST_ENTRY(redis_pool) list;
+};
 
-	if (!(conf_str = ast_variable_retrieve(config, "general", "hostname"))) {
-		ast_log(LOG_WARNING,
-				"No redis hostname, using localhost as default.\n");
-		conf_str =  "127.0.0.1";
-	}
+/*! \brief Connections to the master, used for writes and by default for reads */
+static struct redis_pool pool;
 
-	ast_copy_string(hostname, conf_str, sizeof(hostname));
+/*! \brief Connections to replicas, used for reads when read_from_replicas is set */
+static struct redis_pool replica_pool;
 
-	if (!(conf_str = ast_variable_retrieve(config, "general", "port"))) {
-		ast_log(LOG_WARNING,
-				"No redis port found, using 6379 as default.\n");
-		conf_str = "6379";
-	}
+/*!
+ * \brief How REDIS() writes compress values.
+ *
+ * The value is stored in the header of compressed values, so these must not
+ * be renumbered.
+ */
+enum redis_codec {
+	REDIS_CODEC_NONE = 0,
+	REDIS_CODEC_LZ4 = 1,
+	REDIS_CODEC_ZSTD = 2,
+};
 
-	port = atoi(conf_str);
-	
-	if (!(conf_str = ast_variable_retrieve(config, "general", "database"))) {
-		ast_log(LOG_WARNING,
-				"No redis database index found, using DB 0 as default.\n");
-		conf_str =  "0";
-	}
+static const char * const redis_codec_names[] = {
+	[REDIS_CODEC_NONE] = "no",
+	[REDIS_CODEC_LZ4] = "lz4",
+	[REDIS_CODEC_ZSTD] = "zstd",
+};
 
-	ast_copy_string(database, conf_str, sizeof(database));
+/*! The codec the z option uses when compression is off */
+#if defined(HAVE_LZ4)
+#define REDIS_CODEC_DEFAULT REDIS_CODEC_LZ4
+#elif defined(HAVE_ZSTD)
+#define REDIS_CODEC_DEFAULT REDIS_CODEC_ZSTD
+#else
+#define REDIS_CODEC_DEFAULT REDIS_CODEC_NONE
+#endif
 
-	if (!(conf_str = ast_variable_retrieve(config, "general", "password"))) {
-		ast_log(LOG_WARNING,
-				"No redis password found, disabling authentication.\n");
-		conf_str =  "";
-	}
+/*!
+ * \brief A [section] of func_redis.conf other than general and scripts.
+ *
+ * Keys given as REDIS(<profile>:<key>) go to the profile's database with its
+ * prefix prepended, on a pool of its own to the same master. Profiles that a
+ * reload removes are disabled rather than freed, so a pool found by a lookup
+ * stays valid; they are only freed on unload.
+ */
+struct redis_profile {
+	/*! Guarded by redis_lock, like database and prefix */
+	int enabled;
+	char database[STR_CONF_SZ];
+	char prefix[STR_CONF_SZ];
+	enum redis_codec compression;
+	int compress_threshold;
+	struct redis_pool pool;
+	AST_LIST_ENTRY(redis_profile) list;
+	char name[0];
+};
 
-	ast_copy_string(password, conf_str, sizeof(password));
+static AST_LIST_HEAD_NOLOCK_STATIC(profiles, redis_profile);
 
-	if (!(conf_str = ast_variable_retrieve(config, "general", "timeout"))) {
-		ast_log(LOG_WARNING,
-				"No redis timeout found, using 5 seconds as default.\n");
-		conf_str = "5";
-	}
+/*!
+ * \brief Slot map of a Redis Cluster.
+ *
+ * Each node gets its own pool. Node pools are created as CLUSTER SLOTS and
+ * redirects reveal them and are only freed on unload, so a pool read from
+ * the map stays valid after the lock is released.
+ */
+static struct {
+	ast_rwlock_t lock;
+	/*! Set in cluster mode, keys are then routed by slot */
+	int enabled;
+	/*! Set when a redirect or a node failure means the map is out of date */
+	int stale;
+	/*! Node serving each slot, NULL if unknown */
+	struct redis_pool *slots[CLUSTER_SLOTS];
+	AST_LIST_HEAD_NOLOCK(, redis_pool) nodes;
+} cluster;
 
-	timeout.tv_sec = atoi(conf_str);
+/*! \brief Background thread that restores the pools after a server goes away */
+static struct {
+	ast_mutex_t lock;
+	pthread_t thread;
+	ast_cond_t cond;
+	int stop;
+	/*! Set when a circuit opens or should be retried early */
+	int wakeup;
+} monitor = {
+	.thread = AST_PTHREADT_NULL,
+};
 
-	if (!(conf_str = ast_variable_retrieve(config, "general", "bgsave"))) {
-		ast_log(LOG_WARNING,
-				"No bgsave setting found, using default of false.\n");
-		conf_str =  "false";
-	}
+/*! \brief Listener for Sentinel failover events */
+static struct {
+	pthread_t thread;
+	int stop;
+} sentinel = {
+	.thread = AST_PTHREADT_NULL,
+};
 
-	ast_copy_string(bgsave, conf_str, sizeof(bgsave));
+/*! \brief Listener for the subscribe and psubscribe channels */
+static struct {
+	pthread_t thread;
+	int stop;
+	unsigned int messages;
+} subscriber = {
+	.thread = AST_PTHREADT_NULL,
+};
 
-	ast_config_destroy(config);
+/*! \brief Outcome of a dialplan function call, reported in REDIS_STATUS */
+enum redis_status {
+	REDIS_STATUS_OK,
+	REDIS_STATUS_NOT_FOUND,
+	REDIS_STATUS_ERROR,
+	REDIS_STATUS_UNAVAILABLE,
+	REDIS_STATUS_NOT_SET,
+	REDIS_STATUS_TIMEOUT,
+};
 
-	ast_verb(2, "Redis config loaded.\n");
+/*! \brief A cached GET or HGET result */
+struct redis_cache_entry {
+	/*! Points into data; NULL for plain keys */
+	const char *field;
+	/*! Points into data; NULL if the key or field was missing */
+	const char *value;
+	size_t value_len;
+	struct timeval expires;
+	AST_DLLIST_ENTRY(redis_cache_entry) lru;
+	/*! key, field and value, each NUL terminated */
+	char key[0];
+};
 
-	/* Done reloading. Release lock so others can now use driver. */
-	ast_mutex_unlock(&redis_lock);
+/*! \brief Search key for the cache container */
+struct redis_cache_key {
+	const char *key;
+	const char *field;
+};
 
-	return 1;
-}
+/*!
+ * \brief Local read-through cache for REDIS() reads.
+ *
+ * Entries are bounded by count and TTL. Pooled connections enable Redis
+ * client side caching with CLIENT TRACKING, redirecting invalidations to a
+ * dedicated listener connection, so writes from any client evict the local
+ * copy. Results are only cached from connections registered with the current
+ * listener, so a listener restart can never leave untracked entries behind.
+ */
+static struct {
+	ast_mutex_t lock;
+	struct ao2_container *entries;
+	/*! Least recently used entry last */
+	AST_DLLIST_HEAD_NOLOCK(, redis_cache_entry) lru;
+	/*! Client id of the invalidation listener, 0 while it is not subscribed */
+	long long tracking_id;
+	/*!
+	 * Bumped on every invalidation and local write. A result is only stored if
+	 * none happened while it was in flight, since that one may have been for it.
+	 */
+	unsigned int epoch;
+	pthread_t thread;
+	int stop;
+	unsigned int hits;
+	unsigned int misses;
+	unsigned int evictions;
+	unsigned int invalidations;
+} cache = {
+	.thread = AST_PTHREADT_NULL,
+};
 
-static int redis_connect(void)
+/*! \brief A GET or HGET one channel is running on behalf of every caller of the same key */
+struct redis_flight {
+	const struct redis_profile *profile;
+	/*! Points into data; NULL for plain keys */
+	const char *field;
+	int waiters;
+	int done;
+	/*! Set once the key is written, later reads start a flight of their own */
+	int stale;
+	enum redis_status status;
+	/*! Result for the waiters, allocated once the reply is in */
+	char *value;
+	size_t value_len;
+	AST_LIST_ENTRY(redis_flight) list;
+	/*! key and field, each NUL terminated */
+	char key[0];
+};
 
-{
-	if (redis) {
-		redisFree(redis);
-	}
-	ast_log(LOG_WARNING, "Connecting...\n");
-	redis = redisConnectWithTimeout(hostname, port, timeout);
+/*!
+ * \brief Reads currently waiting on the server.
+ *
+ * When a hot key is read by many channels at once, only the first one
+ * sends the command; the others wait for its reply instead of piling the
+ * same request onto the pool. The list is short, it only ever holds the
+ * reads that are in flight right now.
+ */
+static struct {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	AST_LIST_HEAD_NOLOCK(, redis_flight) list;
+	unsigned int coalesced;
+} flights;
 
-	if (redis == NULL || redis->err != 0) {
-		ast_log(LOG_ERROR,
-			"Couldn't establish connection. Reason: %s\n", redis->errstr);
-		return -1;
-	}
-	ast_log(LOG_WARNING, "Connected.\n");
+enum redis_preload_state {
+	PRELOAD_OFF,
+	PRELOAD_WAITING,
+	PRELOAD_RUNNING,
+	PRELOAD_DONE,
+	PRELOAD_FAILED,
+};
 
-	if (strlen(password) != 0) {
-		ast_log(LOG_WARNING,"Authenticating...\n");
-		reply = redisLoggedCommand(redis,"AUTH %s", password);
-		if (redis == NULL || redis->err != 0) {
-			ast_log(LOG_ERROR, "Unable to authenticate. Reason: %s\n", redis->errstr);
-			return -1;
-		}
-		ast_log(LOG_WARNING, "Authenticated.\n");
-		freeReplyObject(reply);
-	}
+static const char * const redis_preload_state_names[] = {
+	[PRELOAD_OFF] = "Off",
+	[PRELOAD_WAITING] = "Waiting for the cache listener",
+	[PRELOAD_RUNNING] = "Running",
+	[PRELOAD_DONE] = "Done",
+	[PRELOAD_FAILED] = "Failed",
+};
 
-	if (strlen(database) != 0) {
-		ast_log(LOG_WARNING,"Selecting DB %s\n", database);
-		reply = redisLoggedCommand(redis,"SELECT %s", database);
-		if (redis == NULL || redis->err != 0) {
-			ast_log(LOG_ERROR, "Unable to select DB %s. Reason: %s\n", database, redis->errstr);
-			return -1;
+/*!
+ * \brief Background warm-up of the local cache with the keys given by preload.
+ *
+ * Runs once the module is loaded, and after a reload that emptied the cache,
+ * so the first calls after a restart don't all miss at once.
+ */
+static struct {
+	/*! Guards everything but thread, which only load, reload and unload touch */
+	ast_mutex_t lock;
+	pthread_t thread;
+	int stop;
+	enum redis_preload_state state;
+	unsigned int keys;
+	unsigned int hashes;
+	struct timeval started;
+	struct timeval finished;
+} preload = {
+	.thread = AST_PTHREADT_NULL,
+};
+
+/*! \brief Commands with their own statistics, everything else is counted as OTHER */
+enum redis_stat {
+	REDIS_STAT_GET,
+	REDIS_STAT_HGET,
+	REDIS_STAT_SET,
+	REDIS_STAT_HSET,
+	REDIS_STAT_DEL,
+	REDIS_STAT_EXISTS,
+	REDIS_STAT_PUBLISH,
+	REDIS_STAT_MGET,
+	REDIS_STAT_HMGET,
+	REDIS_STAT_OTHER,
+	REDIS_STAT_MAX,
+};
+
+static const char * const redis_stat_names[] = {
+	[REDIS_STAT_GET] = "GET",
+	[REDIS_STAT_HGET] = "HGET",
+	[REDIS_STAT_SET] = "SET",
+	[REDIS_STAT_HSET] = "HSET",
+	[REDIS_STAT_DEL] = "DEL",
+	[REDIS_STAT_EXISTS] = "EXISTS",
+	[REDIS_STAT_PUBLISH] = "PUBLISH",
+	[REDIS_STAT_MGET] = "MGET",
+	[REDIS_STAT_HMGET] = "HMGET",
+	[REDIS_STAT_OTHER] = "OTHER",
+};
+
+/*!
+ * \brief Counters and latency histogram of one command type.
+ *
+ * Everything is updated with atomic operations so recording never takes a
+ * lock. Bucket n counts calls that took less than 2^n microseconds (and at
+ * least 2^(n-1)), so percentiles are accurate to within a factor of two.
+ */
+struct redis_cmd_stats {
+	int count;
+	int errors;
+	int timeouts;
+	int max_us;
+	int buckets[STATS_BUCKETS];
+};
+
+static struct redis_cmd_stats stats[REDIS_STAT_MAX];
+
+/*! \brief A write queued for the async writer, already in wire format */
+struct redis_async_cmd {
+	char *cmd;
+	int len;
+	enum redis_stat stat;
+	/*! Cluster slot of the key, -1 if the command isn't on a key */
+	int slot;
+	/*! Profile of the key, NULL for [general] */
+	struct redis_profile *profile;
+	/*! The key, evicted from the cache once the write is done; NULL if the command isn't on a key */
+	const char *key;
+	AST_LIST_ENTRY(redis_async_cmd) list;
+	char data[0];
+};
+
+/*! \brief Commands the async writer sends together */
+AST_LIST_HEAD_NOLOCK(redis_async_batch, redis_async_cmd);
+
+/*!
+ * \brief Fire-and-forget writer.
+ *
+ * Channel threads queue formatted commands and return immediately. The
+ * writer thread pipelines everything queued onto one pooled connection,
+ * so a burst of writes goes out in a single write() and the replies are
+ * only checked for errors.
+ */
+static struct {
+	ast_mutex_t lock;
+	ast_cond_t cond;
+	AST_LIST_HEAD_NOLOCK(, redis_async_cmd) queue;
+	int queued;
+	pthread_t thread;
+	int stop;
+	unsigned int written;
+	unsigned int errors;
+	unsigned int dropped;
+} async = {
+	.thread = AST_PTHREADT_NULL,
+};
+
+static const char * const redis_status_names[] = {
+	[REDIS_STATUS_OK] = "OK",
+	[REDIS_STATUS_NOT_FOUND] = "NOT_FOUND",
+	[REDIS_STATUS_ERROR] = "ERROR",
+	[REDIS_STATUS_UNAVAILABLE] = "UNAVAILABLE",
+	[REDIS_STATUS_NOT_SET] = "NOT_SET",
+	[REDIS_STATUS_TIMEOUT] = "TIMEOUT",
+};
+
+static char hostname[STR_CONF_SZ] = "";
+/*! Path of a local server's unix socket, used instead of hostname and port if set */
+static char unix_socket[STR_CONF_SZ] = "";
+static char database[STR_CONF_SZ] = "";
+static char password[STR_CONF_SZ] = "";
+static char bgsave[STR_CONF_SZ] = "";
+static int port = 6379;
+static int pool_size = DEFAULT_POOL_SIZE;
+static int reconnect_min_ms = DEFAULT_RECONNECT_MIN_MS;
+static int reconnect_max_ms = DEFAULT_RECONNECT_MAX_MS;
+/*! TCP keepalive interval in seconds, 0 to leave keepalive off */
+static int keepalive = DEFAULT_KEEPALIVE;
+/*! Idle pooled connections are sent a PING this often, 0 to never check them */
+static int idle_ping_ms = DEFAULT_IDLE_PING_MS;
+static struct timeval connect_timeout;
+static struct timeval command_timeout;
+static int cache_enabled;
+static int cache_size = DEFAULT_CACHE_SIZE;
+static int cache_ttl_ms = DEFAULT_CACHE_TTL_MS;
+/*! How long a missing key is remembered, 0 to not cache misses */
+static int cache_negative_ttl_ms = DEFAULT_CACHE_NEGATIVE_TTL_MS;
+static enum redis_codec compression;
+static int compress_threshold = DEFAULT_COMPRESS_THRESHOLD;
+static int async_writes;
+static int async_queue_size = DEFAULT_ASYNC_QUEUE_SIZE;
+static struct redis_addr sentinel_addrs[MAX_SENTINELS];
+static int sentinel_count;
+static char master_name[STR_CONF_SZ] = "";
+static char sentinel_password[STR_CONF_SZ] = "";
+static struct redis_addr replica_addrs[MAX_POOL_ADDRS];
+static int replica_count;
+static int read_from_replicas;
+static int cluster_mode;
+/*! RESP version negotiated with HELLO, 2 unless protocol=3 is set */
+static int protocol = 2;
+static struct redis_addr cluster_seeds[MAX_POOL_ADDRS];
+static int cluster_seed_count;
+
+/*! \brief TLS settings applied to every TCP connection */
+struct redis_tls_settings {
+	int enabled;
+	char ca[STR_CONF_SZ];
+	char cert[STR_CONF_SZ];
+	char key[STR_CONF_SZ];
+	char server_name[STR_CONF_SZ];
+};
+
+static struct redis_tls_settings tls_settings;
+static unsigned int tls_generation;
+
+#ifdef HAVE_HIREDIS_SSL
+/*! \brief A TLS context, shared by the connections opened while it is current */
+struct redis_tls {
+	redisSSLContext *ssl;
+};
+
+/*! Guarded by redis_lock, NULL if TLS is off or the context couldn't be created */
+static struct redis_tls *tls_context;
+
+static void redis_tls_destroy(void *obj)
+{
+	struct redis_tls *tls = obj;
+
+	if (tls->ssl) {
+		redisFreeSSLContext(tls->ssl);
+	}
+}
+#endif
+/*! Prepended to keys that aren't qualified with a profile */
+static char key_prefix[STR_CONF_SZ] = "";
+static char subscribe_channels[SUBSCRIBE_CONF_SZ] = "";
+static char subscribe_patterns[SUBSCRIBE_CONF_SZ] = "";
+static int subscribe_cache;
+/*! Comma separated key patterns loaded into the cache in the background at startup */
+static char preload_patterns[SUBSCRIBE_CONF_SZ] = "";
+
+/*! \brief A Lua script from the [scripts] section */
+struct redis_script {
+	/*! SHA1 of the source, which EVALSHA refers to it by */
+	char sha1[41];
+	char *source;
+	AST_LIST_ENTRY(redis_script) list;
+	char name[0];
+};
+
+/*! \brief Scripts by name, guarded by redis_lock and replaced on reload */
+static AST_LIST_HEAD_NOLOCK_STATIC(scripts, redis_script);
+
+static struct timeval ms_to_timeval(int ms)
+{
+	return ast_tv(ms / 1000, (ms % 1000) * 1000);
+}
+
+/*!
+ * \brief Read an optional positive integer setting (usually milliseconds) from the general section.
+ */
+static int load_config_ms(struct ast_config *config, const char *name, int def)
+{
+	const char *conf_str;
+	int ms;
+
+	if (!(conf_str = ast_variable_retrieve(config, "general", name))) {
+		return def;
+	}
+	if ((ms = atoi(conf_str)) < 1) {
+		ast_log(LOG_WARNING,
+				"Invalid %s '%s', using %d.\n", name, conf_str, def);
+		return def;
+	}
+	return ms;
+}
+
+/*!
+ * \brief Parse a comma separated list of host[:port] into addrs.
+ *
+ * \return the number of addresses parsed, at most max
+ */
+static int redis_parse_addrs(const char *list, struct redis_addr *addrs, int max, int default_port)
+{
+	char *parse = ast_strdupa(list);
+	char *item;
+	char *colon;
+	int count = 0;
+
+	while ((item = strsep(&parse, ",")) && count < max) {
+		item = ast_strip(item);
+		if (ast_strlen_zero(item)) {
+			continue;
+		}
+		addrs[count].port = default_port;
+		if ((colon = strrchr(item, ':'))) {
+			*colon++ = '\0';
+			if ((addrs[count].port = atoi(colon)) < 1) {
+				ast_log(LOG_WARNING, "Invalid port in '%s:%s', skipping.\n", item, colon);
+				continue;
+			}
+		}
+		ast_copy_string(addrs[count].host, item, sizeof(addrs[count].host));
+		count++;
+	}
+
+	return count;
+}
+
+static void redis_script_free(struct redis_script *script)
+{
+	ast_free(script->source);
+	ast_free(script);
+}
+
+/*!
+ * \brief Load the [scripts] section.
+ *
+ * Each entry is name = source, or name = /path/to/script.lua to read the
+ * source from a file.
+ */
+static void load_config_scripts(struct ast_config *config)
+{
+	AST_LIST_HEAD_NOLOCK(, redis_script) loaded = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+	struct redis_script *script;
+	struct ast_variable *var;
+	char *source;
+
+	for (var = ast_variable_browse(config, "scripts"); var; var = var->next) {
+		if (var->value[0] == '/') {
+			if (!(source = ast_read_textfile(var->value))) {
+				ast_log(LOG_WARNING, "Unable to read script %s from %s, skipping.\n", var->name, var->value);
+				continue;
+			}
+		} else if (!(source = ast_strdup(var->value))) {
+			continue;
+		}
+		if (!(script = ast_calloc(1, sizeof(*script) + strlen(var->name) + 1))) {
+			ast_free(source);
+			continue;
+		}
+		strcpy(script->name, var->name);
+		script->source = source;
+		ast_sha1_hash(script->sha1, source);
+		AST_LIST_INSERT_TAIL(&loaded, script, list);
+	}
+
+	while ((script = AST_LIST_REMOVE_HEAD(&scripts, list))) {
+		redis_script_free(script);
+	}
+	AST_LIST_APPEND_LIST(&scripts, &loaded, list);
+}
+
+static void redis_pool_init(struct redis_pool *p)
+{
+	ast_mutex_init(&p->lock);
+	ast_cond_init(&p->cond, NULL);
+	AST_LIST_HEAD_INIT_NOLOCK(&p->idle);
+}
+
+static int redis_codec_available(enum redis_codec codec)
+{
+	switch (codec) {
+	case REDIS_CODEC_NONE:
+		return 1;
+#ifdef HAVE_LZ4
+	case REDIS_CODEC_LZ4:
+		return 1;
+#endif
+#ifdef HAVE_ZSTD
+	case REDIS_CODEC_ZSTD:
+		return 1;
+#endif
+	default:
+		return 0;
+	}
+}
+
+/*!
+ * \brief Read compression and compress_threshold of a section.
+ *
+ * \param codec and threshold hold the defaults, and are set to the values read
+ */
+static void load_config_compression(struct ast_config *config, const char *category,
+	enum redis_codec *codec, int *threshold)
+{
+	const char *conf_str;
+	int i;
+
+	if ((conf_str = ast_variable_retrieve(config, category, "compression"))) {
+		for (i = 0; i < ARRAY_LEN(redis_codec_names); i++) {
+			if (!strcasecmp(conf_str, redis_codec_names[i])) {
+				break;
+			}
+		}
+		if (ast_false(conf_str)) {
+			i = REDIS_CODEC_NONE;
+		}
+		if (i == ARRAY_LEN(redis_codec_names)) {
+			ast_log(LOG_WARNING, "Invalid compression '%s' in [%s], not compressing.\n", conf_str, category);
+			i = REDIS_CODEC_NONE;
+		} else if (!redis_codec_available(i)) {
+			ast_log(LOG_WARNING, "compression=%s in [%s] needs func_redis built against %s, not compressing.\n",
+				conf_str, category, redis_codec_names[i]);
+			i = REDIS_CODEC_NONE;
+		}
+		*codec = i;
+	}
+
+	if ((conf_str = ast_variable_retrieve(config, category, "compress_threshold"))) {
+		if (sscanf(conf_str, "%30d", &i) == 1 && i >= 0) {
+			*threshold = i;
+		} else {
+			ast_log(LOG_WARNING, "Invalid compress_threshold '%s' in [%s], using %d.\n",
+				conf_str, category, *threshold);
+		}
+	}
+}
+
+/*!
+ * \brief Load the profile sections, updating the profiles that already exist.
+ *
+ * \note Called with redis_lock held, after database and compression are loaded
+ */
+static void load_config_profiles(struct ast_config *config)
+{
+	struct redis_profile *profile;
+	const char *category = NULL;
+	const char *conf_str;
+	int count = 0;
+
+	AST_LIST_TRAVERSE(&profiles, profile, list) {
+		profile->enabled = 0;
+	}
+
+	while ((category = ast_category_browse(config, category))) {
+		if (!strcasecmp(category, "general") || !strcasecmp(category, "scripts")) {
+			continue;
+		}
+		AST_LIST_TRAVERSE(&profiles, profile, list) {
+			if (!strcmp(profile->name, category)) {
+				break;
+			}
+			count++;
+		}
+		if (!profile) {
+			if (count >= MAX_PROFILES) {
+				ast_log(LOG_WARNING, "Too many profiles, ignoring [%s].\n", category);
+				continue;
+			}
+			if (!(profile = ast_calloc(1, sizeof(*profile) + strlen(category) + 1))) {
+				continue;
+			}
+			strcpy(profile->name, category);
+			redis_pool_init(&profile->pool);
+			profile->pool.profile = profile;
+			AST_LIST_INSERT_TAIL(&profiles, profile, list);
+		}
+		count = 0;
+		profile->enabled = 1;
+
+		if (!(conf_str = ast_variable_retrieve(config, category, "database"))) {
+			conf_str = database;
+		}
+		ast_copy_string(profile->database, conf_str, sizeof(profile->database));
+		if (!(conf_str = ast_variable_retrieve(config, category, "prefix"))) {
+			conf_str = "";
+		}
+		ast_copy_string(profile->prefix, conf_str, sizeof(profile->prefix));
+
+		profile->compression = compression;
+		profile->compress_threshold = compress_threshold;
+		load_config_compression(config, category, &profile->compression, &profile->compress_threshold);
+	}
+}
+
+static int redis_tls_settings_equal(const struct redis_tls_settings *a, const struct redis_tls_settings *b)
+{
+	return a->enabled == b->enabled && !strcmp(a->ca, b->ca) && !strcmp(a->cert, b->cert)
+		&& !strcmp(a->key, b->key) && !strcmp(a->server_name, b->server_name);
+}
+
+/*!
+ * \brief Read the TLS settings, and set up a new context if they changed.
+ *
+ * Connections already open keep the context they were opened with, a changed
+ * tls_generation has the pools replace them.
+ *
+ * \note Called with redis_lock held
+ */
+static void load_config_tls(struct ast_config *config)
+{
+	struct redis_tls_settings next = { 0, };
+	const char *conf_str;
+#ifdef HAVE_HIREDIS_SSL
+	redisSSLContextError error = REDIS_SSL_CTX_NONE;
+	struct redis_tls *tls = NULL;
+#endif
+
+	next.enabled = (conf_str = ast_variable_retrieve(config, "general", "tls")) && ast_true(conf_str);
+	if ((conf_str = ast_variable_retrieve(config, "general", "tls_ca"))) {
+		ast_copy_string(next.ca, conf_str, sizeof(next.ca));
+	}
+	if ((conf_str = ast_variable_retrieve(config, "general", "tls_cert"))) {
+		ast_copy_string(next.cert, conf_str, sizeof(next.cert));
+	}
+	if ((conf_str = ast_variable_retrieve(config, "general", "tls_key"))) {
+		ast_copy_string(next.key, conf_str, sizeof(next.key));
+	}
+	if ((conf_str = ast_variable_retrieve(config, "general", "tls_server_name"))) {
+		ast_copy_string(next.server_name, conf_str, sizeof(next.server_name));
+	}
+
+	if (tls_generation && redis_tls_settings_equal(&next, &tls_settings)) {
+		return;
+	}
+	tls_settings = next;
+	tls_generation++;
+
+#ifdef HAVE_HIREDIS_SSL
+	/* OpenSSL itself is initialized by Asterisk, so redisInitOpenSSL() isn't needed */
+	if (next.enabled && (tls = ao2_alloc_options(sizeof(*tls), redis_tls_destroy, AO2_ALLOC_OPT_LOCK_NOLOCK))
+		&& !(tls->ssl = redisCreateSSLContext(S_OR(next.ca, NULL), NULL, S_OR(next.cert, NULL),
+			S_OR(next.key, NULL), S_OR(next.server_name, NULL), &error))) {
+		ast_log(LOG_ERROR, "Unable to set up TLS, connections will fail. Reason: %s\n",
+			redisSSLContextGetError(error));
+		ao2_ref(tls, -1);
+		tls = NULL;
+	}
+	ao2_cleanup(tls_context);
+	tls_context = tls;
+#else
+	if (next.enabled) {
+		ast_log(LOG_ERROR, "tls=yes needs func_redis built against hiredis_ssl, connections will fail.\n");
+	}
+#endif
+}
+
+static int load_config(void)
+{
+	struct ast_config *config;
+	const char *conf_str;
+	struct ast_flags config_flags = { 0 };
+
+	config = ast_config_load(REDIS_CONF, config_flags);
+
+	if (config == CONFIG_STATUS_FILEMISSING || config == CONFIG_STATUS_FILEINVALID) {
+		ast_log(LOG_ERROR, "Unable to load config %s\n", REDIS_CONF);
+		return -1;
+	}
+
+	ast_mutex_lock(&redis_lock);
+
+	if (!(conf_str = ast_variable_retrieve(config, "general", "hostname"))) {
+		ast_log(LOG_WARNING,
+				"No redis hostname, using localhost as default.\n");
+		conf_str =  "127.0.0.1";
+	}
+
+	ast_copy_string(hostname, conf_str, sizeof(hostname));
+
+	if (!(conf_str = ast_variable_retrieve(config, "general", "port"))) {
+		ast_log(LOG_WARNING,
+				"No redis port found, using 6379 as default.\n");
+		conf_str = "6379";
+	}
+
+	port = atoi(conf_str);
+
+	if (!(conf_str = ast_variable_retrieve(config, "general", "socket"))) {
+		conf_str = "";
+	}
+	ast_copy_string(unix_socket, conf_str, sizeof(unix_socket));
+
+	load_config_tls(config);
+	
+	if (!(conf_str = ast_variable_retrieve(config, "general", "database"))) {
+		ast_log(LOG_WARNING,
+				"No redis database index found, using DB 0 as default.\n");
+		conf_str =  "0";
+	}
+
+	ast_copy_string(database, conf_str, sizeof(database));
+
+	if (!(conf_str = ast_variable_retrieve(config, "general", "password"))) {
+		ast_log(LOG_WARNING,
+				"No redis password found, disabling authentication.\n");
+		conf_str =  "";
+	}
+
+	ast_copy_string(password, conf_str, sizeof(password));
+
+	if (!(conf_str = ast_variable_retrieve(config, "general", "timeout"))) {
+		ast_log(LOG_WARNING,
+				"No redis timeout found, using 5 seconds as default.\n");
+		conf_str = "5";
+	}
+
+	/* The legacy timeout (in seconds) is the default for both connect and command timeouts */
+	connect_timeout = ms_to_timeval(load_config_ms(config, "connect_timeout", atoi(conf_str) * 1000));
+	command_timeout = ms_to_timeval(load_config_ms(config, "command_timeout", atoi(conf_str) * 1000));
+
+	keepalive = DEFAULT_KEEPALIVE;
+	if ((conf_str = ast_variable_retrieve(config, "general", "keepalive"))
+		&& (keepalive = atoi(conf_str)) < 0) {
+		ast_log(LOG_WARNING,
+				"Invalid keepalive '%s', using %d.\n", conf_str, DEFAULT_KEEPALIVE);
+		keepalive = DEFAULT_KEEPALIVE;
+	}
+
+	idle_ping_ms = DEFAULT_IDLE_PING_MS;
+	if ((conf_str = ast_variable_retrieve(config, "general", "idle_ping"))
+		&& (idle_ping_ms = atoi(conf_str)) < 0) {
+		ast_log(LOG_WARNING,
+				"Invalid idle_ping '%s', using %d.\n", conf_str, DEFAULT_IDLE_PING_MS);
+		idle_ping_ms = DEFAULT_IDLE_PING_MS;
+	}
+
+	if (!(conf_str = ast_variable_retrieve(config, "general", "bgsave"))) {
+		ast_log(LOG_WARNING,
+				"No bgsave setting found, using default of false.\n");
+		conf_str =  "false";
+	}
+
+	ast_copy_string(bgsave, conf_str, sizeof(bgsave));
+
+	pool_size = DEFAULT_POOL_SIZE;
+	if ((conf_str = ast_variable_retrieve(config, "general", "pool_size"))
+		&& (pool_size = atoi(conf_str)) < 1) {
+		ast_log(LOG_WARNING,
+				"Invalid pool_size '%s', using %d.\n", conf_str, DEFAULT_POOL_SIZE);
+		pool_size = DEFAULT_POOL_SIZE;
+	}
+
+	cache_enabled = (conf_str = ast_variable_retrieve(config, "general", "cache")) && ast_true(conf_str);
+	cache_size = load_config_ms(config, "cache_size", DEFAULT_CACHE_SIZE);
+	cache_ttl_ms = load_config_ms(config, "cache_ttl", DEFAULT_CACHE_TTL_MS);
+
+	cache_negative_ttl_ms = DEFAULT_CACHE_NEGATIVE_TTL_MS;
+	if ((conf_str = ast_variable_retrieve(config, "general", "cache_negative_ttl"))
+		&& (cache_negative_ttl_ms = atoi(conf_str)) < 0) {
+		ast_log(LOG_WARNING,
+				"Invalid cache_negative_ttl '%s', using %d.\n", conf_str, DEFAULT_CACHE_NEGATIVE_TTL_MS);
+		cache_negative_ttl_ms = DEFAULT_CACHE_NEGATIVE_TTL_MS;
+	}
+
+	compression = REDIS_CODEC_NONE;
+	compress_threshold = DEFAULT_COMPRESS_THRESHOLD;
+	load_config_compression(config, "general", &compression, &compress_threshold);
+
+	protocol = 2;
+	if ((conf_str = ast_variable_retrieve(config, "general", "protocol"))) {
+		if (!strcmp(conf_str, "3")) {
+#ifdef REDIS_REPLY_PUSH
+			protocol = 3;
+#else
+			ast_log(LOG_WARNING, "protocol=3 needs hiredis 1.0 or later, using RESP2.\n");
+#endif
+		} else if (strcmp(conf_str, "2")) {
+			ast_log(LOG_WARNING, "Invalid protocol '%s', using 2.\n", conf_str);
+		}
+	}
+
+	async_writes = (conf_str = ast_variable_retrieve(config, "general", "async_writes")) && ast_true(conf_str);
+	async_queue_size = load_config_ms(config, "async_queue_size", DEFAULT_ASYNC_QUEUE_SIZE);
+
+	sentinel_count = 0;
+	if ((conf_str = ast_variable_retrieve(config, "general", "sentinels"))) {
+		sentinel_count = redis_parse_addrs(conf_str, sentinel_addrs, MAX_SENTINELS, DEFAULT_SENTINEL_PORT);
+	}
+	if (!(conf_str = ast_variable_retrieve(config, "general", "master_name"))) {
+		conf_str = "mymaster";
+	}
+	ast_copy_string(master_name, conf_str, sizeof(master_name));
+	if (!(conf_str = ast_variable_retrieve(config, "general", "sentinel_password"))) {
+		conf_str = "";
+	}
+	ast_copy_string(sentinel_password, conf_str, sizeof(sentinel_password));
+
+	replica_count = 0;
+	if ((conf_str = ast_variable_retrieve(config, "general", "replicas"))) {
+		replica_count = redis_parse_addrs(conf_str, replica_addrs, MAX_POOL_ADDRS, 6379);
+	}
+	read_from_replicas = (conf_str = ast_variable_retrieve(config, "general", "read_from_replicas"))
+		&& ast_true(conf_str);
+	if (read_from_replicas && !replica_count && !sentinel_count) {
+		ast_log(LOG_WARNING, "read_from_replicas needs replicas or sentinels, reading from the master.\n");
+	}
+
+	cluster_mode = (conf_str = ast_variable_retrieve(config, "general", "cluster")) && ast_true(conf_str);
+	cluster_seed_count = 0;
+	if ((conf_str = ast_variable_retrieve(config, "general", "cluster_nodes"))) {
+		cluster_seed_count = redis_parse_addrs(conf_str, cluster_seeds, MAX_POOL_ADDRS, 6379);
+	}
+	if (cluster_mode) {
+		if (sentinel_count) {
+			ast_log(LOG_WARNING, "Sentinel isn't used with a cluster, ignoring sentinels.\n");
+			sentinel_count = 0;
+		}
+		if (cache_enabled) {
+			ast_log(LOG_WARNING, "The local cache isn't supported with a cluster, disabling it.\n");
+			cache_enabled = 0;
+		}
+		if (read_from_replicas) {
+			ast_log(LOG_WARNING, "read_from_replicas isn't supported with a cluster, reading from masters.\n");
+			read_from_replicas = 0;
+		}
+		if (strcmp(database, "0")) {
+			ast_log(LOG_WARNING, "A cluster only has database 0, ignoring database %s.\n", database);
+			ast_copy_string(database, "0", sizeof(database));
+		}
+	}
+	if (!ast_strlen_zero(unix_socket) && (cluster_mode || sentinel_count)) {
+		ast_log(LOG_WARNING, "socket is only used for a single server, connecting over TCP.\n");
+		unix_socket[0] = '\0';
+	}
+
+	if (!(conf_str = ast_variable_retrieve(config, "general", "preload"))) {
+		conf_str = "";
+	}
+	ast_copy_string(preload_patterns, conf_str, sizeof(preload_patterns));
+	if (!ast_strlen_zero(preload_patterns) && !cache_enabled) {
+		ast_log(LOG_WARNING, "preload needs cache=yes, nothing will be preloaded.\n");
+	}
+
+	if (!(conf_str = ast_variable_retrieve(config, "general", "subscribe"))) {
+		conf_str = "";
+	}
+	ast_copy_string(subscribe_channels, conf_str, sizeof(subscribe_channels));
+	if (!(conf_str = ast_variable_retrieve(config, "general", "psubscribe"))) {
+		conf_str = "";
+	}
+	ast_copy_string(subscribe_patterns, conf_str, sizeof(subscribe_patterns));
+	subscribe_cache = (conf_str = ast_variable_retrieve(config, "general", "subscribe_cache"))
+		&& ast_true(conf_str);
+	if (subscribe_cache && !cache_enabled) {
+		ast_log(LOG_WARNING, "subscribe_cache needs cache=yes, messages won't update the cache.\n");
+	}
+
+	if (!(conf_str = ast_variable_retrieve(config, "general", "prefix"))) {
+		conf_str = "";
+	}
+	ast_copy_string(key_prefix, conf_str, sizeof(key_prefix));
+
+	load_config_profiles(config);
+	if (cluster_mode) {
+		struct redis_profile *profile;
+
+		AST_LIST_TRAVERSE(&profiles, profile, list) {
+			if (profile->enabled && strcmp(profile->database, "0")) {
+				ast_log(LOG_WARNING, "A cluster only has database 0, profile %s only uses its prefix.\n",
+					profile->name);
+			}
+		}
+	}
+
+	load_config_scripts(config);
+
+	reconnect_min_ms = load_config_ms(config, "reconnect_min", DEFAULT_RECONNECT_MIN_MS);
+	reconnect_max_ms = load_config_ms(config, "reconnect_max", DEFAULT_RECONNECT_MAX_MS);
+	if (reconnect_max_ms < reconnect_min_ms) {
+		reconnect_max_ms = reconnect_min_ms;
+	}
+
+	ast_config_destroy(config);
+
+	ast_verb(2, "Redis config loaded.\n");
+
+	/* Done reloading. Release lock so others can now use driver. */
+	ast_mutex_unlock(&redis_lock);
+
+	return 1;
+}
+
+/*!
+ * \brief Arguments of one command, sent with redisCommandArgv.
+ *
+ * Each argument keeps its length, so hiredis never parses a format string
+ * and values are binary safe.
+ */
+struct redis_args {
+	int argc;
+	const char *argv[REDIS_MAX_ARGS];
+	size_t argvlen[REDIS_MAX_ARGS];
+	/*! Prefixed keys, which argv points into */
+	char keybuf[REDIS_KEYBUF_SZ];
+	size_t keybuf_len;
+};
+
+static int redis_args_add(struct redis_args *args, const char *arg, size_t len)
+{
+	if (args->argc >= REDIS_MAX_ARGS) {
+		return -1;
+	}
+	args->argv[args->argc] = arg;
+	args->argvlen[args->argc] = len;
+	args->argc++;
+	return 0;
+}
+
+static int redis_args_addstr(struct redis_args *args, const char *arg)
+{
+	return redis_args_add(args, arg, strlen(arg));
+}
+
+/*!
+ * \brief Start a command from a NULL terminated list of string arguments.
+ */
+static void __attribute__((sentinel)) redis_args_init(struct redis_args *args, ...)
+{
+	const char *arg;
+	va_list ap;
+
+	args->argc = 0;
+	args->keybuf_len = 0;
+	va_start(ap, args);
+	while ((arg = va_arg(ap, const char *))) {
+		redis_args_addstr(args, arg);
+	}
+	va_end(ap);
+}
+
+/*!
+ * \brief The settings a call applies to its keys and writes.
+ *
+ * A reload may rewrite them at any time. A call copies them once, with
+ * redis_profile_find() or redis_keyspace_general(), instead of taking
+ * redis_lock for every key it adds and every write it makes.
+ */
+struct redis_keyspace {
+	/*! NULL for [general] */
+	struct redis_profile *profile;
+	char prefix[STR_CONF_SZ];
+	size_t prefix_len;
+	enum redis_codec compression;
+	int compress_threshold;
+	int async_writes;
+};
+
+/*! \brief Copy the settings of a profile, or of [general] if NULL. Called with redis_lock held. */
+static void redis_keyspace_copy(struct redis_keyspace *space, struct redis_profile *profile)
+{
+	space->profile = profile;
+	ast_copy_string(space->prefix, profile ? profile->prefix : key_prefix, sizeof(space->prefix));
+	space->prefix_len = strlen(space->prefix);
+	space->compression = profile ? profile->compression : compression;
+	space->compress_threshold = profile ? profile->compress_threshold : compress_threshold;
+	space->async_writes = async_writes;
+}
+
+/*! \brief Copy the settings of [general], for keys without a profile qualifier */
+static void redis_keyspace_general(struct redis_keyspace *space)
+{
+	ast_mutex_lock(&redis_lock);
+	redis_keyspace_copy(space, NULL);
+	ast_mutex_unlock(&redis_lock);
+}
+
+/*!
+ * \brief Take the profile qualifier off a key from the dialplan.
+ *
+ * \param key advanced past "<profile>:" if it names an enabled profile
+ * \param space set to the settings of the profile, for the rest of the call
+ *
+ * \return the profile, or NULL for [general]
+ */
+static struct redis_profile *redis_profile_find(const char **key, struct redis_keyspace *space)
+{
+	struct redis_profile *profile;
+	size_t len;
+
+	ast_mutex_lock(&redis_lock);
+	AST_LIST_TRAVERSE(&profiles, profile, list) {
+		len = strlen(profile->name);
+		if (profile->enabled && !strncmp(*key, profile->name, len) && (*key)[len] == ':') {
+			*key += len + 1;
+			break;
+		}
+	}
+	redis_keyspace_copy(space, profile);
+	ast_mutex_unlock(&redis_lock);
+
+	return profile;
+}
+
+/*!
+ * \brief Add a key with the prefix of its profile.
+ *
+ * A prefixed key is assembled in the command's own buffer rather than
+ * allocated, and a key without a prefix is referenced as is.
+ *
+ * \retval 0 added
+ * \retval -1 too many arguments, or the keys don't fit in the buffer
+ */
+static int redis_args_addkey(struct redis_args *args, const struct redis_keyspace *space, const char *key)
+{
+	size_t key_len = strlen(key);
+	char *dst;
+
+	if (!space->prefix_len) {
+		return redis_args_add(args, key, key_len);
+	}
+	if (args->keybuf_len + space->prefix_len + key_len + 1 > sizeof(args->keybuf)) {
+		ast_log(LOG_WARNING, "REDIS: Keys too long for one command, dropping %s\n", key);
+		return -1;
+	}
+	dst = args->keybuf + args->keybuf_len;
+	memcpy(dst, space->prefix, space->prefix_len);
+	memcpy(dst + space->prefix_len, key, key_len + 1);
+	args->keybuf_len += space->prefix_len + key_len + 1;
+
+	return redis_args_add(args, dst, space->prefix_len + key_len);
+}
+
+/*! \brief Start a command on a key, see redis_args_addkey() */
+static int redis_args_init_key(struct redis_args *args, const char *command,
+	const struct redis_keyspace *space, const char *key)
+{
+	redis_args_init(args, command, NULL);
+	return redis_args_addkey(args, space, key);
+}
+
+/*! \brief Whether an argument is a credential that must not reach the log */
+static int redis_arg_is_secret(const struct redis_args *args, int i)
+{
+	/* AUTH [username] password */
+	if (args->argvlen[0] == 4 && !strncasecmp(args->argv[0], "AUTH", 4)) {
+		return 1;
+	}
+	/* HELLO protover AUTH username password */
+	if (args->argvlen[0] == 5 && !strncasecmp(args->argv[0], "HELLO", 5)) {
+		return (i >= 3 && args->argvlen[i - 1] == 4 && !strncasecmp(args->argv[i - 1], "AUTH", 4))
+			|| (i >= 4 && args->argvlen[i - 2] == 4 && !strncasecmp(args->argv[i - 2], "AUTH", 4));
+	}
+	return 0;
+}
+
+/*!
+ * \brief Log a command at debug level 1.
+ *
+ * Nothing is formatted unless debug is on for this module, so the hot path
+ * only pays for one comparison. Passwords are masked and long values are cut
+ * short.
+ */
+static void redis_log_args(const char *prefix, const struct redis_args *args)
+{
+	struct ast_str *line;
+	int i;
+
+	if (!DEBUG_ATLEAST(1)) {
+		return;
+	}
+
+	if (!(line = ast_str_create(128))) {
+		return;
+	}
+	for (i = 0; i < args->argc; i++) {
+		if (i && redis_arg_is_secret(args, i)) {
+			ast_str_append(&line, 0, " ********");
+		} else if (args->argvlen[i] > LOG_ARG_MAX) {
+			ast_str_append(&line, 0, "%s%.*s...(%zu bytes)", i ? " " : "", LOG_ARG_MAX, args->argv[i],
+				args->argvlen[i]);
+		} else {
+			ast_str_append(&line, 0, "%s%.*s", i ? " " : "", (int) args->argvlen[i], args->argv[i]);
+		}
+	}
+	ast_log(LOG_DEBUG, "%s%s\n", prefix, ast_str_buffer(line));
+	ast_free(line);
+}
+
+/*! \brief Find which statistics a command is counted under */
+static enum redis_stat redis_stat_lookup(const struct redis_args *args)
+{
+	int i;
+
+	for (i = 0; i < REDIS_STAT_OTHER; i++) {
+		if (args->argvlen[0] == strlen(redis_stat_names[i])
+			&& !strncasecmp(args->argv[0], redis_stat_names[i], args->argvlen[0])) {
+			return i;
+		}
+	}
+	return REDIS_STAT_OTHER;
+}
+
+/*! \brief Whether the last failure on a connection was the command timeout expiring */
+static int redis_conn_timed_out(const redisContext *ctx)
+{
+#ifdef REDIS_ERR_TIMEOUT
+	if (ctx->err == REDIS_ERR_TIMEOUT) {
+		return 1;
+	}
+#endif
+	return ctx->err == REDIS_ERR_IO && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/*!
+ * \brief Count one call and its latency.
+ *
+ * \param start when the call began
+ */
+static void redis_stats_add(struct redis_cmd_stats *s, struct timeval start)
+{
+	int64_t elapsed = ast_tvdiff_us(ast_tvnow(), start);
+	int us = elapsed > INT_MAX ? INT_MAX : elapsed < 0 ? 0 : elapsed;
+	int bucket = 0;
+	int old;
+
+	while (bucket < STATS_BUCKETS - 1 && (us >> bucket)) {
+		bucket++;
+	}
+
+	ast_atomic_fetchadd_int(&s->count, 1);
+	ast_atomic_fetchadd_int(&s->buckets[bucket], 1);
+
+	old = s->max_us;
+	while (us > old && !__sync_bool_compare_and_swap(&s->max_us, old, us)) {
+		old = s->max_us;
+	}
+}
+
+/*!
+ * \brief Record one call.
+ *
+ * \param reply the reply, NULL if the connection failed
+ * \param start when the command was sent
+ */
+static void redis_stats_record(enum redis_stat stat, const redisContext *ctx, const redisReply *reply,
+	struct timeval start)
+{
+	struct redis_cmd_stats *s = &stats[stat];
+
+	redis_stats_add(s, start);
+	if (!reply) {
+		if (redis_conn_timed_out(ctx)) {
+			ast_atomic_fetchadd_int(&s->timeouts, 1);
+		} else {
+			ast_atomic_fetchadd_int(&s->errors, 1);
+		}
+	} else if (reply->type == REDIS_REPLY_ERROR) {
+		ast_atomic_fetchadd_int(&s->errors, 1);
+	}
+}
+
+/*!
+ * \brief Latency below which a given share of the recorded calls completed.
+ *
+ * \return the upper bound of the matching histogram bucket, in microseconds
+ */
+static int redis_stats_percentile(const int *buckets, int percent)
+{
+	long long total = 0;
+	long long seen = 0;
+	long long target;
+	int i;
+
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		total += buckets[i];
+	}
+	if (!total) {
+		return 0;
+	}
+
+	target = (total * percent + 99) / 100;
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		seen += buckets[i];
+		if (seen >= target) {
+			break;
+		}
+	}
+	return i >= STATS_BUCKETS - 1 ? INT_MAX : (1 << i) - 1;
+}
+
+/*! \brief A consistent enough copy of one command's statistics for reporting */
+struct redis_stats_snapshot {
+	int count;
+	int errors;
+	int timeouts;
+	int p50_us;
+	int p99_us;
+	int max_us;
+};
+
+static void redis_stats_snapshot(enum redis_stat stat, struct redis_stats_snapshot *snap)
+{
+	struct redis_cmd_stats *s = &stats[stat];
+	int buckets[STATS_BUCKETS];
+	int i;
+
+	for (i = 0; i < STATS_BUCKETS; i++) {
+		buckets[i] = ast_atomic_fetchadd_int(&s->buckets[i], 0);
+	}
+	snap->count = ast_atomic_fetchadd_int(&s->count, 0);
+	snap->errors = ast_atomic_fetchadd_int(&s->errors, 0);
+	snap->timeouts = ast_atomic_fetchadd_int(&s->timeouts, 0);
+	snap->max_us = ast_atomic_fetchadd_int(&s->max_us, 0);
+	snap->p50_us = redis_stats_percentile(buckets, 50);
+	snap->p99_us = redis_stats_percentile(buckets, 99);
+}
+
+/*!
+ * \brief Time budget of the dialplan function running on this thread.
+ *
+ * Set from REDIS_TIMEOUT_MS for the duration of one function call. Waiting
+ * for a pooled connection, and each command, are cut short when it runs out.
+ */
+struct redis_deadline {
+	struct timeval expires;
+	int active;
+};
+
+AST_THREADSTORAGE(redis_deadline_storage);
+
+static void redis_deadline_begin(struct ast_channel *chan)
+{
+	struct redis_deadline *deadline;
+	const char *value;
+	int ms = 0;
+
+	if (!(deadline = ast_threadstorage_get(&redis_deadline_storage, sizeof(*deadline)))) {
+		return;
+	}
+	deadline->active = 0;
+	if (!chan) {
+		return;
+	}
+
+	ast_channel_lock(chan);
+	if ((value = pbx_builtin_getvar_helper(chan, "REDIS_TIMEOUT_MS"))) {
+		ms = atoi(value);
+	}
+	ast_channel_unlock(chan);
+
+	if (ms > 0) {
+		deadline->expires = ast_tvadd(ast_tvnow(), ms_to_timeval(ms));
+		deadline->active = 1;
+	}
+}
+
+static void redis_deadline_end(void)
+{
+	struct redis_deadline *deadline;
+
+	if ((deadline = ast_threadstorage_get(&redis_deadline_storage, sizeof(*deadline)))) {
+		deadline->active = 0;
+	}
+}
+
+/*!
+ * \retval 1 the current call has a deadline, stored in expires
+ * \retval 0 no deadline
+ */
+static int redis_deadline_get(struct timeval *expires)
+{
+	struct redis_deadline *deadline;
+
+	if (!(deadline = ast_threadstorage_get(&redis_deadline_storage, sizeof(*deadline)))
+		|| !deadline->active) {
+		return 0;
+	}
+	*expires = deadline->expires;
+
+	return 1;
+}
+
+static int redis_deadline_expired(void)
+{
+	struct timeval expires;
+
+	return redis_deadline_get(&expires) && ast_tvcmp(ast_tvnow(), expires) >= 0;
+}
+
+/*!
+ * \brief Shorten a timeout to what is left of the current call's deadline.
+ *
+ * \retval 1 the timeout was shortened
+ * \retval 0 the call has no deadline, or more time than the timeout
+ */
+static int redis_deadline_clamp(struct timeval *timeout)
+{
+	struct timeval expires;
+	struct timeval left;
+
+	if (!redis_deadline_get(&expires)) {
+		return 0;
+	}
+	left = ast_tvsub(expires, ast_tvnow());
+	if (left.tv_sec < 0 || (!left.tv_sec && left.tv_usec < 1000)) {
+		left = ast_tv(0, 1000);
+	}
+	if (ast_tvcmp(left, *timeout) >= 0) {
+		return 0;
+	}
+	*timeout = left;
+
+	return 1;
+}
+
+/*!
+ * \brief Scratch memory replies are parsed into.
+ *
+ * Every command a thread sends has its reply built here rather than with
+ * one malloc per object. The arena is rewound once all of the replies in it
+ * are freed, which for the usual one command at a time is right after each
+ * command, so a steady stream of GETs and SETs allocates nothing. Anything
+ * that doesn't fit, and the rest of the replies read until the next rewind,
+ * goes to the heap as hiredis would have allocated it.
+ *
+ * \note A reply must be freed with redis_reply_free() on the thread that read it.
+ */
+struct redis_arena {
+	size_t used;
+	/*! Replies whose root is in the arena and which haven't been freed yet */
+	int live;
+	/*! Set once an allocation didn't fit, until the next rewind */
+	int full;
+	long long buf[REDIS_ARENA_SZ / sizeof(long long)];
+};
+
+AST_THREADSTORAGE(redis_arena_storage);
+
+static int redis_arena_owns(const struct redis_arena *arena, const void *ptr)
+{
+	return arena && (const char *) ptr >= (const char *) arena->buf
+		&& (const char *) ptr < (const char *) arena->buf + sizeof(arena->buf);
+}
+
+static void *redis_arena_alloc(struct redis_arena *arena, size_t size)
+{
+	void *ptr;
+	size_t aligned = (size + sizeof(long long) - 1) & ~(sizeof(long long) - 1);
+
+	if (!arena->full && aligned <= sizeof(arena->buf) - arena->used) {
+		ptr = (char *) arena->buf + arena->used;
+		arena->used += aligned;
+		memset(ptr, 0, size);
+		return ptr;
+	}
+	arena->full = 1;
+
+	/* Freed by freeReplyObject() once the arena is rewound, so it has to come from libc */
+	return ast_std_calloc(1, size);
+}
+
+/*! \brief Free whatever parts of a reply are on the heap */
+static void redis_arena_free_tree(struct redis_arena *arena, redisReply *reply)
+{
+	size_t i;
+
+	if (reply->element) {
+		for (i = 0; i < reply->elements; i++) {
+			if (reply->element[i]) {
+				redis_arena_free_tree(arena, reply->element[i]);
+			}
+		}
+		if (!redis_arena_owns(arena, reply->element)) {
+			ast_std_free(reply->element);
+		}
+	}
+	if (reply->str && !redis_arena_owns(arena, reply->str)) {
+		ast_std_free(reply->str);
+	}
+	if (!redis_arena_owns(arena, reply)) {
+		ast_std_free(reply);
+	}
+}
+
+/*!
+ * \brief Free a reply, wherever it was allocated.
+ */
+static void redis_reply_free(void *obj)
+{
+	struct redis_arena *arena = ast_threadstorage_get(&redis_arena_storage, sizeof(*arena));
+	redisReply *reply = obj;
+
+	if (!reply) {
+		return;
+	}
+	if (!redis_arena_owns(arena, reply)) {
+		freeReplyObject(reply);
+		return;
+	}
+	redis_arena_free_tree(arena, reply);
+	if (!--arena->live) {
+		arena->used = 0;
+		arena->full = 0;
+	}
+}
+
+static redisReply *redis_arena_reply(const redisReadTask *task, struct redis_arena **arena)
+{
+	redisReply *reply;
+
+	if (!(*arena = ast_threadstorage_get(&redis_arena_storage, sizeof(**arena)))
+		|| !(reply = redis_arena_alloc(*arena, sizeof(*reply)))) {
+		return NULL;
+	}
+	reply->type = task->type;
+
+	return reply;
+}
+
+/*! \brief Hook a finished object into its parent, and count it if it is a root in the arena */
+static void *redis_arena_link(const redisReadTask *task, struct redis_arena *arena, redisReply *reply)
+{
+	if (task->parent) {
+		((redisReply *) task->parent->obj)->element[task->idx] = reply;
+	} else if (redis_arena_owns(arena, reply)) {
+		arena->live++;
+	}
+
+	return reply;
+}
+
+/*! \brief Drop an object that couldn't be completed, before it is linked anywhere */
+static void *redis_arena_discard(struct redis_arena *arena, redisReply *reply)
+{
+	if (!redis_arena_owns(arena, reply)) {
+		ast_std_free(reply);
+	}
+
+	return NULL;
+}
+
+static void *redis_arena_string(const redisReadTask *task, char *str, size_t len)
+{
+	struct redis_arena *arena;
+	redisReply *reply;
+
+	if (!(reply = redis_arena_reply(task, &arena))) {
+		return NULL;
+	}
+#ifdef REDIS_REPLY_VERB
+	/* Verbatim strings start with their three letter format and a colon */
+	if (task->type == REDIS_REPLY_VERB && len >= 4) {
+		memcpy(reply->vtype, str, 3);
+		str += 4;
+		len -= 4;
+	}
+#endif
+	if (!(reply->str = redis_arena_alloc(arena, len + 1))) {
+		return redis_arena_discard(arena, reply);
+	}
+	memcpy(reply->str, str, len);
+	reply->len = len;
+
+	return redis_arena_link(task, arena, reply);
+}
+
+#ifdef REDIS_REPLY_PUSH
+static void *redis_arena_array(const redisReadTask *task, size_t elements)
+#else
+static void *redis_arena_array(const redisReadTask *task, int elements)
+#endif
+{
+	struct redis_arena *arena;
+	redisReply *reply;
+
+	if (!(reply = redis_arena_reply(task, &arena))) {
+		return NULL;
+	}
+	if (elements > 0 && !(reply->element = redis_arena_alloc(arena, elements * sizeof(*reply->element)))) {
+		return redis_arena_discard(arena, reply);
+	}
+	reply->elements = elements;
+
+	return redis_arena_link(task, arena, reply);
+}
+
+static void *redis_arena_integer(const redisReadTask *task, long long value)
+{
+	struct redis_arena *arena;
+	redisReply *reply;
+
+	if (!(reply = redis_arena_reply(task, &arena))) {
+		return NULL;
+	}
+	reply->integer = value;
+
+	return redis_arena_link(task, arena, reply);
+}
+
+static void *redis_arena_nil(const redisReadTask *task)
+{
+	struct redis_arena *arena;
+	redisReply *reply;
+
+	if (!(reply = redis_arena_reply(task, &arena))) {
+		return NULL;
+	}
+
+	return redis_arena_link(task, arena, reply);
+}
+
+#ifdef REDIS_REPLY_PUSH
+static void *redis_arena_double(const redisReadTask *task, double value, char *str, size_t len)
+{
+	struct redis_arena *arena;
+	redisReply *reply;
+
+	if (!(reply = redis_arena_reply(task, &arena))) {
+		return NULL;
+	}
+	if (!(reply->str = redis_arena_alloc(arena, len + 1))) {
+		return redis_arena_discard(arena, reply);
+	}
+	memcpy(reply->str, str, len);
+	reply->len = len;
+	reply->dval = value;
+
+	return redis_arena_link(task, arena, reply);
+}
+
+static void *redis_arena_bool(const redisReadTask *task, int value)
+{
+	struct redis_arena *arena;
+	redisReply *reply;
+
+	if (!(reply = redis_arena_reply(task, &arena))) {
+		return NULL;
+	}
+	reply->integer = value != 0;
+
+	return redis_arena_link(task, arena, reply);
+}
+
+/*! \brief Pushes that nobody waits for, such as stray invalidations, are dropped */
+static void redis_push_discard(void *privdata, void *reply)
+{
+	redis_reply_free(reply);
+}
+#endif
+
+static redisReplyObjectFunctions redis_arena_functions = {
+	.createString = redis_arena_string,
+	.createArray = redis_arena_array,
+	.createInteger = redis_arena_integer,
+#ifdef REDIS_REPLY_PUSH
+	.createDouble = redis_arena_double,
+	.createBool = redis_arena_bool,
+#endif
+	.createNil = redis_arena_nil,
+	.freeObject = redis_reply_free,
+};
+
+/*!
+ * \brief Queue a command on a connection, encoded in the connection's own buffer.
+ *
+ * hiredis would format every command into a freshly allocated string; the buffer
+ * here is kept for the next command instead, unless a large value grew it.
+ */
+static int redis_conn_append(struct redis_conn *conn, const struct redis_args *args)
+{
+	size_t need = 16;
+	size_t size;
+	char *buf;
+	char *p;
+	int res;
+	int i;
+
+	for (i = 0; i < args->argc; i++) {
+		need += args->argvlen[i] + 32;
+	}
+	if (need > conn->cmdbuf_size) {
+		for (size = REDIS_CMDBUF_SZ; size < need; size *= 2) {
+		}
+		if (!(buf = ast_realloc(conn->cmdbuf, size))) {
+			return redisAppendCommandArgv(conn->ctx, args->argc, (const char **) args->argv, args->argvlen);
+		}
+		conn->cmdbuf = buf;
+		conn->cmdbuf_size = size;
+	}
+
+	p = conn->cmdbuf + sprintf(conn->cmdbuf, "*%d\r\n", args->argc);
+	for (i = 0; i < args->argc; i++) {
+		p += sprintf(p, "$%zu\r\n", args->argvlen[i]);
+		memcpy(p, args->argv[i], args->argvlen[i]);
+		p += args->argvlen[i];
+		*p++ = '\r';
+		*p++ = '\n';
+	}
+	res = redisAppendFormattedCommand(conn->ctx, conn->cmdbuf, p - conn->cmdbuf);
+
+	if (conn->cmdbuf_size > REDIS_CMDBUF_MAX) {
+		ast_free(conn->cmdbuf);
+		conn->cmdbuf = NULL;
+		conn->cmdbuf_size = 0;
+	}
+
+	return res;
+}
+
+/*!
+ * \brief Read the next reply of a pooled connection into the thread's reply arena.
+ */
+static int redis_conn_get_reply(struct redis_conn *conn, redisReply **reply)
+{
+	redisReader *reader = conn->ctx->reader;
+	redisReplyObjectFunctions *fn = reader->fn;
+	struct timeval expires;
+	struct timeval limit;
+	int bounded = 0;
+	int res;
+
+	*reply = NULL;
+	if (redis_deadline_get(&expires)) {
+		limit = ast_tvsub(expires, ast_tvnow());
+		if (limit.tv_sec < 0 || (!limit.tv_sec && limit.tv_usec < 1000)) {
+			/* Already out of time, still send it rather than leave it queued */
+			limit = ast_tv(0, 1000);
+		}
+		bounded = ast_tvcmp(limit, conn->cmd_timeout) < 0 && redisSetTimeout(conn->ctx, limit) == REDIS_OK;
+	}
+
+	reader->fn = &redis_arena_functions;
+	res = redisGetReply(conn->ctx, (void **) reply);
+	if (bounded) {
+		if (conn->ctx->err) {
+			conn->deadline_hit = redis_conn_timed_out(conn->ctx);
+		} else {
+			redisSetTimeout(conn->ctx, conn->cmd_timeout);
+		}
+	}
+	/*
+	 * After an error the reader may still hold part of a reply built in the
+	 * arena, which it frees with these functions when the context is closed.
+	 */
+	if (!conn->ctx->err) {
+		reader->fn = fn;
+	}
+
+	return res;
+}
+
+/*!
+ * \brief Run a command on a checked out connection and log it.
+ *
+ * \return the reply, to be freed by the caller, or NULL on a transport error
+ */
+static redisReply *redis_logged_command(struct redis_conn *conn, const struct redis_args *args)
+{
+	redisReply *reply = NULL;
+	struct timeval start = ast_tvnow();
+
+	if (redis_conn_append(conn, args) != REDIS_OK || redis_conn_get_reply(conn, &reply) != REDIS_OK) {
+		redis_reply_free(reply);
+		reply = NULL;
+	}
+	redis_stats_record(redis_stat_lookup(args), conn->ctx, reply, start);
+	redis_log_args("", args);
+
+	return reply;
+}
+
+/*!
+ * \brief Send several commands in one write and read all of their replies.
+ *
+ * \param replies receives one reply per command, NULL for any that weren't read
+ *
+ * \retval 0 every reply was read, though some may be error replies
+ * \retval -1 the connection failed
+ */
+static int redis_logged_pipeline(struct redis_conn *conn, const struct redis_args *cmds, int count,
+	redisReply **replies)
+{
+	struct timeval start = ast_tvnow();
+	int res = 0;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		replies[i] = NULL;
+		redis_conn_append(conn, &cmds[i]);
+		redis_log_args("Pipelined: ", &cmds[i]);
+	}
+	/* Each command is charged with the time the pipeline took up to its reply */
+	for (i = 0; i < count; i++) {
+		if (!res && redis_conn_get_reply(conn, &replies[i]) != REDIS_OK) {
+			res = -1;
+		}
+		redis_stats_record(redis_stat_lookup(&cmds[i]), conn->ctx, replies[i], start);
+	}
+
+	return res;
+}
+
+/*! \brief Where a dialplan read puts its result: a fixed buffer or a dynamic string */
+struct redis_output {
+	char *buf;
+	size_t len;
+	struct ast_str **str;
+	ssize_t maxlen;
+};
+
+/*!
+ * \brief Copy a value into the read result, never past the space available.
+ */
+static void redis_output_set(struct redis_output *out, const char *value, size_t value_len)
+{
+	size_t n;
+
+	if (out->str) {
+		ast_str_set_substr(out->str, out->maxlen, value, value_len);
+		return;
+	}
+	if (!out->len) {
+		return;
+	}
+	n = MIN(value_len, out->len - 1);
+	memcpy(out->buf, value, n);
+	out->buf[n] = '\0';
+}
+
+static const char *redis_output_buffer(struct redis_output *out)
+{
+	return out->str ? ast_str_buffer(*out->str) : out->buf;
+}
+
+AST_THREADSTORAGE(redis_compress_storage);
+AST_THREADSTORAGE(redis_decompress_storage);
+AST_THREADSTORAGE(redis_mget_storage);
+
+/*!
+ * \brief Pick the codec of a REDIS() write.
+ *
+ * \param force the z option was given
+ * \param threshold set to the smallest value worth compressing
+ */
+static enum redis_codec redis_codec_get(const struct redis_keyspace *space, int force, int *threshold)
+{
+	enum redis_codec codec = space->compression;
+
+	*threshold = space->compress_threshold;
+	if (codec == REDIS_CODEC_NONE && force) {
+		codec = REDIS_CODEC_DEFAULT;
+	}
+
+	return codec;
+}
+
+/*!
+ * \brief Compress a value about to be written.
+ *
+ * A compressed value starts with REDIS_COMPRESS_MAGIC, whose NUL no dialplan
+ * value can start with, then the codec and the original length, big endian.
+ * Values that don't get smaller are written as they are.
+ *
+ * \param value set to the compressed value, in a buffer of the calling thread
+ *
+ * \retval 0 compressed
+ * \retval -1 left as is
+ */
+static int redis_value_compress(enum redis_codec codec, const char **value, size_t *len)
+{
+	struct ast_str *buf;
+	unsigned char *dst;
+	size_t bound;
+	size_t n = 0;
+
+	if (*len > REDIS_COMPRESS_MAX) {
+		return -1;
+	}
+	switch (codec) {
+#ifdef HAVE_LZ4
+	case REDIS_CODEC_LZ4:
+		bound = LZ4_compressBound(*len);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case REDIS_CODEC_ZSTD:
+		bound = ZSTD_compressBound(*len);
+		break;
+#endif
+	default:
+		return -1;
+	}
+	if (!(buf = ast_str_thread_get(&redis_compress_storage, REDIS_CMDBUF_SZ))
+		|| ast_str_make_space(&buf, REDIS_COMPRESS_HDR + bound)) {
+		return -1;
+	}
+	dst = (unsigned char *) ast_str_buffer(buf);
+
+	switch (codec) {
+#ifdef HAVE_LZ4
+	case REDIS_CODEC_LZ4:
+		n = LZ4_compress_default(*value, (char *) dst + REDIS_COMPRESS_HDR, *len, bound);
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case REDIS_CODEC_ZSTD:
+		n = ZSTD_compress(dst + REDIS_COMPRESS_HDR, bound, *value, *len, ZSTD_CLEVEL_DEFAULT);
+		if (ZSTD_isError(n)) {
+			n = 0;
+		}
+		break;
+#endif
+	default:
+		break;
+	}
+	if (!n || REDIS_COMPRESS_HDR + n >= *len) {
+		return -1;
+	}
+
+	memcpy(dst, REDIS_COMPRESS_MAGIC, 3);
+	dst[3] = codec;
+	dst[4] = *len >> 24;
+	dst[5] = *len >> 16;
+	dst[6] = *len >> 8;
+	dst[7] = *len;
+	*value = (const char *) dst;
+	*len = REDIS_COMPRESS_HDR + n;
+
+	return 0;
+}
+
+/*!
+ * \brief Undo redis_value_compress() on a value read.
+ *
+ * Values without the header are left as they are, whatever the compression
+ * setting, so it can be changed without rewriting the keys.
+ *
+ * \param value set to the decompressed value, NUL terminated in a buffer of
+ *        the calling thread that the next call reuses
+ *
+ * \retval 0 not compressed, or decompressed
+ * \retval -1 corrupt, or compressed with a codec func_redis isn't built with
+ */
+static int redis_value_decompress(const char **value, size_t *len)
+{
+	const unsigned char *hdr = (const unsigned char *) *value;
+	struct ast_str *buf;
+	size_t orig;
+	size_t n = 0;
+	char *dst;
+
+	if (*len < REDIS_COMPRESS_HDR || memcmp(*value, REDIS_COMPRESS_MAGIC, 3)) {
+		return 0;
+	}
+	orig = ((size_t) hdr[4] << 24) | ((size_t) hdr[5] << 16) | ((size_t) hdr[6] << 8) | hdr[7];
+	if (orig > REDIS_COMPRESS_MAX || !(buf = ast_str_thread_get(&redis_decompress_storage, REDIS_CMDBUF_SZ))
+		|| ast_str_make_space(&buf, orig + 1)) {
+		return -1;
+	}
+	dst = ast_str_buffer(buf);
+
+	switch (hdr[3]) {
+#ifdef HAVE_LZ4
+	case REDIS_CODEC_LZ4:
+		if (LZ4_decompress_safe(*value + REDIS_COMPRESS_HDR, dst, *len - REDIS_COMPRESS_HDR, orig) == (int) orig) {
+			n = orig;
+		}
+		break;
+#endif
+#ifdef HAVE_ZSTD
+	case REDIS_CODEC_ZSTD:
+		n = ZSTD_decompress(dst, orig, *value + REDIS_COMPRESS_HDR, *len - REDIS_COMPRESS_HDR);
+		if (ZSTD_isError(n)) {
+			n = 0;
+		}
+		break;
+#endif
+	default:
+		break;
+	}
+	if (!n || n != orig) {
+		return -1;
+	}
+
+	dst[n] = '\0';
+	ast_str_update(buf);
+	*value = dst;
+	*len = n;
+
+	return 0;
+}
+
+/*! \brief Get the value of a string reply, decompressed, see redis_value_decompress() */
+static int redis_reply_value(const redisReply *reply, const char **value, size_t *len)
+{
+	*value = reply->str;
+	*len = reply->len;
+
+	return redis_value_decompress(value, len);
+}
+
+static void redis_conn_close(struct redis_conn *conn)
+{
+	if (conn->ctx) {
+		redisFree(conn->ctx);
+	}
+	ast_free(conn->cmdbuf);
+	ast_free(conn);
+}
+
+/*!
+ * \brief Whether a reply is an array, or under RESP3 a push, which is how
+ * pub/sub messages and subscription confirmations arrive.
+ */
+static int redis_reply_is_array(const redisReply *reply)
+{
+#ifdef REDIS_REPLY_PUSH
+	if (reply->type == REDIS_REPLY_PUSH) {
+		return 1;
+	}
+#endif
+	return reply->type == REDIS_REPLY_ARRAY;
+}
+
+/*!
+ * \brief Format a scalar reply, under either protocol.
+ *
+ * \retval 0 the value was copied to buf
+ * \retval -1 the reply is nil, an error or an aggregate
+ */
+static int redis_reply_scalar(const redisReply *reply, char *buf, size_t len)
+{
+	switch (reply->type) {
+	case REDIS_REPLY_STRING:
+	case REDIS_REPLY_STATUS:
+#ifdef REDIS_REPLY_PUSH
+	case REDIS_REPLY_DOUBLE:
+	case REDIS_REPLY_BIGNUM:
+	case REDIS_REPLY_VERB:
+#endif
+		ast_copy_string(buf, reply->str ? reply->str : "", len);
+		return 0;
+	case REDIS_REPLY_INTEGER:
+#ifdef REDIS_REPLY_PUSH
+	case REDIS_REPLY_BOOL:
+#endif
+		snprintf(buf, len, "%lld", reply->integer);
+		return 0;
+	default:
+		return -1;
+	}
+}
+
+/*!
+ * \brief Set a channel variable to a scalar reply, or blank for nil and aggregates.
+ */
+static void redis_reply_setvar(struct ast_channel *chan, const char *var, const redisReply *reply)
+{
+	char num[32];
+
+	if (reply->type == REDIS_REPLY_INTEGER
+#ifdef REDIS_REPLY_PUSH
+		|| reply->type == REDIS_REPLY_BOOL
+#endif
+		) {
+		snprintf(num, sizeof(num), "%lld", reply->integer);
+		pbx_builtin_setvar_helper(chan, var, num);
+	} else if (reply->type != REDIS_REPLY_ERROR) {
+		/* Strings, statuses, and under RESP3 doubles, big numbers and verbatim strings */
+		pbx_builtin_setvar_helper(chan, var, reply->str ? reply->str : "");
+	} else {
+		pbx_builtin_setvar_helper(chan, var, "");
+	}
+}
+
+/*!
+ * \brief Let pushes on a listener connection through to redisGetReply.
+ *
+ * hiredis frees push replies by default, which under RESP3 would swallow
+ * every message and subscription confirmation.
+ */
+static void redis_conn_keep_pushes(struct redis_conn *conn)
+{
+#ifdef REDIS_REPLY_PUSH
+	redisSetPushCallback(conn->ctx, NULL);
+#endif
+}
+
+/*!
+ * \brief Wait for the next reply on a connection that isn't sending commands.
+ *
+ * Used by listener connections so they can notice a shutdown request
+ * without the command timeout breaking the context.
+ *
+ * \retval 1 a reply was read
+ * \retval 0 nothing arrived within timeout_ms
+ * \retval -1 the connection failed
+ */
+static int redis_conn_wait_reply(struct redis_conn *conn, int timeout_ms, redisReply **reply)
+{
+	struct pollfd pfd = { .fd = conn->ctx->fd, .events = POLLIN, };
+	void *r = NULL;
+
+	*reply = NULL;
+
+	/* A previous read may have buffered more than one reply */
+	if (redisGetReplyFromReader(conn->ctx, &r) != REDIS_OK) {
+		return -1;
+	}
+	if (!r) {
+		if (poll(&pfd, 1, timeout_ms) <= 0) {
+			return 0;
+		}
+		if (redisBufferRead(conn->ctx) != REDIS_OK
+			|| redisGetReplyFromReader(conn->ctx, &r) != REDIS_OK) {
+			return -1;
+		}
+		if (!r) {
+			return 0;
+		}
+	}
+	*reply = r;
+	return 1;
+}
+
+/*!
+ * \brief Start TLS on a new TCP connection if tls is enabled.
+ *
+ * \retval 0 TLS is up or not configured
+ * \retval -1 the handshake failed, or TLS is enabled but unavailable
+ */
+static int redis_conn_start_tls(struct redis_conn *conn)
+{
+#ifdef HAVE_HIREDIS_SSL
+	struct redis_tls *tls;
+#endif
+	int enabled;
+	int res = -1;
+
+	ast_mutex_lock(&redis_lock);
+	enabled = tls_settings.enabled;
+#ifdef HAVE_HIREDIS_SSL
+	tls = ao2_bump(tls_context);
+#endif
+	ast_mutex_unlock(&redis_lock);
+
+	if (!enabled) {
+		return 0;
+	}
+
+#ifdef HAVE_HIREDIS_SSL
+	if (!tls) {
+		ast_log(LOG_ERROR, "Couldn't start TLS. Reason: no TLS context\n");
+	} else if (redisInitiateSSLWithContext(conn->ctx, tls->ssl) != REDIS_OK) {
+		ast_log(LOG_ERROR, "Couldn't start TLS. Reason: %s\n", conn->ctx->errstr);
+	} else {
+		res = 0;
+	}
+	ao2_cleanup(tls);
+#else
+	ast_log(LOG_ERROR, "Couldn't start TLS. Reason: built without hiredis_ssl\n");
+#endif
+
+	return res;
+}
+
+/*!
+ * \brief Turn on TCP keepalive, so a peer that silently went away is noticed
+ * while the connection sits in the pool rather than by the next command.
+ */
+static void redis_conn_keepalive(struct redis_conn *conn)
+{
+	int interval;
+
+	ast_mutex_lock(&redis_lock);
+	interval = keepalive;
+	ast_mutex_unlock(&redis_lock);
+
+	if (!interval) {
+		return;
+	}
+#if HIREDIS_MAJOR > 1 || (HIREDIS_MAJOR == 1 && HIREDIS_MINOR >= 1)
+	if (redisEnableKeepAliveWithInterval(conn->ctx, interval) != REDIS_OK) {
+#else
+	/* Older hiredis only knows its fixed 15 second interval */
+	if (redisEnableKeepAlive(conn->ctx) != REDIS_OK) {
+#endif
+		ast_log(LOG_WARNING, "Unable to enable TCP keepalive. Reason: %s\n", conn->ctx->errstr);
+	}
+}
+
+/*!
+ * \brief Connect to a server and apply the command timeout.
+ *
+ * A host starting with / is the path of a unix socket. TCP connections
+ * get keepalive, and start TLS when it is enabled. hiredis already turns
+ * off Nagle's algorithm on every TCP connection it opens.
+ *
+ * \return a connection that doesn't belong to any pool yet, or NULL
+ */
+static struct redis_conn *redis_conn_connect(const struct redis_addr *addr,
+	struct timeval conn_timeout, struct timeval cmd_timeout)
+{
+	struct redis_conn *conn;
+	int local = addr->host[0] == '/';
+
+	if (!(conn = ast_calloc(1, sizeof(*conn)))) {
+		return NULL;
+	}
+	conn->addr = *addr;
+
+	if (local) {
+		ast_log(LOG_WARNING, "Connecting to %s...\n", addr->host);
+		conn->ctx = redisConnectUnixWithTimeout(addr->host, conn_timeout);
+	} else {
+		ast_log(LOG_WARNING, "Connecting to %s:%d...\n", addr->host, addr->port);
+		conn->ctx = redisConnectWithTimeout(addr->host, addr->port, conn_timeout);
+	}
+
+	if (conn->ctx == NULL || conn->ctx->err != 0) {
+		ast_log(LOG_ERROR,
+			"Couldn't establish connection. Reason: %s\n",
+			conn->ctx ? conn->ctx->errstr : "out of memory");
+		redis_conn_close(conn);
+		return NULL;
+	}
+	if (!local) {
+		redis_conn_keepalive(conn);
+		/* The TLS handshake gets the same bound as the connect */
+		redisSetTimeout(conn->ctx, conn_timeout);
+		if (redis_conn_start_tls(conn)) {
+			redis_conn_close(conn);
+			return NULL;
+		}
+	}
+	conn->last_used = ast_tvnow();
+	ast_log(LOG_WARNING, "Connected.\n");
+#ifdef REDIS_REPLY_PUSH
+	redisSetPushCallback(conn->ctx, redis_push_discard);
+#endif
+
+	/* Bound every command so a half-open socket can't stall a channel for the TCP timeout */
+	conn->cmd_timeout = cmd_timeout;
+	if (redisSetTimeout(conn->ctx, cmd_timeout) != REDIS_OK) {
+		ast_log(LOG_WARNING, "Unable to set command timeout. Reason: %s\n", conn->ctx->errstr);
+	}
+
+	return conn;
+}
+
+/*!
+ * \brief Send AUTH on a new connection.
+ *
+ * \retval 0 authenticated, or no password is set
+ * \retval -1 the server refused the password or the connection failed
+ */
+static int redis_conn_auth(struct redis_conn *conn, const char *auth)
+{
+	redisReply *reply;
+	struct redis_args cmd;
+
+	if (ast_strlen_zero(auth)) {
+		return 0;
+	}
+
+	ast_log(LOG_WARNING,"Authenticating...\n");
+	redis_args_init(&cmd, "AUTH", auth, NULL);
+	reply = redis_logged_command(conn, &cmd);
+	if (reply == NULL || conn->ctx->err != 0 || reply->type == REDIS_REPLY_ERROR) {
+		ast_log(LOG_ERROR, "Unable to authenticate. Reason: %s\n",
+			reply ? reply->str : conn->ctx->errstr);
+		redis_reply_free(reply);
+		return -1;
+	}
+	ast_log(LOG_WARNING, "Authenticated.\n");
+	redis_reply_free(reply);
+
+	return 0;
+}
+
+/*!
+ * \brief Snapshot the settings for a pool's connections, so a concurrent
+ * reload can't change them under a connect.
+ */
+static void redis_conn_settings_get(const struct redis_pool *p, struct redis_conn_settings *settings)
+{
+	ast_mutex_lock(&redis_lock);
+	ast_copy_string(settings->database, p->profile ? p->profile->database : database, sizeof(settings->database));
+	ast_copy_string(settings->password, password, sizeof(settings->password));
+	settings->connect_timeout = connect_timeout;
+	settings->command_timeout = command_timeout;
+	settings->protocol = protocol;
+	settings->tls_generation = tls_generation;
+	ast_mutex_unlock(&redis_lock);
+}
+
+static int redis_conn_settings_equal(const struct redis_conn_settings *a, const struct redis_conn_settings *b)
+{
+	return !strcmp(a->database, b->database) && !strcmp(a->password, b->password)
+		&& !ast_tvcmp(a->connect_timeout, b->connect_timeout)
+		&& !ast_tvcmp(a->command_timeout, b->command_timeout)
+		&& a->protocol == b->protocol && a->tls_generation == b->tls_generation;
+}
+
+/*!
+ * \brief Open, authenticate and select the database on a new connection.
+ *
+ * The pool's servers are used in turn, so the connections of a pool with
+ * several replicas are spread across them. Called by a channel with a
+ * REDIS_TIMEOUT_MS deadline, the connect takes no longer than what is left
+ * of it, and the handshake commands are bounded by it like any other.
+ *
+ * \param p pool to open the connection for
+ * \param generation pool generation to tag the connection with
+ * \param track non-zero to register for client side caching invalidations
+ *
+ * \return the new connection, or NULL on failure
+ */
+static struct redis_conn *redis_conn_open(struct redis_pool *p, unsigned int generation, int track)
+{
+	struct redis_conn *conn;
+	redisReply *reply;
+	struct redis_args cmd;
+	struct redis_addr addr;
+	struct redis_conn_settings settings;
+	struct timeval conn_timeout;
+	int check_role;
+
+	ast_mutex_lock(&p->lock);
+	if (!p->naddrs) {
+		ast_mutex_unlock(&p->lock);
+		return NULL;
+	}
+	addr = p->addrs[p->next_addr++ % p->naddrs];
+	ast_mutex_unlock(&p->lock);
+
+	redis_conn_settings_get(p, &settings);
+
+	ast_mutex_lock(&redis_lock);
+	/* A master that Sentinel has since demoted may still accept connections */
+	check_role = (p == &pool || p->profile) && sentinel_count > 0;
+	ast_mutex_unlock(&redis_lock);
+
+	conn_timeout = settings.connect_timeout;
+	redis_deadline_clamp(&conn_timeout);
+
+	if (!(conn = redis_conn_connect(&addr, conn_timeout, settings.command_timeout))) {
+		return NULL;
+	}
+	conn->pool = p;
+	conn->generation = generation;
+
+	if (redis_conn_auth(conn, settings.password)) {
+		redis_conn_close(conn);
+		return NULL;
+	}
+
+	if (settings.protocol == 3) {
+		redis_args_init(&cmd, "HELLO", "3", NULL);
+		reply = redis_logged_command(conn, &cmd);
+		if (reply == NULL || conn->ctx->err != 0) {
+			ast_log(LOG_ERROR, "Unable to switch to RESP3. Reason: %s\n", conn->ctx->errstr);
+			redis_reply_free(reply);
+			redis_conn_close(conn);
+			return NULL;
+		}
+		if (reply->type == REDIS_REPLY_ERROR) {
+			/* Servers before 6.0 don't know HELLO, carry on with RESP2 */
+			ast_log(LOG_WARNING, "Server %s:%d refused RESP3, using RESP2. Reason: %s\n",
+				addr.host, addr.port, reply->str);
+		}
+		redis_reply_free(reply);
+	}
+
+	if (strlen(settings.database) != 0) {
+		ast_log(LOG_WARNING,"Selecting DB %s\n", settings.database);
+		redis_args_init(&cmd, "SELECT", settings.database, NULL);
+		reply = redis_logged_command(conn, &cmd);
+		if (reply == NULL || conn->ctx->err != 0 || reply->type == REDIS_REPLY_ERROR) {
+			ast_log(LOG_ERROR, "Unable to select DB %s. Reason: %s\n", settings.database,
+				reply ? reply->str : conn->ctx->errstr);
+			redis_reply_free(reply);
+			redis_conn_close(conn);
+			return NULL;
+		}
+		ast_log(LOG_WARNING, "Database %s selected.\n", settings.database);
+		redis_reply_free(reply);
+	}
+
+	if (check_role) {
+		redis_args_init(&cmd, "ROLE", NULL);
+		reply = redis_logged_command(conn, &cmd);
+		if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements < 1
+			|| reply->element[0]->type != REDIS_REPLY_STRING || strcmp(reply->element[0]->str, "master")) {
+			ast_log(LOG_WARNING, "REDIS: %s:%d is not a master, waiting for Sentinel.\n",
+				addr.host, addr.port);
+			redis_reply_free(reply);
+			redis_conn_close(conn);
+			return NULL;
+		}
+		redis_reply_free(reply);
+	}
+
+	if (track) {
+		long long listener;
+		char id[32];
+
+		ast_mutex_lock(&cache.lock);
+		listener = cache.tracking_id;
+		ast_mutex_unlock(&cache.lock);
+
+		if (listener) {
+			snprintf(id, sizeof(id), "%lld", listener);
+			redis_args_init(&cmd, "CLIENT", "TRACKING", "on", "REDIRECT", id, NULL);
+			reply = redis_logged_command(conn, &cmd);
+			if (reply == NULL || conn->ctx->err != 0 || reply->type == REDIS_REPLY_ERROR) {
+				/* Not fatal, results read on this connection just won't be cached */
+				ast_log(LOG_WARNING, "Unable to enable client tracking. Reason: %s\n",
+					reply ? reply->str : conn->ctx->errstr);
+			} else {
+				conn->tracking_id = listener;
+			}
+			redis_reply_free(reply);
+			if (conn->ctx->err != 0) {
+				redis_conn_close(conn);
+				return NULL;
+			}
+		}
+	}
+
+	return conn;
+}
+
+static void redis_pool_destroy(struct redis_pool *p)
+{
+	ast_cond_destroy(&p->cond);
+	ast_mutex_destroy(&p->lock);
+}
+
+/*!
+ * \brief Close every idle connection and retire the checked out ones.
+ */
+static void redis_pool_drain(struct redis_pool *p)
+{
+	struct redis_conn *conn;
+	AST_LIST_HEAD_NOLOCK(, redis_conn) closing = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+
+	ast_mutex_lock(&p->lock);
+	p->generation++;
+	while ((conn = AST_LIST_REMOVE_HEAD(&p->idle, list))) {
+		p->total--;
+		AST_LIST_INSERT_TAIL(&closing, conn, list);
+	}
+	ast_cond_broadcast(&p->cond);
+	ast_mutex_unlock(&p->lock);
+
+	while ((conn = AST_LIST_REMOVE_HEAD(&closing, list))) {
+		redis_conn_close(conn);
+	}
+}
+
+/*!
+ * \brief Move a pool to the current settings after a reload, without a gap.
+ *
+ * Nothing happens if the settings its connections were opened with still
+ * hold. Otherwise replacements for the idle connections are opened first,
+ * and then swapped in under the lock in one go, so callers keep using the
+ * old connections meanwhile and never wait for a connect. Connections that
+ * are checked out at that point are closed when they are checked back in.
+ */
+static void redis_pool_refresh(struct redis_pool *p)
+{
+	struct redis_conn_settings settings;
+	struct redis_conn *conn;
+	AST_LIST_HEAD_NOLOCK(, redis_conn) fresh = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+	AST_LIST_HEAD_NOLOCK(, redis_conn) closing = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+	unsigned int generation;
+	int nfresh = 0;
+	int count = 0;
+	int size;
+
+	redis_conn_settings_get(p, &settings);
+
+	ast_mutex_lock(&redis_lock);
+	size = pool_size;
+	ast_mutex_unlock(&redis_lock);
+
+	ast_mutex_lock(&p->lock);
+	if (redis_conn_settings_equal(&settings, &p->settings)) {
+		ast_mutex_unlock(&p->lock);
+		return;
+	}
+	generation = p->generation + 1;
+	if (!p->circuit_open) {
+		AST_LIST_TRAVERSE(&p->idle, conn, list) {
+			count++;
+		}
+	}
+	ast_mutex_unlock(&p->lock);
+
+	/* If the server is unreachable with the new settings, the first failure is enough */
+	while (nfresh < count && (conn = redis_conn_open(p, generation, p == &pool))) {
+		AST_LIST_INSERT_TAIL(&fresh, conn, list);
+		nfresh++;
+	}
+
+	ast_mutex_lock(&p->lock);
+	if (p->generation + 1 != generation) {
+		/* Drained meanwhile, by a failover or a tripped circuit */
+		AST_LIST_APPEND_LIST(&closing, &fresh, list);
+		nfresh = 0;
+	}
+	p->generation++;
+	p->settings = settings;
+	while ((conn = AST_LIST_REMOVE_HEAD(&p->idle, list))) {
+		p->total--;
+		AST_LIST_INSERT_TAIL(&closing, conn, list);
+	}
+	while ((conn = AST_LIST_REMOVE_HEAD(&fresh, list))) {
+		if (p->total < size) {
+			p->total++;
+			AST_LIST_INSERT_TAIL(&p->idle, conn, list);
+		} else {
+			AST_LIST_INSERT_TAIL(&closing, conn, list);
+		}
+	}
+	ast_cond_broadcast(&p->cond);
+	ast_mutex_unlock(&p->lock);
+
+	while ((conn = AST_LIST_REMOVE_HEAD(&closing, list))) {
+		redis_conn_close(conn);
+	}
+	if (nfresh) {
+		ast_debug(1, "REDIS: Replaced %d pooled connections with the new settings.\n", nfresh);
+	}
+}
+
+/*!
+ * \brief Point a pool at a new set of servers.
+ *
+ * If anything changed, the pool is drained so no connection to a server
+ * that was removed, such as a master that failed over, is used again.
+ *
+ * \retval 1 the servers changed
+ * \retval 0 they were already in use
+ */
+static int redis_pool_set_addrs(struct redis_pool *p, const struct redis_addr *addrs, int count)
+{
+	int changed;
+	int i;
+
+	count = MIN(count, MAX_POOL_ADDRS);
+
+	ast_mutex_lock(&p->lock);
+	changed = count != p->naddrs;
+	for (i = 0; i < count && !changed; i++) {
+		changed = strcmp(addrs[i].host, p->addrs[i].host) || addrs[i].port != p->addrs[i].port;
+	}
+	if (changed) {
+		if (count) {
+			memcpy(p->addrs, addrs, count * sizeof(*addrs));
+		}
+		p->naddrs = count;
+	}
+	ast_mutex_unlock(&p->lock);
+
+	if (changed) {
+		redis_pool_drain(p);
+	}
+
+	return changed;
+}
+
+/*! \brief Whether a pool still connects to the given server */
+static int redis_pool_has_addr(struct redis_pool *p, const struct redis_addr *addr)
+{
+	int found = 0;
+	int i;
+
+	ast_mutex_lock(&p->lock);
+	for (i = 0; i < p->naddrs && !found; i++) {
+		found = !strcmp(p->addrs[i].host, addr->host) && p->addrs[i].port == addr->port;
+	}
+	ast_mutex_unlock(&p->lock);
+
+	return found;
+}
+
+/*!
+ * \brief Get the pools of every profile.
+ *
+ * \param enabled set to only get the profiles in the current configuration
+ */
+static int redis_profile_pools(struct redis_pool **pools, int max, int enabled)
+{
+	struct redis_profile *profile;
+	int count = 0;
+
+	ast_mutex_lock(&redis_lock);
+	AST_LIST_TRAVERSE(&profiles, profile, list) {
+		if (count < max && (profile->enabled || !enabled)) {
+			pools[count++] = &profile->pool;
+		}
+	}
+	ast_mutex_unlock(&redis_lock);
+
+	return count;
+}
+
+/*!
+ * \brief Point the main pool and the profile pools at the master.
+ *
+ * Profiles a reload removed, and all of them in cluster mode, get no servers.
+ *
+ * \param master the master, or NULL for none
+ *
+ * \retval 1 the main pool's server changed
+ */
+static int redis_master_set_addrs(const struct redis_addr *master)
+{
+	struct redis_pool *pools[MAX_PROFILES];
+	struct redis_profile *profile;
+	int enabled[MAX_PROFILES];
+	int count = 0;
+	int i;
+
+	ast_mutex_lock(&redis_lock);
+	AST_LIST_TRAVERSE(&profiles, profile, list) {
+		if (count < ARRAY_LEN(pools)) {
+			enabled[count] = profile->enabled && !cluster_mode;
+			pools[count++] = &profile->pool;
+		}
+	}
+	ast_mutex_unlock(&redis_lock);
+
+	for (i = 0; i < count; i++) {
+		redis_pool_set_addrs(pools[i], master, master && enabled[i] ? 1 : 0);
+	}
+
+	return master ? redis_pool_set_addrs(&pool, master, 1) : 0;
+}
+
+/*! \brief Read a host and port pair out of a reply to SENTINEL commands */
+static int redis_sentinel_addr(redisReply *host, redisReply *port, struct redis_addr *addr)
+{
+	if (host->type != REDIS_REPLY_STRING || port->type != REDIS_REPLY_STRING) {
+		return -1;
+	}
+	ast_copy_string(addr->host, host->str, sizeof(addr->host));
+	addr->port = atoi(port->str);
+	return addr->port > 0 ? 0 : -1;
+}
+
+/*!
+ * \brief Collect the healthy replicas from a SENTINEL REPLICAS reply.
+ *
+ * Each replica is a flat list of field names and values.
+ *
+ * \return the number of replicas found
+ */
+static int redis_sentinel_replicas(redisReply *reply, struct redis_addr *addrs, int max)
+{
+	redisReply *replica;
+	redisReply *ip;
+	redisReply *port;
+	const char *flags;
+	int count = 0;
+	int i;
+	int j;
+
+	if (reply->type != REDIS_REPLY_ARRAY) {
+		return 0;
+	}
+	for (i = 0; i < reply->elements && count < max; i++) {
+		replica = reply->element[i];
+		if (replica->type != REDIS_REPLY_ARRAY) {
+			continue;
+		}
+		ip = port = NULL;
+		flags = "";
+		for (j = 0; j + 1 < replica->elements; j += 2) {
+			if (replica->element[j]->type != REDIS_REPLY_STRING
+				|| replica->element[j + 1]->type != REDIS_REPLY_STRING) {
+				continue;
+			}
+			if (!strcmp(replica->element[j]->str, "ip")) {
+				ip = replica->element[j + 1];
+			} else if (!strcmp(replica->element[j]->str, "port")) {
+				port = replica->element[j + 1];
+			} else if (!strcmp(replica->element[j]->str, "flags")) {
+				flags = replica->element[j + 1]->str;
+			}
+		}
+		if (!ip || !port || strstr(flags, "s_down") || strstr(flags, "o_down")
+			|| strstr(flags, "disconnected")) {
+			continue;
+		}
+		if (!redis_sentinel_addr(ip, port, &addrs[count])) {
+			count++;
+		}
+	}
+
+	return count;
+}
+
+/*!
+ * \brief Open a connection to the first reachable sentinel, starting at index start.
+ */
+static struct redis_conn *redis_sentinel_open(int start)
+{
+	struct redis_addr addrs[MAX_SENTINELS];
+	char auth[STR_CONF_SZ];
+	struct redis_conn *conn;
+	struct timeval conn_timeout;
+	struct timeval cmd_timeout;
+	int count;
+	int i;
+
+	ast_mutex_lock(&redis_lock);
+	count = sentinel_count;
+	memcpy(addrs, sentinel_addrs, count * sizeof(*addrs));
+	ast_copy_string(auth, sentinel_password, sizeof(auth));
+	conn_timeout = connect_timeout;
+	cmd_timeout = command_timeout;
+	ast_mutex_unlock(&redis_lock);
+
+	for (i = 0; i < count; i++) {
+		if (!(conn = redis_conn_connect(&addrs[(start + i) % count], conn_timeout, cmd_timeout))) {
+			continue;
+		}
+		if (!redis_conn_auth(conn, auth)) {
+			return conn;
+		}
+		redis_conn_close(conn);
+	}
+
+	return NULL;
+}
+
+/*!
+ * \brief Ask Sentinel for the current master and replicas and update the pools.
+ *
+ * Statically configured replicas take precedence over discovered ones.
+ *
+ * \retval 0 the master is known
+ * \retval -1 no sentinel could tell us
+ */
+static int redis_sentinel_discover(void)
+{
+	struct redis_conn *conn;
+	redisReply *reply;
+	struct redis_args cmd;
+	struct redis_addr master;
+	struct redis_addr replicas[MAX_POOL_ADDRS];
+	char name[STR_CONF_SZ];
+	int nreplicas;
+	int use_static;
+	int count;
+	int i;
+
+	ast_mutex_lock(&redis_lock);
+	ast_copy_string(name, master_name, sizeof(name));
+	count = sentinel_count;
+	use_static = replica_count > 0;
+	ast_mutex_unlock(&redis_lock);
+
+	for (i = 0; i < count; i++) {
+		if (!(conn = redis_sentinel_open(i))) {
+			break;
+		}
+
+		redis_args_init(&cmd, "SENTINEL", "get-master-addr-by-name", name, NULL);
+		reply = redis_logged_command(conn, &cmd);
+		if (reply == NULL || reply->type != REDIS_REPLY_ARRAY || reply->elements != 2
+			|| redis_sentinel_addr(reply->element[0], reply->element[1], &master)) {
+			ast_log(LOG_WARNING, "REDIS: Sentinel %s:%d doesn't know master '%s'.\n",
+				conn->addr.host, conn->addr.port, name);
+			redis_reply_free(reply);
+			redis_conn_close(conn);
+			continue;
+		}
+		redis_reply_free(reply);
+
+		nreplicas = 0;
+		if (!use_static) {
+			redis_args_init(&cmd, "SENTINEL", "replicas", name, NULL);
+			if ((reply = redis_logged_command(conn, &cmd))) {
+				nreplicas = redis_sentinel_replicas(reply, replicas, ARRAY_LEN(replicas));
+			}
+			redis_reply_free(reply);
+		}
+		redis_conn_close(conn);
+
+		if (redis_master_set_addrs(&master)) {
+			ast_log(LOG_NOTICE, "REDIS: Master '%s' is at %s:%d.\n", name, master.host, master.port);
+		}
+		if (!use_static && redis_pool_set_addrs(&replica_pool, replicas, nreplicas)) {
+			ast_log(LOG_NOTICE, "REDIS: Master '%s' has %d usable replicas.\n", name, nreplicas);
+		}
+		return 0;
+	}
+
+	ast_log(LOG_ERROR, "REDIS: No sentinel could resolve master '%s'.\n", name);
+	return -1;
+}
+
+static void redis_monitor_wake(void)
+{
+	ast_mutex_lock(&monitor.lock);
+	monitor.wakeup = 1;
+	ast_cond_signal(&monitor.cond);
+	ast_mutex_unlock(&monitor.lock);
+}
+
+/*!
+ * \brief Cluster hash slot of a key.
+ *
+ * CRC16 (XMODEM) of the key, or of its hash tag, the part between the first
+ * '{' and the next '}' if that isn't empty, so related keys can be kept on
+ * the same node.
+ */
+static int redis_cluster_slot(const char *key, size_t len)
+{
+	const char *open;
+	const char *close;
+	unsigned int crc = 0;
+	size_t i;
+	int bit;
+
+	if ((open = memchr(key, '{', len)) && (close = memchr(open + 1, '}', len - (open + 1 - key)))
+		&& close > open + 1) {
+		len = close - open - 1;
+		key = open + 1;
+	}
+
+	for (i = 0; i < len; i++) {
+		crc ^= (unsigned char) key[i] << 8;
+		for (bit = 0; bit < 8; bit++) {
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+		}
+	}
+
+	return (crc & 0xffff) % CLUSTER_SLOTS;
+}
+
+/*!
+ * \brief Find or create the pool of a cluster node.
+ *
+ * \return the pool, or NULL if there are too many nodes or out of memory
+ */
+static struct redis_pool *redis_cluster_node(const struct redis_addr *addr)
+{
+	struct redis_pool *p;
+	int count = 0;
+
+	ast_rwlock_wrlock(&cluster.lock);
+	AST_LIST_TRAVERSE(&cluster.nodes, p, list) {
+		if (!strcmp(p->addrs[0].host, addr->host) && p->addrs[0].port == addr->port) {
+			break;
+		}
+		count++;
+	}
+	if (!p && count < MAX_CLUSTER_NODES && (p = ast_calloc(1, sizeof(*p)))) {
+		redis_pool_init(p);
+		p->addrs[0] = *addr;
+		p->naddrs = 1;
+		AST_LIST_INSERT_TAIL(&cluster.nodes, p, list);
+	}
+	ast_rwlock_unlock(&cluster.lock);
+
+	return p;
+}
+
+/*! \brief Whether a pool belongs to a cluster node */
+static int redis_pool_is_node(const struct redis_pool *p)
+{
+	return p != &pool && p != &replica_pool && !p->profile;
+}
+
+/*!
+ * \brief Copy the node pools so they can be walked without the cluster lock.
+ *
+ * \return the number of pools copied
+ */
+static int redis_cluster_nodes(struct redis_pool **nodes, int max)
+{
+	struct redis_pool *p;
+	int count = 0;
+
+	ast_rwlock_rdlock(&cluster.lock);
+	AST_LIST_TRAVERSE(&cluster.nodes, p, list) {
+		if (count == max) {
+			break;
+		}
+		nodes[count++] = p;
+	}
+	ast_rwlock_unlock(&cluster.lock);
+
+	return count;
+}
+
+/*!
+ * \brief Collect the distinct nodes serving slots.
+ *
+ * \return the number of nodes
+ */
+static int redis_cluster_masters(struct redis_pool **nodes, int max)
+{
+	struct redis_pool *last = NULL;
+	int count = 0;
+	int slot;
+	int i;
+
+	ast_rwlock_rdlock(&cluster.lock);
+	for (slot = 0; slot < CLUSTER_SLOTS && count < max; slot++) {
+		if (!cluster.slots[slot] || cluster.slots[slot] == last) {
+			continue;
+		}
+		last = cluster.slots[slot];
+		for (i = 0; i < count && nodes[i] != last; i++) {
+		}
+		if (i == count) {
+			nodes[count++] = last;
+		}
+	}
+	ast_rwlock_unlock(&cluster.lock);
+
+	return count;
+}
+
+/*! \brief Ask the monitor thread to read the slot map again */
+static void redis_cluster_refresh_soon(void)
+{
+	ast_rwlock_wrlock(&cluster.lock);
+	cluster.stale = 1;
+	ast_rwlock_unlock(&cluster.lock);
+	redis_monitor_wake();
+}
+
+/*!
+ * \brief Mark a pool's servers as down and hand reconnection to the monitor thread.
+ *
+ * Idle connections are dropped since they share the fate of the one that failed.
+ */
+static void redis_circuit_trip(struct redis_pool *p)
+{
+	int min_ms;
+
+	ast_mutex_lock(&redis_lock);
+	min_ms = reconnect_min_ms;
+	ast_mutex_unlock(&redis_lock);
+
+	ast_mutex_lock(&p->lock);
+	if (p->circuit_open) {
+		ast_mutex_unlock(&p->lock);
+		return;
+	}
+	p->circuit_open = 1;
+	p->backoff_ms = min_ms;
+	p->next_attempt = ast_tvadd(ast_tvnow(), ms_to_timeval(min_ms));
+	/* Wake up anyone waiting for a connection so they fail fast */
+	ast_cond_broadcast(&p->cond);
+	ast_mutex_unlock(&p->lock);
+
+	if (p == &pool) {
+		ast_log(LOG_ERROR, "REDIS: Server unavailable, failing requests until reconnected.\n");
+	} else if (p->profile) {
+		ast_log(LOG_ERROR, "REDIS: Server unavailable for profile %s, failing its requests until reconnected.\n",
+			p->profile->name);
+	} else if (p == &replica_pool) {
+		ast_log(LOG_ERROR, "REDIS: Replicas unavailable, reading from the master until reconnected.\n");
+	} else {
+		ast_log(LOG_ERROR, "REDIS: Cluster node %s:%d unavailable, failing its keys until reconnected.\n",
+			p->addrs[0].host, p->addrs[0].port);
+	}
+
+	redis_pool_drain(p);
+	if (redis_pool_is_node(p)) {
+		/* Its slots may have failed over to a replica */
+		redis_cluster_refresh_soon();
+	} else {
+		redis_monitor_wake();
+	}
+}
+
+/*!
+ * \brief Try once to reconnect while a pool's circuit is open.
+ *
+ * On success the new connection is added to the pool and the circuit closes;
+ * on failure the backoff doubles up to reconnect_max. With Sentinel, the
+ * servers are looked up again first, since the outage may be a failover.
+ */
+static void redis_circuit_probe(struct redis_pool *p)
+{
+	struct redis_conn *conn = NULL;
+	unsigned int generation;
+	int use_sentinel;
+	int max_ms;
+
+	ast_mutex_lock(&redis_lock);
+	max_ms = reconnect_max_ms;
+	use_sentinel = sentinel_count > 0;
+	ast_mutex_unlock(&redis_lock);
+
+	if (!use_sentinel || !redis_sentinel_discover()) {
+		/* Discovery may have drained the pool, so read the generation afterwards */
+		ast_mutex_lock(&p->lock);
+		generation = p->generation;
+		ast_mutex_unlock(&p->lock);
+
+		conn = redis_conn_open(p, generation, p == &pool);
+	}
+
+	ast_mutex_lock(&p->lock);
+	if (conn) {
+		p->circuit_open = 0;
+		p->total++;
+		AST_LIST_INSERT_HEAD(&p->idle, conn, list);
+		ast_cond_broadcast(&p->cond);
+		ast_mutex_unlock(&p->lock);
+		if (p == &pool) {
+			ast_log(LOG_NOTICE, "REDIS: Connection restored.\n");
+		} else if (p->profile) {
+			ast_log(LOG_NOTICE, "REDIS: Connection restored for profile %s.\n", p->profile->name);
+		} else if (p == &replica_pool) {
+			ast_log(LOG_NOTICE, "REDIS: Replica connection restored.\n");
+		} else {
+			ast_log(LOG_NOTICE, "REDIS: Cluster node %s:%d connection restored.\n",
+				p->addrs[0].host, p->addrs[0].port);
+		}
+		return;
+	}
+	p->backoff_ms = MIN(p->backoff_ms * 2, max_ms);
+	p->next_attempt = ast_tvadd(ast_tvnow(), ms_to_timeval(p->backoff_ms));
+	ast_debug(1, "REDIS: Reconnect failed, next attempt in %d ms.\n", p->backoff_ms);
+	ast_mutex_unlock(&p->lock);
+}
+
+/*!
+ * \brief Check a connection out of a pool.
+ *
+ * Reuses an idle connection if there is one, opens a new one while the pool
+ * is below pool_size, and otherwise waits up to the connect timeout for
+ * another thread to check one back in. Both the wait and a connect are
+ * bounded by the caller's REDIS_TIMEOUT_MS. Fails immediately while the circuit
+ * is open, or if the pool has no servers.
+ *
+ * \return a connection for the exclusive use of the caller, or NULL
+ */
+static struct redis_conn *redis_pool_acquire(struct redis_pool *p)
+{
+	struct redis_conn *conn = NULL;
+	struct timeval wait_until;
+	struct timeval expires;
+	struct timespec ts;
+	unsigned int generation;
+	int size;
+
+	if (redis_deadline_expired()) {
+		return NULL;
+	}
+
+	ast_mutex_lock(&redis_lock);
+	size = pool_size;
+	wait_until = ast_tvadd(ast_tvnow(), connect_timeout);
+	ast_mutex_unlock(&redis_lock);
+	if (redis_deadline_get(&expires) && ast_tvcmp(expires, wait_until) < 0) {
+		wait_until = expires;
+	}
+
+	ts.tv_sec = wait_until.tv_sec;
+	ts.tv_nsec = wait_until.tv_usec * 1000;
+
+	ast_mutex_lock(&p->lock);
+	while (p->naddrs && !p->circuit_open && !(conn = AST_LIST_REMOVE_HEAD(&p->idle, list))) {
+		if (p->total < size) {
+			/* Reserve the slot, then connect without holding the lock */
+			p->total++;
+			generation = p->generation;
+			ast_mutex_unlock(&p->lock);
+
+			if (!(conn = redis_conn_open(p, generation, p == &pool))) {
+				ast_mutex_lock(&p->lock);
+				p->total--;
+				ast_cond_signal(&p->cond);
+				ast_mutex_unlock(&p->lock);
+				if (redis_deadline_expired()) {
+					/* The caller's deadline, not the server, cut the connect short */
+					ast_debug(1, "REDIS: Connect abandoned, the call ran out of time.\n");
+				} else {
+					redis_circuit_trip(p);
+				}
+			}
+			return conn;
+		}
+		if (ast_cond_timedwait(&p->cond, &p->lock, &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+	ast_mutex_unlock(&p->lock);
+
+	if (!conn && p->naddrs && !p->circuit_open && !redis_deadline_expired()) {
+		ast_log(LOG_WARNING, "REDIS: No connection available, all %d pooled connections are busy.\n", size);
+	}
+
+	return conn;
+}
+
+/*!
+ * \brief Check out a connection for a read.
+ *
+ * With read_from_replicas, a replica is used if one is reachable and the
+ * master otherwise.
+ */
+static struct redis_conn *redis_read_acquire(void)
+{
+	struct redis_conn *conn;
+	int replicas;
+
+	ast_mutex_lock(&redis_lock);
+	replicas = read_from_replicas;
+	ast_mutex_unlock(&redis_lock);
+
+	if (replicas && (conn = redis_pool_acquire(&replica_pool))) {
+		return conn;
+	}
+	return redis_pool_acquire(&pool);
+}
+
+/*!
+ * \brief Return a connection to its pool.
+ *
+ * Connections in an error state, or opened before the last reload, are closed
+ * rather than reused. A transport error also opens the circuit, since the
+ * other pooled connections are most likely broken too.
+ */
+static void redis_pool_release(struct redis_conn *conn)
+{
+	struct redis_pool *p;
+	int failed;
+
+	if (!conn) {
+		return;
+	}
+	p = conn->pool;
+
+	ast_mutex_lock(&p->lock);
+	if ((failed = conn->ctx->err != 0) || conn->generation != p->generation) {
+		p->total--;
+		ast_cond_signal(&p->cond);
+		ast_mutex_unlock(&p->lock);
+		if (failed && conn->deadline_hit) {
+			/* The caller's deadline, not the server, cut the command short */
+			ast_debug(1, "REDIS: Closing connection to %s:%d after a command ran out of time.\n",
+				conn->addr.host, conn->addr.port);
+		} else if (failed) {
+			ast_log(LOG_WARNING, "REDIS: Connection to %s:%d failed. Reason: %s\n",
+				conn->addr.host, conn->addr.port, conn->ctx->errstr);
+			redis_circuit_trip(p);
+		}
+		redis_conn_close(conn);
+		return;
+	}
+	/* Most recently used first, so a quiet pool keeps reusing warm connections */
+	conn->last_used = ast_tvnow();
+	AST_LIST_INSERT_HEAD(&p->idle, conn, list);
+	ast_cond_signal(&p->cond);
+	ast_mutex_unlock(&p->lock);
+}
+
+/*!
+ * \brief PING the connections of a pool that have been idle for idle_ms.
+ *
+ * A connection a NAT or firewall dropped in the meantime is closed here,
+ * off the call path, instead of making the next command wait for the TCP
+ * retransmit timeout. One stale connection doesn't say the server is down,
+ * so a failed check doesn't trip the circuit.
+ */
+static void redis_pool_ping_idle(struct redis_pool *p, int idle_ms)
+{
+	AST_LIST_HEAD_NOLOCK(, redis_conn) stale = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+	struct redis_conn *conn;
+	struct redis_args cmd;
+	redisReply *reply;
+	struct timeval now = ast_tvnow();
+	int ok;
+
+	ast_mutex_lock(&p->lock);
+	if (p->circuit_open) {
+		ast_mutex_unlock(&p->lock);
+		return;
+	}
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&p->idle, conn, list) {
+		if (ast_tvdiff_ms(now, conn->last_used) >= idle_ms) {
+			/* Still counted in total, as if checked out */
+			AST_LIST_REMOVE_CURRENT(list);
+			AST_LIST_INSERT_TAIL(&stale, conn, list);
+		}
+	}
+	AST_LIST_TRAVERSE_SAFE_END;
+	ast_mutex_unlock(&p->lock);
+
+	while ((conn = AST_LIST_REMOVE_HEAD(&stale, list))) {
+		/* Not through redis_logged_command(), health checks stay out of the statistics */
+		redis_args_init(&cmd, "PING", NULL);
+		reply = NULL;
+		if (redis_conn_append(conn, &cmd) != REDIS_OK || redis_conn_get_reply(conn, &reply) != REDIS_OK) {
+			redis_reply_free(reply);
+			reply = NULL;
+		}
+		ok = reply && !conn->ctx->err && reply->type != REDIS_REPLY_ERROR;
+		redis_reply_free(reply);
+		if (ok) {
+			redis_pool_release(conn);
+			continue;
+		}
+		ast_log(LOG_WARNING, "REDIS: Idle connection to %s:%d failed its health check, closing it.\n",
+			conn->addr.host, conn->addr.port);
+		ast_mutex_lock(&p->lock);
+		p->total--;
+		ast_cond_signal(&p->cond);
+		ast_mutex_unlock(&p->lock);
+		redis_conn_close(conn);
+	}
+}
+
+/*!
+ * \brief Read the slot map with CLUSTER SLOTS.
+ *
+ * The seeds are asked first, then any node already known.
+ *
+ * \retval 0 the map was replaced
+ * \retval -1 no node answered
+ */
+static int redis_cluster_refresh(void)
+{
+	struct redis_pool *nodes[MAX_CLUSTER_NODES];
+	struct redis_pool **slots;
+	struct redis_pool *p;
+	struct redis_conn *conn;
+	redisReply *reply = NULL;
+	redisReply *range;
+	struct redis_args cmd;
+	struct redis_addr from;
+	struct redis_addr addr;
+	int nnodes;
+	int covered = 0;
+	int start;
+	int end;
+	int i;
+
+	conn = redis_pool_acquire(&pool);
+	nnodes = redis_cluster_nodes(nodes, ARRAY_LEN(nodes));
+	for (i = 0; !conn && i < nnodes; i++) {
+		conn = redis_pool_acquire(nodes[i]);
+	}
+	if (!conn) {
+		ast_log(LOG_WARNING, "REDIS: No cluster node reachable to read the slot map from.\n");
+		return -1;
+	}
+
+	redis_args_init(&cmd, "CLUSTER", "SLOTS", NULL);
+	reply = redis_logged_command(conn, &cmd);
+	from = conn->addr;
+	redis_pool_release(conn);
+
+	if (reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+		ast_log(LOG_WARNING, "REDIS: Unable to read the cluster slot map. Reason: %s\n",
+			reply && reply->type == REDIS_REPLY_ERROR ? reply->str : "no reply");
+		redis_reply_free(reply);
+		return -1;
+	}
+
+	if (!(slots = ast_calloc(CLUSTER_SLOTS, sizeof(*slots)))) {
+		redis_reply_free(reply);
+		return -1;
+	}
+
+	/* Each range is [ start, end, [ host, port, id ], replicas... ] */
+	for (i = 0; i < reply->elements; i++) {
+		range = reply->element[i];
+		if (range->type != REDIS_REPLY_ARRAY || range->elements < 3
+			|| range->element[0]->type != REDIS_REPLY_INTEGER
+			|| range->element[1]->type != REDIS_REPLY_INTEGER
+			|| range->element[2]->type != REDIS_REPLY_ARRAY
+			|| range->element[2]->elements < 2
+			|| range->element[2]->element[0]->type != REDIS_REPLY_STRING
+			|| range->element[2]->element[1]->type != REDIS_REPLY_INTEGER) {
+			continue;
+		}
+		/* An empty host means the node we asked */
+		ast_copy_string(addr.host, ast_strlen_zero(range->element[2]->element[0]->str)
+			? from.host : range->element[2]->element[0]->str, sizeof(addr.host));
+		addr.port = range->element[2]->element[1]->integer;
+		if (!(p = redis_cluster_node(&addr))) {
+			continue;
+		}
+		start = MAX(range->element[0]->integer, 0);
+		end = MIN(range->element[1]->integer, CLUSTER_SLOTS - 1);
+		for (; start <= end; start++) {
+			slots[start] = p;
+			covered++;
+		}
+	}
+	redis_reply_free(reply);
+
+	ast_rwlock_wrlock(&cluster.lock);
+	memcpy(cluster.slots, slots, sizeof(cluster.slots));
+	ast_rwlock_unlock(&cluster.lock);
+	ast_free(slots);
+
+	if (covered < CLUSTER_SLOTS) {
+		ast_log(LOG_WARNING, "REDIS: Only %d of %d cluster slots are served.\n", covered, CLUSTER_SLOTS);
+	}
+	ast_verb(3, "REDIS: Cluster slot map refreshed from %s:%d.\n", from.host, from.port);
+
+	return 0;
+}
+
+/*!
+ * \brief Parse a MOVED or ASK error.
+ *
+ * \param ask set to 1 for ASK, 0 for MOVED
+ *
+ * \retval 1 the reply is a redirect
+ * \retval 0 it isn't
+ */
+static int redis_cluster_redirect(const redisReply *reply, int *slot, struct redis_addr *addr, int *ask)
+{
+	char target[STR_CONF_SZ + 8];
+	char *colon;
+
+	if (!reply || reply->type != REDIS_REPLY_ERROR) {
+		return 0;
+	}
+	if (!strncmp(reply->str, "MOVED ", 6)) {
+		*ask = 0;
+	} else if (!strncmp(reply->str, "ASK ", 4)) {
+		*ask = 1;
+	} else {
+		return 0;
+	}
+	if (sscanf(reply->str, "%*s %30d %263s", slot, target) != 2
+		|| *slot < 0 || *slot >= CLUSTER_SLOTS || !(colon = strrchr(target, ':'))) {
+		return 0;
+	}
+	*colon++ = '\0';
+	ast_copy_string(addr->host, target, sizeof(addr->host));
+	addr->port = atoi(colon);
+
+	return addr->port > 0;
+}
+
+/*!
+ * \brief Learn from a MOVED error without retrying the command.
+ */
+static void redis_cluster_note_moved(const redisReply *reply)
+{
+	struct redis_addr addr;
+	struct redis_pool *p;
+	int slot;
+	int ask;
+
+	if (!redis_cluster_redirect(reply, &slot, &addr, &ask) || ask) {
+		return;
+	}
+	if ((p = redis_cluster_node(&addr))) {
+		ast_rwlock_wrlock(&cluster.lock);
+		cluster.slots[slot] = p;
+		ast_rwlock_unlock(&cluster.lock);
+	}
+	/* One slot moving usually means a resharding or failover, so reread the rest */
+	redis_cluster_refresh_soon();
+}
+
+/*!
+ * \brief Pool of the node that serves a slot, or the seed pool if unknown.
+ */
+static struct redis_pool *redis_cluster_slot_pool(int slot)
+{
+	struct redis_pool *p;
+
+	ast_rwlock_rdlock(&cluster.lock);
+	p = cluster.slots[slot];
+	ast_rwlock_unlock(&cluster.lock);
+
+	return p ? p : &pool;
+}
+
+static struct redis_pool *redis_cluster_pool(const char *key, size_t len)
+{
+	return redis_cluster_slot_pool(redis_cluster_slot(key, len));
+}
+
+/*! \brief Whether keys are routed by cluster slot */
+static int redis_cluster_enabled(void)
+{
+	int enabled;
+
+	ast_rwlock_rdlock(&cluster.lock);
+	enabled = cluster.enabled;
+	ast_rwlock_unlock(&cluster.lock);
+
+	return enabled;
+}
+
+/*!
+ * \brief Check out a connection for a command on a key.
+ *
+ * In cluster mode this is a connection to the node serving the key,
+ * otherwise to the profile's pool, or for [general] to the master or for
+ * reads a replica if read_from_replicas is set.
+ *
+ * \param key the key as sent, with its prefix
+ */
+static struct redis_conn *redis_key_acquire(struct redis_profile *profile, const char *key, int read)
+{
+	if (redis_cluster_enabled()) {
+		return redis_pool_acquire(redis_cluster_pool(key, strlen(key)));
+	}
+	if (profile) {
+		return redis_pool_acquire(&profile->pool);
+	}
+	return read ? redis_read_acquire() : redis_pool_acquire(&pool);
+}
+
+/*!
+ * \brief Run a command, following cluster redirects.
+ *
+ * On MOVED the slot map is updated and the command is sent again to the new
+ * owner, whose connection replaces *conn. On ASK it is sent once to the
+ * importing node, preceded by ASKING. If the target can't be reached, the
+ * redirect error is returned as is.
+ *
+ * \note *conn is always a connection the caller must release.
+ */
+static redisReply *redis_routed_command(struct redis_conn **conn, const struct redis_args *args)
+{
+	struct redis_conn *target;
+	struct redis_pool *p;
+	struct redis_args asking;
+	struct redis_addr addr;
+	redisReply *reply;
+	int redirects;
+	int slot;
+	int ask;
+
+	reply = redis_logged_command(*conn, args);
+
+	for (redirects = 0; redirects < CLUSTER_MAX_REDIRECTS
+		&& redis_cluster_redirect(reply, &slot, &addr, &ask); redirects++) {
+		if (!(p = redis_cluster_node(&addr)) || !(target = redis_pool_acquire(p))) {
+			break;
+		}
+		if (ask) {
+			redis_args_init(&asking, "ASKING", NULL);
+			redis_reply_free(redis_logged_command(target, &asking));
+		} else {
+			redis_cluster_note_moved(reply);
+		}
+		redis_reply_free(reply);
+		redis_pool_release(*conn);
+		*conn = target;
+		reply = redis_logged_command(*conn, args);
+	}
+
+	return reply;
+}
+
+/*! \brief One MGET of a split batch, for keys that share a slot */
+struct redis_slot_batch {
+	struct redis_args cmd;
+	/*! Position in the caller's list of each key in cmd */
+	int index[MAX_BATCH_KEYS];
+	int count;
+	int slot;
+	/*! Index into the connections of the node serving the slot */
+	int node;
+	redisReply *reply;
+};
+
+/*!
+ * \brief MGET keys that may be spread across cluster nodes.
+ *
+ * Keys are grouped into one MGET per slot, since a cluster refuses MGET
+ * across slots. Every node gets all of its MGETs written before any reply
+ * is read, so the nodes work on them in parallel. A batch that comes back
+ * redirected is sent again on its own.
+ *
+ * \param values receives the reply of each key, NULL if it couldn't be read
+ * \param batches receives the replies that own the values, to be freed with
+ *        redis_slot_batches_free()
+ *
+ * \return the number of batches, or -1 out of memory
+ */
+static int redis_cluster_mget(const char * const *keys, int count, redisReply **values, struct redis_slot_batch **batches)
+{
+	struct redis_pool *pools[MAX_BATCH_KEYS];
+	struct redis_conn *conns[MAX_BATCH_KEYS];
+	struct redis_slot_batch *b;
+	struct redis_conn *conn;
+	struct redis_addr addr;
+	struct timeval start;
+	int nbatches = 0;
+	int nnodes = 0;
+	int slot;
+	int done;
+	int ask;
+	int i;
+	int j;
+
+	if (!(*batches = ast_calloc(count, sizeof(**batches)))) {
+		return -1;
+	}
+	b = *batches;
+
+	for (i = 0; i < count; i++) {
+		values[i] = NULL;
+		slot = redis_cluster_slot(keys[i], strlen(keys[i]));
+		for (j = 0; j < nbatches && b[j].slot != slot; j++) {
+		}
+		if (j == nbatches) {
+			redis_args_init(&b[j].cmd, "MGET", NULL);
+			b[j].slot = slot;
+			nbatches++;
+		}
+		redis_args_addstr(&b[j].cmd, keys[i]);
+		b[j].index[b[j].count++] = i;
+	}
+
+	/* One connection per node, shared by the batches it serves */
+	for (i = 0; i < nbatches; i++) {
+		struct redis_pool *p = redis_cluster_pool(b[i].cmd.argv[1], b[i].cmd.argvlen[1]);
+
+		for (j = 0; j < nnodes && pools[j] != p; j++) {
+		}
+		if (j == nnodes) {
+			pools[j] = p;
+			conns[j] = redis_pool_acquire(p);
+			nnodes++;
+		}
+		b[i].node = j;
+		if (conns[j]) {
+			redis_conn_append(conns[j], &b[i].cmd);
+			redis_log_args("Pipelined: ", &b[i].cmd);
+		}
+	}
+
+	start = ast_tvnow();
+	for (j = 0; j < nnodes; j++) {
+		done = 0;
+		while (conns[j] && !done && redisBufferWrite(conns[j]->ctx, &done) == REDIS_OK) {
+		}
+	}
+	for (i = 0; i < nbatches; i++) {
+		if ((conn = conns[b[i].node]) && !conn->ctx->err) {
+			redis_conn_get_reply(conn, &b[i].reply);
+			redis_stats_record(REDIS_STAT_MGET, conn->ctx, b[i].reply, start);
+		}
+	}
+	for (j = 0; j < nnodes; j++) {
+		redis_pool_release(conns[j]);
+	}
+
+	for (i = 0; i < nbatches; i++) {
+		if (redis_cluster_redirect(b[i].reply, &slot, &addr, &ask)) {
+			redis_cluster_note_moved(b[i].reply);
+			redis_reply_free(b[i].reply);
+			b[i].reply = NULL;
+			if ((conn = redis_pool_acquire(redis_cluster_pool(b[i].cmd.argv[1], b[i].cmd.argvlen[1])))) {
+				b[i].reply = redis_routed_command(&conn, &b[i].cmd);
+				redis_pool_release(conn);
+			}
+		}
+		if (!b[i].reply || b[i].reply->type != REDIS_REPLY_ARRAY || b[i].reply->elements != b[i].count) {
+			continue;
+		}
+		for (j = 0; j < b[i].count; j++) {
+			values[b[i].index[j]] = b[i].reply->element[j];
+		}
+	}
+
+	return nbatches;
+}
+
+static void redis_slot_batches_free(struct redis_slot_batch *batches, int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++) {
+		redis_reply_free(batches[i].reply);
+	}
+	ast_free(batches);
+}
+
+/*!
+ * \brief Point the pools at the configured servers.
+ *
+ * \retval 0 on success
+ * \retval -1 Sentinel or the cluster is configured but couldn't be reached
+ */
+static int redis_pools_configure(void)
+{
+	struct redis_addr master;
+	struct redis_addr replicas[MAX_POOL_ADDRS];
+	int nreplicas;
+	int use_sentinel;
+
+	struct redis_addr seeds[MAX_POOL_ADDRS];
+	int nseeds;
+	int use_cluster;
+
+	ast_mutex_lock(&redis_lock);
+	use_sentinel = sentinel_count > 0;
+	use_cluster = cluster_mode;
+	if (!ast_strlen_zero(unix_socket)) {
+		ast_copy_string(master.host, unix_socket, sizeof(master.host));
+		master.port = 0;
+	} else {
+		ast_copy_string(master.host, hostname, sizeof(master.host));
+		master.port = port;
+	}
+	nreplicas = replica_count;
+	memcpy(replicas, replica_addrs, nreplicas * sizeof(*replicas));
+	seeds[0] = master;
+	nseeds = 1 + MIN(cluster_seed_count, MAX_POOL_ADDRS - 1);
+	memcpy(seeds + 1, cluster_seeds, (nseeds - 1) * sizeof(*seeds));
+	ast_mutex_unlock(&redis_lock);
+
+	ast_rwlock_wrlock(&cluster.lock);
+	/* On a reload that keeps the cluster, the old map serves until the refresh below */
+	if (cluster.enabled != use_cluster) {
+		memset(cluster.slots, 0, sizeof(cluster.slots));
+	}
+	cluster.enabled = use_cluster;
+	cluster.stale = 0;
+	ast_rwlock_unlock(&cluster.lock);
+
+	if (use_cluster) {
+		/* The main pool connects to the seeds, for commands that aren't on a key */
+		redis_pool_set_addrs(&replica_pool, replicas, 0);
+		redis_pool_set_addrs(&pool, seeds, nseeds);
+		/* Keys are routed by slot, profiles only add their prefix */
+		redis_master_set_addrs(NULL);
+		return redis_cluster_refresh();
+	}
+
+	if (nreplicas || !use_sentinel) {
+		redis_pool_set_addrs(&replica_pool, replicas, nreplicas);
+	}
+	if (use_sentinel) {
+		return redis_sentinel_discover();
+	}
+	redis_master_set_addrs(&master);
+
+	return 0;
+}
+
+static void *redis_monitor_thread(void *data)
+{
+	struct redis_pool *pools[2 + MAX_PROFILES + MAX_CLUSTER_NODES] = { &pool, &replica_pool };
+	struct timeval next = { 0, };
+	struct timeval next_ping = ast_tvnow();
+	struct timespec ts;
+	int npools;
+	int refresh;
+	int waiting;
+	int ping_ms;
+	int ping;
+	int due;
+	int i;
+
+	ast_mutex_lock(&monitor.lock);
+	while (!monitor.stop) {
+		monitor.wakeup = 0;
+		ast_mutex_unlock(&monitor.lock);
+
+		ast_rwlock_wrlock(&cluster.lock);
+		refresh = cluster.stale && cluster.enabled;
+		cluster.stale = 0;
+		ast_rwlock_unlock(&cluster.lock);
+		if (refresh && redis_cluster_refresh()) {
+			/* Try again with the next reconnect attempt */
+			ast_rwlock_wrlock(&cluster.lock);
+			cluster.stale = 1;
+			ast_rwlock_unlock(&cluster.lock);
+		}
+
+		ast_mutex_lock(&redis_lock);
+		ping_ms = idle_ping_ms;
+		ast_mutex_unlock(&redis_lock);
+		if ((ping = ping_ms && ast_tvcmp(ast_tvnow(), next_ping) >= 0)) {
+			next_ping = ast_tvadd(ast_tvnow(), ms_to_timeval(ping_ms));
+		}
+
+		npools = 2 + redis_profile_pools(pools + 2, MAX_PROFILES, 1);
+		npools += redis_cluster_nodes(pools + npools, MAX_CLUSTER_NODES);
+		waiting = 0;
+		for (i = 0; i < npools; i++) {
+			if (ping) {
+				redis_pool_ping_idle(pools[i], ping_ms);
+			}
+
+			ast_mutex_lock(&pools[i]->lock);
+			due = pools[i]->circuit_open && ast_tvcmp(ast_tvnow(), pools[i]->next_attempt) >= 0;
+			ast_mutex_unlock(&pools[i]->lock);
+
+			if (due) {
+				redis_circuit_probe(pools[i]);
+			}
+
+			ast_mutex_lock(&pools[i]->lock);
+			if (pools[i]->circuit_open && (!waiting || ast_tvcmp(pools[i]->next_attempt, next) < 0)) {
+				next = pools[i]->next_attempt;
+				waiting = 1;
+			}
+			ast_mutex_unlock(&pools[i]->lock);
+		}
+		if (ping_ms && (!waiting || ast_tvcmp(next_ping, next) < 0)) {
+			next = next_ping;
+			waiting = 1;
+		}
+
+		ast_mutex_lock(&monitor.lock);
+		if (monitor.stop || monitor.wakeup) {
+			continue;
+		}
+		if (!waiting) {
+			ast_cond_wait(&monitor.cond, &monitor.lock);
+		} else {
+			ts.tv_sec = next.tv_sec;
+			ts.tv_nsec = next.tv_usec * 1000;
+			ast_cond_timedwait(&monitor.cond, &monitor.lock, &ts);
+		}
+	}
+	ast_mutex_unlock(&monitor.lock);
+
+	return NULL;
+}
+
+static int redis_monitor_start(void)
+{
+	monitor.stop = 0;
+	if (ast_pthread_create_background(&monitor.thread, NULL, redis_monitor_thread, NULL)) {
+		ast_log(LOG_ERROR, "Unable to start Redis monitor thread.\n");
+		monitor.thread = AST_PTHREADT_NULL;
+		return -1;
+	}
+	return 0;
+}
+
+static void redis_monitor_stop(void)
+{
+	if (monitor.thread == AST_PTHREADT_NULL) {
+		return;
+	}
+	ast_mutex_lock(&monitor.lock);
+	monitor.stop = 1;
+	ast_cond_signal(&monitor.cond);
+	ast_mutex_unlock(&monitor.lock);
+	pthread_join(monitor.thread, NULL);
+	monitor.thread = AST_PTHREADT_NULL;
+}
+
+/*!
+ * \brief Send every configured script to the server with SCRIPT LOAD.
+ *
+ * This only saves REDIS_EVAL from falling back to EVAL the first time each
+ * script runs, so failures are logged and otherwise ignored.
+ */
+static void redis_scripts_load(struct redis_conn *conn)
+{
+	struct redis_script *script;
+	struct redis_args cmd;
+	redisReply *reply;
+	char **sources;
+	char **names;
+	int count = 0;
+	int i;
+
+	ast_mutex_lock(&redis_lock);
+	AST_LIST_TRAVERSE(&scripts, script, list) {
+		count++;
+	}
+	sources = ast_calloc(count ? count : 1, sizeof(*sources));
+	names = ast_calloc(count ? count : 1, sizeof(*names));
+	if (!sources || !names) {
+		ast_mutex_unlock(&redis_lock);
+		ast_free(sources);
+		ast_free(names);
+		return;
+	}
+	i = 0;
+	/* Copy them so nothing is sent while holding the config lock */
+	AST_LIST_TRAVERSE(&scripts, script, list) {
+		sources[i] = ast_strdup(script->source);
+		names[i++] = ast_strdup(script->name);
+	}
+	ast_mutex_unlock(&redis_lock);
+
+	for (i = 0; i < count; i++) {
+		if (!sources[i] || !names[i]) {
+			continue;
+		}
+		redis_args_init(&cmd, "SCRIPT", "LOAD", sources[i], NULL);
+		reply = redis_logged_command(conn, &cmd);
+		if (reply == NULL || reply->type != REDIS_REPLY_STRING) {
+			ast_log(LOG_WARNING, "REDIS: Unable to load script %s. Reason: %s\n", names[i],
+				reply && reply->type == REDIS_REPLY_ERROR ? reply->str : conn->ctx->errstr);
+		} else {
+			ast_verb(3, "REDIS: Loaded script %s as %s.\n", names[i], reply->str);
+		}
+		redis_reply_free(reply);
+	}
+
+	for (i = 0; i < count; i++) {
+		ast_free(sources[i]);
+		ast_free(names[i]);
+	}
+	ast_free(sources);
+	ast_free(names);
+}
+
+/*!
+ * \brief (Re)connect the pools using the current configuration.
+ *
+ * Pools whose servers changed are drained, and pools whose connection
+ * settings changed have their connections replaced in the background, so a
+ * reload that changes neither leaves the connections in use alone. One
+ * connection is then checked out to verify that the master is reachable. If
+ * the circuit is open, the monitor thread is asked to retry right away with
+ * the new settings instead.
+ */
+static int redis_connect(void)
+{
+	struct redis_pool *pools[2 + MAX_PROFILES + MAX_CLUSTER_NODES] = { &pool, &replica_pool };
+	struct redis_conn *conn;
+	int npools = 2;
+	int i;
+
+	if (redis_pools_configure()) {
+		redis_circuit_trip(&pool);
+	}
+
+	npools += redis_profile_pools(pools + npools, MAX_PROFILES, 0);
+	npools += redis_cluster_nodes(pools + npools, MAX_CLUSTER_NODES);
+	for (i = 0; i < npools; i++) {
+		redis_pool_refresh(pools[i]);
+	}
+	/* Pick up a changed idle_ping */
+	redis_monitor_wake();
+
+	ast_mutex_lock(&pool.lock);
+	if (pool.circuit_open) {
+		pool.next_attempt = ast_tvnow();
+		ast_mutex_unlock(&pool.lock);
+		redis_monitor_wake();
+		return -1;
+	}
+	ast_mutex_unlock(&pool.lock);
+
+	if (!(conn = redis_pool_acquire(&pool))) {
+		return -1;
+	}
+	redis_scripts_load(conn);
+	redis_pool_release(conn);
+
+	return 1;
+}
+
+/*! \brief Handle a Sentinel event, any of which may mean the servers changed */
+static void redis_sentinel_handle_message(redisReply *reply)
+{
+	if (reply->type != REDIS_REPLY_ARRAY || reply->elements != 3
+		|| reply->element[0]->type != REDIS_REPLY_STRING
+		|| strcmp(reply->element[0]->str, "message")
+		|| reply->element[1]->type != REDIS_REPLY_STRING
+		|| reply->element[2]->type != REDIS_REPLY_STRING) {
+		return;
+	}
+	ast_verb(3, "REDIS: Sentinel event %s %s\n", reply->element[1]->str, reply->element[2]->str);
+	redis_sentinel_discover();
+}
+
+/*!
+ * \brief Subscribe to the Sentinel events that change where the master or replicas are.
+ */
+static struct redis_conn *redis_sentinel_subscribe(int start)
+{
+	struct redis_conn *conn;
+	redisReply *reply;
+	struct redis_args cmd;
+
+	if (!(conn = redis_sentinel_open(start))) {
+		return NULL;
+	}
+
+	redis_args_init(&cmd, "SUBSCRIBE", "+switch-master", "+slave", "+sdown", "-sdown", NULL);
+	reply = redis_logged_command(conn, &cmd);
+	if (reply == NULL || reply->type != REDIS_REPLY_ARRAY) {
+		ast_log(LOG_WARNING, "REDIS: Unable to subscribe to Sentinel events. Reason: %s\n",
+			reply ? reply->str : conn->ctx->errstr);
+		redis_reply_free(reply);
+		redis_conn_close(conn);
+		return NULL;
+	}
+	redis_reply_free(reply);
+	ast_verb(3, "REDIS: Watching Sentinel %s:%d for failovers.\n", conn->addr.host, conn->addr.port);
+
+	return conn;
+}
+
+static void *redis_sentinel_thread(void *data)
+{
+	struct redis_conn *conn = NULL;
+	redisReply *reply;
+	int retry_ms = 0;
+	int backoff_ms = 0;
+	int start = 0;
+	int res;
+
+	while (!sentinel.stop) {
+		if (!conn) {
+			/* Sleep in short steps so unload isn't held up by a long backoff */
+			if (backoff_ms > 0) {
+				usleep(MIN(backoff_ms, 100) * 1000);
+				backoff_ms -= 100;
+				continue;
+			}
+			if (!(conn = redis_sentinel_subscribe(start++))) {
+				ast_mutex_lock(&redis_lock);
+				retry_ms = retry_ms ? MIN(retry_ms * 2, reconnect_max_ms) : reconnect_min_ms;
+				ast_mutex_unlock(&redis_lock);
+				backoff_ms = retry_ms;
+				continue;
+			}
+			retry_ms = 0;
+			/* Events may have been missed while we weren't subscribed */
+			redis_sentinel_discover();
+		}
+
+		if ((res = redis_conn_wait_reply(conn, 1000, &reply)) > 0) {
+			redis_sentinel_handle_message(reply);
+			redis_reply_free(reply);
+		} else if (res < 0) {
+			ast_log(LOG_WARNING, "REDIS: Lost connection to Sentinel. Reason: %s\n", conn->ctx->errstr);
+			redis_conn_close(conn);
+			conn = NULL;
+		}
+	}
+
+	if (conn) {
+		redis_conn_close(conn);
+	}
+
+	return NULL;
+}
+
+static void redis_sentinel_stop(void)
+{
+	if (sentinel.thread == AST_PTHREADT_NULL) {
+		return;
+	}
+	sentinel.stop = 1;
+	pthread_join(sentinel.thread, NULL);
+	sentinel.thread = AST_PTHREADT_NULL;
+}
+
+/*!
+ * \brief Start or stop the Sentinel event listener to match the configuration.
+ */
+static void redis_sentinel_apply_config(void)
+{
+	int enabled;
+
+	ast_mutex_lock(&redis_lock);
+	enabled = sentinel_count > 0;
+	ast_mutex_unlock(&redis_lock);
+
+	/* The sentinels may have changed, resubscribe */
+	redis_sentinel_stop();
+	if (!enabled) {
+		return;
+	}
+	sentinel.stop = 0;
+	if (ast_pthread_create_background(&sentinel.thread, NULL, redis_sentinel_thread, NULL)) {
+		ast_log(LOG_ERROR, "Unable to start Redis Sentinel thread, failovers need a reload.\n");
+		sentinel.thread = AST_PTHREADT_NULL;
+	}
+}
+
+static int redis_cache_hash_fn(const void *obj, int flags)
+{
+	const struct redis_cache_entry *entry;
+	const struct redis_cache_key *search;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		search = obj;
+		return ast_str_hash(search->key);
+	case OBJ_SEARCH_PARTIAL_KEY:
+		return ast_str_hash(obj);
+	case OBJ_SEARCH_OBJECT:
+	default:
+		entry = obj;
+		return ast_str_hash(entry->key);
+	}
+}
+
+/*!
+ * \note A partial key search matches every field cached for a redis key, which
+ * is what an invalidation needs.
+ */
+static int redis_cache_cmp_fn(void *obj, void *arg, int flags)
+{
+	const struct redis_cache_entry *entry = obj;
+	const struct redis_cache_entry *other;
+	const struct redis_cache_key *search;
+
+	switch (flags & OBJ_SEARCH_MASK) {
+	case OBJ_SEARCH_KEY:
+		search = arg;
+		break;
+	case OBJ_SEARCH_PARTIAL_KEY:
+		return strcmp(entry->key, arg) ? 0 : CMP_MATCH;
+	case OBJ_SEARCH_OBJECT:
+	default:
+		other = arg;
+		if (strcmp(entry->key, other->key)) {
+			return 0;
+		}
+		return (!entry->field == !other->field
+			&& (!entry->field || !strcmp(entry->field, other->field))) ? CMP_MATCH : 0;
+	}
+
+	if (strcmp(entry->key, search->key)) {
+		return 0;
+	}
+	return (!entry->field == !search->field
+		&& (!entry->field || !strcmp(entry->field, search->field))) ? CMP_MATCH : 0;
+}
+
+/*! \note Called with cache.lock held */
+static void redis_cache_unlink(struct redis_cache_entry *entry)
+{
+	AST_DLLIST_REMOVE(&cache.lru, entry, lru);
+	ao2_unlink_flags(cache.entries, entry, OBJ_NOLOCK);
+}
+
+/*! \note Called with cache.lock held */
+static void redis_cache_clear(void)
+{
+	struct redis_cache_entry *entry;
+
+	while ((entry = AST_DLLIST_FIRST(&cache.lru))) {
+		redis_cache_unlink(entry);
+	}
+}
+
+/*!
+ * \brief Look up a cached value.
+ *
+ * \retval 1 hit, value copied to out
+ * \retval -1 hit on a key or field known to be missing, out is untouched
+ * \retval 0 miss
+ */
+static int redis_cache_get(const char *key, const char *field, struct redis_output *out)
+{
+	struct redis_cache_key search = { .key = key, .field = field, };
+	struct redis_cache_entry *entry;
+	int hit = 0;
+
+	ast_mutex_lock(&cache.lock);
+	if (!cache.tracking_id) {
+		ast_mutex_unlock(&cache.lock);
+		return 0;
+	}
+	if ((entry = ao2_find(cache.entries, &search, OBJ_SEARCH_KEY | OBJ_NOLOCK))) {
+		if (ast_tvcmp(ast_tvnow(), entry->expires) < 0) {
+			AST_DLLIST_REMOVE(&cache.lru, entry, lru);
+			AST_DLLIST_INSERT_HEAD(&cache.lru, entry, lru);
+			if (entry->value) {
+				redis_output_set(out, entry->value, entry->value_len);
+				hit = 1;
+			} else {
+				hit = -1;
+			}
+		} else {
+			redis_cache_unlink(entry);
+		}
+		ao2_ref(entry, -1);
+	}
+	if (hit) {
+		cache.hits++;
+	} else {
+		cache.misses++;
+	}
+	ast_mutex_unlock(&cache.lock);
+
+	return hit;
+}
+
+/*! \brief Snapshot of the invalidation epoch, taken before a command is sent */
+static unsigned int redis_cache_epoch(void)
+{
+	unsigned int epoch;
+
+	ast_mutex_lock(&cache.lock);
+	epoch = cache.epoch;
+	ast_mutex_unlock(&cache.lock);
+
+	return epoch;
+}
+
+/*!
+ * \brief Store a value, evicting the least recently used entry when full.
+ *
+ * \param tracking_id client id of the tracked connection the value was read on,
+ *        or 0 for a value pushed by a subscribed message, which replaces the
+ *        cached copy unconditionally and is only bounded by cache_ttl
+ * \param epoch value of redis_cache_epoch() from before the command was sent
+ * \param value NULL to remember that the key or field does not exist, for
+ *        cache_negative_ttl only
+ *
+ * \retval 0 stored
+ * \retval -1 not stored, the value may already be stale
+ */
+static int redis_cache_store(long long tracking_id, unsigned int epoch,
+	const char *key, const char *field, const char *value, size_t value_len)
+{
+	struct redis_cache_entry *entry;
+	struct redis_cache_entry *old;
+	size_t key_len = strlen(key) + 1;
+	size_t field_len = field ? strlen(field) + 1 : 0;
+	int size;
+	int ttl_ms;
+
+	ast_mutex_lock(&redis_lock);
+	size = cache_size;
+	ttl_ms = value ? cache_ttl_ms : cache_negative_ttl_ms;
+	ast_mutex_unlock(&redis_lock);
+
+	if (!ttl_ms) {
+		return -1;
+	}
+
+	if (!(entry = ao2_alloc_options(sizeof(*entry) + key_len + field_len + value_len + 1,
+		NULL, AO2_ALLOC_OPT_LOCK_NOLOCK))) {
+		return -1;
+	}
+	memcpy(entry->key, key, key_len);
+	if (field) {
+		entry->field = entry->key + key_len;
+		memcpy((char *) entry->field, field, field_len);
+	}
+	if (value) {
+		entry->value = entry->key + key_len + field_len;
+		memcpy((char *) entry->value, value, value_len);
+		((char *) entry->value)[value_len] = '\0';
+		entry->value_len = value_len;
+	}
+	entry->expires = ast_tvadd(ast_tvnow(), ms_to_timeval(ttl_ms));
+
+	ast_mutex_lock(&cache.lock);
+	if (!cache.tracking_id
+		|| (tracking_id && (tracking_id != cache.tracking_id || epoch != cache.epoch))) {
+		ast_mutex_unlock(&cache.lock);
+		ao2_ref(entry, -1);
+		return -1;
+	}
+	if (!tracking_id) {
+		/* A read already in flight must not overwrite the pushed value */
+		cache.epoch++;
+	}
+	if ((old = ao2_find(cache.entries, entry, OBJ_SEARCH_OBJECT | OBJ_NOLOCK))) {
+		redis_cache_unlink(old);
+		ao2_ref(old, -1);
+	}
+	while (ao2_container_count(cache.entries) >= size && (old = AST_DLLIST_LAST(&cache.lru))) {
+		redis_cache_unlink(old);
+		cache.evictions++;
+	}
+	ao2_link_flags(cache.entries, entry, OBJ_NOLOCK);
+	AST_DLLIST_INSERT_HEAD(&cache.lru, entry, lru);
+	ast_mutex_unlock(&cache.lock);
+
+	ao2_ref(entry, -1);
+
+	return 0;
+}
+
+/*!
+ * \brief Store a value read on conn.
+ *
+ * \param epoch value of redis_cache_epoch() from before the command was sent
+ * \param value NULL if the server replied nil
+ *
+ * \retval 0 stored
+ * \retval -1 not stored, see redis_cache_store()
+ */
+static int redis_cache_put(struct redis_conn *conn, unsigned int epoch,
+	const char *key, const char *field, const char *value, size_t value_len)
+{
+	return conn->tracking_id ? redis_cache_store(conn->tracking_id, epoch, key, field, value, value_len) : -1;
+}
+
+/*!
+ * \brief Join the read of a key another channel already has in flight, or start one.
+ *
+ * \param[out] leader set to 1 if the caller has to run the command and hand
+ *             the result over with redis_flight_finish()
+ *
+ * \return the flight, or NULL if it could not be allocated and the caller
+ *         should just read on its own
+ */
+static struct redis_flight *redis_flight_join(const struct redis_profile *profile,
+	const char *key, const char *field, int *leader)
+{
+	struct redis_flight *flight;
+	size_t key_len = strlen(key) + 1;
+	size_t field_len = field ? strlen(field) + 1 : 0;
+
+	*leader = 0;
+
+	ast_mutex_lock(&flights.lock);
+	AST_LIST_TRAVERSE(&flights.list, flight, list) {
+		if (flight->profile == profile && !flight->done && !flight->stale && !strcmp(flight->key, key)
+			&& (field ? flight->field && !strcmp(flight->field, field) : !flight->field)) {
+			flight->waiters++;
+			flights.coalesced++;
+			ast_mutex_unlock(&flights.lock);
+			return flight;
+		}
+	}
+	if ((flight = ast_calloc(1, sizeof(*flight) + key_len + field_len))) {
+		flight->profile = profile;
+		memcpy(flight->key, key, key_len);
+		if (field) {
+			flight->field = flight->key + key_len;
+			memcpy((char *) flight->field, field, field_len);
+		}
+		flight->waiters = 1;
+		AST_LIST_INSERT_HEAD(&flights.list, flight, list);
+		*leader = 1;
+	}
+	ast_mutex_unlock(&flights.lock);
+
+	return flight;
+}
+
+/*! \brief Drop a reference to a flight, the last one out frees it. Called with flights.lock held. */
+static void redis_flight_unref(struct redis_flight *flight)
+{
+	if (!--flight->waiters) {
+		ast_free(flight->value);
+		ast_free(flight);
+	}
+}
+
+/*!
+ * \brief Publish the result of a flight to the channels waiting on it.
+ *
+ * A leader that failed because its own REDIS_TIMEOUT_MS ran out hands over
+ * REDIS_STATUS_TIMEOUT. That tells the waiters to read again, since their own
+ * deadlines may allow it, rather than fail with it.
+ *
+ * \param value the string read, or NULL for any status but REDIS_STATUS_OK
+ */
+static void redis_flight_finish(struct redis_flight *flight, enum redis_status status,
+	const char *value, size_t value_len)
+{
+	char *copy = NULL;
+
+	if (value && (copy = ast_malloc(value_len + 1))) {
+		memcpy(copy, value, value_len);
+		copy[value_len] = '\0';
+	} else if (value) {
+		status = REDIS_STATUS_ERROR;
+		value_len = 0;
+	}
+	if ((status == REDIS_STATUS_ERROR || status == REDIS_STATUS_UNAVAILABLE) && redis_deadline_expired()) {
+		status = REDIS_STATUS_TIMEOUT;
+	}
+
+	ast_mutex_lock(&flights.lock);
+	AST_LIST_REMOVE(&flights.list, flight, list);
+	flight->status = status;
+	flight->value = copy;
+	flight->value_len = copy ? value_len : 0;
+	flight->done = 1;
+	ast_cond_broadcast(&flights.cond);
+	redis_flight_unref(flight);
+	ast_mutex_unlock(&flights.lock);
+}
+
+/*!
+ * \brief Wait for the channel leading a flight and take its result.
+ *
+ * \retval REDIS_STATUS_TIMEOUT the leader gave up on its own deadline, and the
+ *         key has to be read again
+ * \retval REDIS_STATUS_ERROR also if the caller's own deadline ran out first
+ */
+static enum redis_status redis_flight_wait(struct redis_flight *flight, struct redis_output *out)
+{
+	enum redis_status status = REDIS_STATUS_ERROR;
+	struct timeval expires;
+	struct timespec ts;
+	int bounded = redis_deadline_get(&expires);
+
+	ts.tv_sec = expires.tv_sec;
+	ts.tv_nsec = bounded ? expires.tv_usec * 1000 : 0;
+
+	ast_mutex_lock(&flights.lock);
+	while (!flight->done) {
+		if (!bounded) {
+			ast_cond_wait(&flights.cond, &flights.lock);
+		} else if (ast_cond_timedwait(&flights.cond, &flights.lock, &ts) == ETIMEDOUT) {
+			break;
+		}
+	}
+	if (flight->done) {
+		status = flight->status;
+	}
+	if (flight->value) {
+		redis_output_set(out, flight->value, flight->value_len);
+	}
+	redis_flight_unref(flight);
+	ast_mutex_unlock(&flights.lock);
+
+	return status;
+}
+
+/*!
+ * \brief Drop every cached field of a key, or everything if key is NULL.
+ *
+ * \note Called with cache.lock held.
+ */
+static void redis_cache_drop(const char *key)
+{
+	struct ao2_iterator *matches;
+	struct redis_cache_entry *entry;
+
+	cache.epoch++;
+	if (!key) {
+		redis_cache_clear();
+	} else if ((matches = ao2_callback(cache.entries, OBJ_SEARCH_PARTIAL_KEY | OBJ_MULTIPLE | OBJ_NOLOCK,
+		NULL, (void *) key))) {
+		while ((entry = ao2_iterator_next(matches))) {
+			redis_cache_unlink(entry);
+			ao2_ref(entry, -1);
+		}
+		ao2_iterator_destroy(matches);
+	}
+}
+
+/*!
+ * \brief Drop every cached field of a key the server invalidated, or everything if key is NULL.
+ */
+static void redis_cache_invalidate(const char *key)
+{
+	ast_mutex_lock(&cache.lock);
+	cache.invalidations++;
+	redis_cache_drop(key);
+	ast_mutex_unlock(&cache.lock);
+}
+
+/*!
+ * \brief Forget what is known locally about a key that a write changes.
+ *
+ * Called before the write is sent or queued, so the same channel never reads
+ * the old value back from the cache or from a read already in flight, and
+ * again once the write is done, to drop what a read running alongside it may
+ * have stored. Waiting for the invalidation push instead would leave the old
+ * value in place for a round trip, or for the whole async queue.
+ *
+ * \param key the key as sent, with its prefix
+ */
+static void redis_cache_evict(const struct redis_profile *profile, const char *key)
+{
+	struct redis_flight *flight;
+
+	/* Only keys of [general] are cached */
+	if (!profile) {
+		ast_mutex_lock(&cache.lock);
+		redis_cache_drop(key);
+		ast_mutex_unlock(&cache.lock);
+	}
+
+	ast_mutex_lock(&flights.lock);
+	AST_LIST_TRAVERSE(&flights.list, flight, list) {
+		if (flight->profile == profile && !strcmp(flight->key, key)) {
+			flight->stale = 1;
+		}
+	}
+	ast_mutex_unlock(&flights.lock);
+}
+
+static void redis_cache_handle_message(redisReply *reply)
+{
+	redisReply *keys;
+	size_t i;
+
+	/* [ "message", "__redis__:invalidate", [ key, ... ] | nil ] */
+	if (!redis_reply_is_array(reply) || reply->elements != 3
+		|| reply->element[0]->type != REDIS_REPLY_STRING
+		|| strcmp(reply->element[0]->str, "message")) {
+		return;
+	}
+
+	keys = reply->element[2];
+	if (keys->type == REDIS_REPLY_ARRAY) {
+		for (i = 0; i < keys->elements; i++) {
+			if (keys->element[i]->type == REDIS_REPLY_STRING) {
+				redis_cache_invalidate(keys->element[i]->str);
+			}
+		}
+	} else {
+		/* FLUSHDB / FLUSHALL, or the server lost track of what we read */
+		redis_cache_invalidate(NULL);
+	}
+}
+
+/*!
+ * \brief Subscribe to invalidations and publish the listener's client id.
+ *
+ * The pool is drained afterwards so every connection re-registers its
+ * tracking redirect with the new listener.
+ */
+static int redis_cache_listen(struct redis_conn *conn)
+{
+	redisReply *reply;
+	struct redis_args cmd;
+	long long id;
+
+	redis_args_init(&cmd, "CLIENT", "ID", NULL);
+	reply = redis_logged_command(conn, &cmd);
+	if (reply == NULL || reply->type != REDIS_REPLY_INTEGER) {
+		ast_log(LOG_WARNING, "REDIS: Unable to get client id for cache invalidation. Reason: %s\n",
+			reply ? reply->str : conn->ctx->errstr);
+		redis_reply_free(reply);
+		return -1;
+	}
+	id = reply->integer;
+	redis_reply_free(reply);
+
+	redis_conn_keep_pushes(conn);
+	redis_args_init(&cmd, "SUBSCRIBE", REDIS_INVALIDATE_CHANNEL, NULL);
+	reply = redis_logged_command(conn, &cmd);
+	if (reply == NULL || !redis_reply_is_array(reply)) {
+		ast_log(LOG_WARNING, "REDIS: Unable to subscribe to cache invalidations. Reason: %s\n",
+			reply ? reply->str : conn->ctx->errstr);
+		redis_reply_free(reply);
+		return -1;
+	}
+	redis_reply_free(reply);
+
+	ast_mutex_lock(&cache.lock);
+	cache.tracking_id = id;
+	ast_mutex_unlock(&cache.lock);
+
+	redis_pool_drain(&pool);
+	ast_verb(3, "Redis cache invalidation listener subscribed as client %lld.\n", id);
+
+	return 0;
+}
+
+static void redis_cache_unlisten(void)
+{
+	ast_mutex_lock(&cache.lock);
+	cache.tracking_id = 0;
+	cache.epoch++;
+	redis_cache_clear();
+	ast_mutex_unlock(&cache.lock);
+}
+
+/* The preload is run by the listener, each time it subscribes */
+static void redis_preload_start(void);
+static void redis_preload_stop(void);
+
+static void *redis_cache_thread(void *data)
+{
+	struct redis_conn *conn = NULL;
+	redisReply *reply;
+	int retry_ms = 0;
+	int backoff_ms = 0;
+	int res;
+
+	while (!cache.stop) {
+		if (!conn) {
+			/* Sleep in short steps so unload isn't held up by a long backoff */
+			if (backoff_ms > 0) {
+				usleep(MIN(backoff_ms, 100) * 1000);
+				backoff_ms -= 100;
+				continue;
+			}
+			if (!(conn = redis_conn_open(&pool, 0, 0)) || redis_cache_listen(conn)) {
+				if (conn) {
+					redis_conn_close(conn);
+					conn = NULL;
+				}
+				ast_mutex_lock(&redis_lock);
+				retry_ms = retry_ms ? MIN(retry_ms * 2, reconnect_max_ms) : reconnect_min_ms;
+				ast_mutex_unlock(&redis_lock);
+				backoff_ms = retry_ms;
+				continue;
+			}
+			retry_ms = 0;
+			/* The cache was emptied when the previous listener went away */
+			redis_preload_start();
+		}
+
+		if ((res = redis_conn_wait_reply(conn, 1000, &reply)) > 0) {
+			redis_cache_handle_message(reply);
+			redis_reply_free(reply);
+		} else if (res < 0) {
+			ast_log(LOG_WARNING, "REDIS: Cache invalidation listener disconnected. Reason: %s\n",
+				conn->ctx->errstr);
+			redis_cache_unlisten();
+			redis_conn_close(conn);
+			conn = NULL;
+		} else if (!redis_pool_has_addr(&pool, &conn->addr)) {
+			/* The master failed over, invalidations now come from the new one */
+			redis_cache_unlisten();
+			redis_conn_close(conn);
+			conn = NULL;
+		}
+	}
+
+	redis_preload_stop();
+	ast_mutex_lock(&preload.lock);
+	preload.state = PRELOAD_OFF;
+	ast_mutex_unlock(&preload.lock);
+	redis_cache_unlisten();
+	if (conn) {
+		redis_conn_close(conn);
+	}
+
+	return NULL;
+}
+
+static void redis_cache_stop(void)
+{
+	if (cache.thread == AST_PTHREADT_NULL) {
+		return;
+	}
+	cache.stop = 1;
+	pthread_join(cache.thread, NULL);
+	cache.thread = AST_PTHREADT_NULL;
+}
+
+/*!
+ * \brief Start or stop the invalidation listener to match the configuration.
+ *
+ * \param restart non-zero if the main pool's connections were replaced,
+ * otherwise a running listener and the cache are kept
+ */
+static void redis_cache_apply_config(int restart)
+{
+	int enabled;
+
+	ast_mutex_lock(&redis_lock);
+	enabled = cache_enabled;
+	ast_mutex_unlock(&redis_lock);
+
+	if (!enabled) {
+		redis_cache_stop();
+		return;
+	}
+	if (!restart && cache.thread != AST_PTHREADT_NULL) {
+		return;
+	}
+
+	/* Settings may have changed, flush and let the listener reconnect */
+	redis_cache_stop();
+	cache.stop = 0;
+	if (ast_pthread_create_background(&cache.thread, NULL, redis_cache_thread, NULL)) {
+		ast_log(LOG_ERROR, "Unable to start Redis cache invalidation thread, caching disabled.\n");
+		cache.thread = AST_PTHREADT_NULL;
+	}
+}
+
+/*!
+ * \brief Raise a RedisMessage event, and update the cache if subscribe_cache is set.
+ */
+static void redis_subscriber_handle_message(redisReply *reply, int use_cache)
+{
+	redisReply *pattern = NULL;
+	redisReply *channel;
+	redisReply *payload;
+	struct ast_json *blob;
+
+	/* [ "message", channel, payload ] or [ "pmessage", pattern, channel, payload ] */
+	if (!redis_reply_is_array(reply) || reply->elements < 3
+		|| reply->element[0]->type != REDIS_REPLY_STRING) {
+		return;
+	}
+	if (!strcmp(reply->element[0]->str, "message") && reply->elements == 3) {
+		channel = reply->element[1];
+		payload = reply->element[2];
+	} else if (!strcmp(reply->element[0]->str, "pmessage") && reply->elements == 4) {
+		pattern = reply->element[1];
+		channel = reply->element[2];
+		payload = reply->element[3];
+	} else {
+		/* Subscription confirmations */
+		return;
+	}
+	if (channel->type != REDIS_REPLY_STRING || payload->type != REDIS_REPLY_STRING
+		|| (pattern && pattern->type != REDIS_REPLY_STRING)) {
+		return;
+	}
+
+	ast_atomic_fetchadd_int((int *) &subscriber.messages, 1);
+
+	if (use_cache) {
+		/* The channel names the key and the payload is its new value */
+		redis_cache_store(0, 0, channel->str, NULL, payload->str, payload->len);
+	}
+
+	if (!(blob = ast_json_pack("{s: s, s: s, s: s}",
+		"Channel", channel->str,
+		"Pattern", pattern ? pattern->str : "",
+		"Message", payload->str))) {
+		ast_debug(1, "REDIS: Message on %s is not valid UTF-8, no event raised.\n", channel->str);
+		return;
+	}
+	ast_manager_publish_event("RedisMessage", EVENT_FLAG_USER, blob);
+	ast_json_unref(blob);
+}
+
+/*!
+ * \brief Send SUBSCRIBE or PSUBSCRIBE for a comma separated list.
+ *
+ * Only the first confirmation is read here, the rest arrive like messages
+ * and are skipped by redis_subscriber_handle_message().
+ */
+static int redis_subscriber_send(struct redis_conn *conn, const char *verb, char *list)
+{
+	struct redis_args cmd;
+	redisReply *reply;
+	char *name;
+
+	redis_args_init(&cmd, verb, NULL);
+	while ((name = strsep(&list, ","))) {
+		name = ast_strip(name);
+		if (!ast_strlen_zero(name)) {
+			redis_args_addstr(&cmd, name);
+		}
+	}
+	if (cmd.argc == 1) {
+		return 0;
+	}
+
+	reply = redis_logged_command(conn, &cmd);
+	if (reply == NULL || !redis_reply_is_array(reply)) {
+		ast_log(LOG_WARNING, "REDIS: Unable to %s. Reason: %s\n", verb,
+			reply && reply->type == REDIS_REPLY_ERROR ? reply->str : conn->ctx->errstr);
+		redis_reply_free(reply);
+		return -1;
+	}
+	redis_reply_free(reply);
+
+	return 0;
+}
+
+static struct redis_conn *redis_subscriber_subscribe(void)
+{
+	char channels[SUBSCRIBE_CONF_SZ];
+	char patterns[SUBSCRIBE_CONF_SZ];
+	struct redis_conn *conn;
+
+	ast_mutex_lock(&redis_lock);
+	ast_copy_string(channels, subscribe_channels, sizeof(channels));
+	ast_copy_string(patterns, subscribe_patterns, sizeof(patterns));
+	ast_mutex_unlock(&redis_lock);
+
+	if (!(conn = redis_conn_open(&pool, 0, 0))) {
+		return NULL;
+	}
+	redis_conn_keep_pushes(conn);
+	if (redis_subscriber_send(conn, "SUBSCRIBE", channels)
+		|| redis_subscriber_send(conn, "PSUBSCRIBE", patterns)) {
+		redis_conn_close(conn);
+		return NULL;
+	}
+	ast_verb(3, "REDIS: Subscribed to messages on %s:%d.\n", conn->addr.host, conn->addr.port);
+
+	return conn;
+}
+
+static void *redis_subscriber_thread(void *data)
+{
+	struct redis_conn *conn = NULL;
+	redisReply *reply;
+	int retry_ms = 0;
+	int backoff_ms = 0;
+	int use_cache;
+	int res;
+
+	ast_mutex_lock(&redis_lock);
+	use_cache = subscribe_cache && cache_enabled;
+	ast_mutex_unlock(&redis_lock);
+
+	while (!subscriber.stop) {
+		if (!conn) {
+			/* Sleep in short steps so unload isn't held up by a long backoff */
+			if (backoff_ms > 0) {
+				usleep(MIN(backoff_ms, 100) * 1000);
+				backoff_ms -= 100;
+				continue;
+			}
+			if (!(conn = redis_subscriber_subscribe())) {
+				ast_mutex_lock(&redis_lock);
+				retry_ms = retry_ms ? MIN(retry_ms * 2, reconnect_max_ms) : reconnect_min_ms;
+				ast_mutex_unlock(&redis_lock);
+				backoff_ms = retry_ms;
+				continue;
+			}
+			retry_ms = 0;
+		}
+
+		if ((res = redis_conn_wait_reply(conn, 1000, &reply)) > 0) {
+			redis_subscriber_handle_message(reply, use_cache);
+			redis_reply_free(reply);
+		} else if (res < 0) {
+			ast_log(LOG_WARNING, "REDIS: Subscriber disconnected. Reason: %s\n", conn->ctx->errstr);
+			redis_conn_close(conn);
+			conn = NULL;
+		}
+	}
+
+	if (conn) {
+		redis_conn_close(conn);
+	}
+
+	return NULL;
+}
+
+static void redis_subscriber_stop(void)
+{
+	if (subscriber.thread == AST_PTHREADT_NULL) {
+		return;
+	}
+	subscriber.stop = 1;
+	pthread_join(subscriber.thread, NULL);
+	subscriber.thread = AST_PTHREADT_NULL;
+}
+
+/*!
+ * \brief Start or stop the subscriber to match the configuration.
+ */
+static void redis_subscriber_apply_config(void)
+{
+	int enabled;
+
+	ast_mutex_lock(&redis_lock);
+	enabled = !ast_strlen_zero(subscribe_channels) || !ast_strlen_zero(subscribe_patterns);
+	ast_mutex_unlock(&redis_lock);
+
+	/* The channels may have changed, resubscribe */
+	redis_subscriber_stop();
+	if (!enabled) {
+		return;
+	}
+	subscriber.stop = 0;
+	if (ast_pthread_create_background(&subscriber.thread, NULL, redis_subscriber_thread, NULL)) {
+		ast_log(LOG_ERROR, "Unable to start Redis subscriber thread, no RedisMessage events.\n");
+		subscriber.thread = AST_PTHREADT_NULL;
+	}
+}
+
+static void redis_async_cmd_free(struct redis_async_cmd *item)
+{
+	redisFreeCommand(item->cmd);
+	ast_free(item);
+}
+
+/*!
+ * \brief Format a command to be sent later.
+ *
+ * \param keyed non-zero if argv[1] is the key, which decides the cluster node
+ */
+static struct redis_async_cmd *redis_async_cmd_alloc(const struct redis_args *args, int keyed,
+	struct redis_profile *profile)
+{
+	struct redis_async_cmd *item;
+
+	if (!(item = ast_calloc(1, sizeof(*item) + (keyed ? args->argvlen[1] + 1 : 0)))) {
+		return NULL;
+	}
+	item->len = redisFormatCommandArgv(&item->cmd, args->argc, (const char **) args->argv, args->argvlen);
+	if (item->len < 0) {
+		ast_free(item);
+		return NULL;
+	}
+	item->stat = redis_stat_lookup(args);
+	item->slot = keyed ? redis_cluster_slot(args->argv[1], args->argvlen[1]) : -1;
+	item->profile = profile;
+	if (keyed) {
+		memcpy(item->data, args->argv[1], args->argvlen[1]);
+		item->key = item->data;
+	}
+
+	return item;
+}
+
+/*!
+ * \brief Queue a command for the async writer.
+ *
+ * \retval 0 queued
+ * \retval -1 the queue is full or the command could not be formatted
+ */
+static int redis_async_enqueue(const struct redis_args *args, int keyed, struct redis_profile *profile)
+{
+	struct redis_async_cmd *item;
+	int limit;
+
+	redis_log_args("Queued: ", args);
+
+	if (!(item = redis_async_cmd_alloc(args, keyed, profile))) {
+		return -1;
+	}
+
+	ast_mutex_lock(&redis_lock);
+	limit = async_queue_size;
+	ast_mutex_unlock(&redis_lock);
+
+	ast_mutex_lock(&async.lock);
+	if (async.queued >= limit || async.stop) {
+		async.dropped++;
+		ast_mutex_unlock(&async.lock);
+		redis_async_cmd_free(item);
+		return -1;
+	}
+	AST_LIST_INSERT_TAIL(&async.queue, item, list);
+	async.queued++;
+	ast_cond_signal(&async.cond);
+	ast_mutex_unlock(&async.lock);
+
+	return 0;
+}
+
+/*!
+ * \brief Pipeline a batch of queued commands on one connection and check their replies.
+ *
+ * The connection is released and the batch freed afterwards.
+ */
+static void redis_async_send(struct redis_conn *conn, struct redis_async_batch *batch,
+	unsigned int *written, unsigned int *errors)
+{
+	struct redis_async_cmd *item;
+	redisReply *reply;
+	struct timeval start;
+
+	start = ast_tvnow();
+	AST_LIST_TRAVERSE(batch, item, list) {
+		redisAppendFormattedCommand(conn->ctx, item->cmd, item->len);
+	}
+
+	/* The first read flushes the whole batch to the socket */
+	while ((item = AST_LIST_REMOVE_HEAD(batch, list))) {
+		reply = NULL;
+		if (conn->ctx->err != 0 || redis_conn_get_reply(conn, &reply) != REDIS_OK) {
+			(*errors)++;
+		} else if (reply->type == REDIS_REPLY_ERROR) {
+			ast_log(LOG_WARNING, "REDIS: Async write failed. Reason: %s\n", reply->str);
+			redis_cluster_note_moved(reply);
+			(*errors)++;
+		} else {
+			(*written)++;
+		}
+		redis_stats_record(item->stat, conn->ctx, reply, start);
+		redis_reply_free(reply);
+		if (item->key) {
+			redis_cache_evict(item->profile, item->key);
+		}
+		redis_async_cmd_free(item);
+	}
+
+	if (conn->ctx->err != 0) {
+		ast_log(LOG_WARNING, "REDIS: Async write batch failed. Reason: %s\n", conn->ctx->errstr);
+	}
+	redis_pool_release(conn);
+}
+
+/*!
+ * \brief Pool an async command is sent on.
+ */
+static struct redis_pool *redis_async_pool(const struct redis_async_cmd *item, int clustered)
+{
+	if (clustered) {
+		return item->slot >= 0 ? redis_cluster_slot_pool(item->slot) : &pool;
+	}
+	return item->profile ? &item->profile->pool : &pool;
+}
+
+/*!
+ * \brief Move the commands for one pool to the end of another list, keeping their order.
+ *
+ * \return the number of commands moved
+ */
+static int redis_async_take(struct redis_async_batch *from, struct redis_async_batch *to,
+	struct redis_pool *p, int clustered)
+{
+	struct redis_async_cmd *item;
+	int count = 0;
+
+	AST_LIST_TRAVERSE_SAFE_BEGIN(from, item, list) {
+		if (redis_async_pool(item, clustered) == p) {
+			AST_LIST_REMOVE_CURRENT(list);
+			AST_LIST_INSERT_TAIL(to, item, list);
+			count++;
+		}
+	}
+	AST_LIST_TRAVERSE_SAFE_END;
+
+	return count;
+}
+
+/*!
+ * \brief Pipeline one batch of queued commands and check their replies.
+ *
+ * The batch is split by node in cluster mode and by profile otherwise,
+ * keeping the order of the writes to each pool. Every pool is treated alike:
+ * the writes for one whose circuit is open stay queued, and those for one
+ * that no connection could be checked out of go back to the front of the
+ * queue, so they are retried while the writes for the other pools go out.
+ * Writes for a pool without servers are dropped.
+ *
+ * \note Called with async.lock held; it is released while talking to Redis.
+ *
+ * \return the number of commands sent
+ */
+static int redis_async_flush(void)
+{
+	struct redis_async_batch batch = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+	struct redis_async_batch node = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+	struct redis_async_batch held = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+	struct redis_async_cmd *item;
+	struct redis_conn *conn;
+	struct redis_pool *p;
+	unsigned int written = 0;
+	unsigned int errors = 0;
+	int clustered = redis_cluster_enabled();
+	int count = 0;
+	int kept = 0;
+	int sent = 0;
+	int naddrs;
+
+	AST_LIST_TRAVERSE_SAFE_BEGIN(&async.queue, item, list) {
+		if (count >= ASYNC_BATCH_SIZE) {
+			break;
+		}
+		/* Read without the pool's lock, a pool that just went down is held back below */
+		if (redis_async_pool(item, clustered)->circuit_open) {
+			continue;
+		}
+		AST_LIST_REMOVE_CURRENT(list);
+		AST_LIST_INSERT_TAIL(&batch, item, list);
+		async.queued--;
+		count++;
+	}
+	AST_LIST_TRAVERSE_SAFE_END;
+	ast_mutex_unlock(&async.lock);
+
+	while (!AST_LIST_EMPTY(&batch)) {
+		p = redis_async_pool(AST_LIST_FIRST(&batch), clustered);
+		count = redis_async_take(&batch, &node, p, clustered);
+
+		if ((conn = redis_pool_acquire(p))) {
+			redis_async_send(conn, &node, &written, &errors);
+			sent += count;
+			continue;
+		}
+
+		ast_mutex_lock(&p->lock);
+		naddrs = p->naddrs;
+		ast_mutex_unlock(&p->lock);
+		if (naddrs) {
+			AST_LIST_APPEND_LIST(&held, &node, list);
+			kept += count;
+			continue;
+		}
+		while ((item = AST_LIST_REMOVE_HEAD(&node, list))) {
+			errors++;
+			redis_async_cmd_free(item);
+		}
+	}
+
+	ast_mutex_lock(&async.lock);
+	if (kept) {
+		/* Ahead of what was queued meanwhile, which keeps the order of each pool's writes */
+		AST_LIST_APPEND_LIST(&held, &async.queue, list);
+		AST_LIST_APPEND_LIST(&async.queue, &held, list);
+		async.queued += kept;
+	}
+	async.written += written;
+	async.errors += errors;
+
+	return sent;
+}
+
+static void *redis_async_thread(void *data)
+{
+	struct timespec ts;
+	struct timeval retry;
+
+	ast_mutex_lock(&async.lock);
+	for (;;) {
+		if (AST_LIST_EMPTY(&async.queue)) {
+			if (async.stop) {
+				break;
+			}
+			ast_cond_wait(&async.cond, &async.lock);
+			continue;
+		}
+		if (!redis_async_flush() && !AST_LIST_EMPTY(&async.queue)) {
+			if (async.stop) {
+				/* Nowhere to send what's left */
+				break;
+			}
+			/* Keep queueing while the servers are away instead of spinning */
+			retry = ast_tvadd(ast_tvnow(), ms_to_timeval(reconnect_min_ms));
+			ts.tv_sec = retry.tv_sec;
+			ts.tv_nsec = retry.tv_usec * 1000;
+			ast_cond_timedwait(&async.cond, &async.lock, &ts);
+		}
+	}
+	ast_mutex_unlock(&async.lock);
+
+	return NULL;
+}
+
+static int redis_async_start(void)
+{
+	async.stop = 0;
+	if (ast_pthread_create_background(&async.thread, NULL, redis_async_thread, NULL)) {
+		ast_log(LOG_ERROR, "Unable to start Redis async writer thread.\n");
+		async.thread = AST_PTHREADT_NULL;
+		return -1;
+	}
+	return 0;
+}
+
+/*!
+ * \brief Stop the writer after it has flushed what is still queued.
+ */
+static void redis_async_stop(void)
+{
+	struct redis_async_cmd *item;
+
+	if (async.thread != AST_PTHREADT_NULL) {
+		ast_mutex_lock(&async.lock);
+		async.stop = 1;
+		ast_cond_signal(&async.cond);
+		ast_mutex_unlock(&async.lock);
+		pthread_join(async.thread, NULL);
+		async.thread = AST_PTHREADT_NULL;
+	}
+
+	ast_mutex_lock(&async.lock);
+	while ((item = AST_LIST_REMOVE_HEAD(&async.queue, list))) {
+		async.dropped++;
+		redis_async_cmd_free(item);
+	}
+	async.queued = 0;
+	ast_mutex_unlock(&async.lock);
+}
+
+/*! \brief Writes a channel buffers between REDIS_BEGIN and REDIS_COMMIT */
+struct redis_batch {
+	struct redis_async_batch cmds;
+	int count;
+	/*! Set by the p option, send without MULTI and EXEC */
+	int pipeline;
+};
+
+static void redis_batch_destroy(void *data)
+{
+	struct redis_batch *batch = data;
+	struct redis_async_cmd *item;
+
+	while ((item = AST_LIST_REMOVE_HEAD(&batch->cmds, list))) {
+		redis_async_cmd_free(item);
+	}
+	ast_free(batch);
+}
+
+static const struct ast_datastore_info redis_batch_info = {
+	.type = "REDIS_BATCH",
+	.destroy = redis_batch_destroy,
+};
+
+/*!
+ * \brief Buffer a write if the channel is between REDIS_BEGIN and REDIS_COMMIT.
+ *
+ * \param keyed non-zero if argv[1] is the key
+ *
+ * \retval 1 buffered
+ * \retval 0 no batch is open, the write should be sent now
+ * \retval -1 a batch is open but the write couldn't be added to it
+ */
+static int redis_batch_add(struct ast_channel *chan, const struct redis_args *args, int keyed,
+	struct redis_profile *profile)
+{
+	struct ast_datastore *datastore;
+	struct redis_batch *batch;
+	struct redis_async_cmd *item;
+
+	if (!chan) {
+		return 0;
+	}
+
+	ast_channel_lock(chan);
+	if (!(datastore = ast_channel_datastore_find(chan, &redis_batch_info, NULL))) {
+		ast_channel_unlock(chan);
+		return 0;
+	}
+	batch = datastore->data;
+	if (batch->count >= MAX_BATCH_CMDS) {
+		ast_channel_unlock(chan);
+		ast_log(LOG_WARNING, "REDIS: More than %d writes between REDIS_BEGIN and REDIS_COMMIT, dropping one.\n",
+			MAX_BATCH_CMDS);
+		return -1;
+	}
+	if (!(item = redis_async_cmd_alloc(args, keyed, profile))) {
+		ast_channel_unlock(chan);
+		return -1;
+	}
+	AST_LIST_INSERT_TAIL(&batch->cmds, item, list);
+	batch->count++;
+	ast_channel_unlock(chan);
+
+	redis_log_args("Batched: ", args);
+
+	return 1;
+}
+
+/*!
+ * \brief Send commands as one MULTI/EXEC transaction, in a single round trip.
+ *
+ * The connection is not released, and the commands are freed afterwards.
+ *
+ * \return the number of commands that failed, all of them if the
+ * transaction was aborted
+ */
+static int redis_batch_exec(struct redis_conn *conn, struct redis_async_batch *cmds, int count)
+{
+	struct redis_async_cmd *item;
+	struct redis_args cmd;
+	redisReply *reply = NULL;
+	redisReply *exec = NULL;
+	struct timeval start;
+	int failed = 0;
+	int i;
+
+	start = ast_tvnow();
+	redis_args_init(&cmd, "MULTI", NULL);
+	redis_conn_append(conn, &cmd);
+	AST_LIST_TRAVERSE(cmds, item, list) {
+		redisAppendFormattedCommand(conn->ctx, item->cmd, item->len);
+	}
+	redis_args_init(&cmd, "EXEC", NULL);
+	redis_conn_append(conn, &cmd);
+
+	/* +OK for MULTI and +QUEUED for each command, or an error if one is refused */
+	for (i = 0; i <= count; i++) {
+		if (redis_conn_get_reply(conn, &reply) != REDIS_OK) {
+			break;
+		}
+		if (reply->type == REDIS_REPLY_ERROR) {
+			ast_log(LOG_WARNING, "REDIS_COMMIT: Command refused. Reason: %s\n", reply->str);
+			redis_cluster_note_moved(reply);
+		}
+		redis_reply_free(reply);
+	}
+	if (conn->ctx->err == 0 && redis_conn_get_reply(conn, &exec) == REDIS_OK
+		&& !redis_reply_is_array(exec)) {
+		/* EXECABORT after a refused command */
+		ast_log(LOG_WARNING, "REDIS_COMMIT: Transaction aborted. Reason: %s\n",
+			exec->type == REDIS_REPLY_ERROR ? exec->str : "unexpected reply");
+	}
+	if (conn->ctx->err != 0) {
+		ast_log(LOG_WARNING, "REDIS_COMMIT: Transaction failed. Reason: %s\n", conn->ctx->errstr);
+	}
+
+	for (i = 0; (item = AST_LIST_REMOVE_HEAD(cmds, list)); i++) {
+		reply = exec && redis_reply_is_array(exec) && i < exec->elements ? exec->element[i] : NULL;
+		if (!reply || reply->type == REDIS_REPLY_ERROR) {
+			if (reply) {
+				ast_log(LOG_WARNING, "REDIS_COMMIT: Write failed. Reason: %s\n", reply->str);
+			}
+			failed++;
+		}
+		redis_stats_record(item->stat, conn->ctx, reply, start);
+		if (item->key) {
+			redis_cache_evict(item->profile, item->key);
+		}
+		redis_async_cmd_free(item);
+	}
+	redis_reply_free(exec);
+
+	return failed;
+}
+
+enum {
+	OPT_ASYNC = (1 << 0),
+	OPT_SYNC = (1 << 1),
+	OPT_EXPIRE = (1 << 2),
+	OPT_PEXPIRE = (1 << 3),
+	OPT_NX = (1 << 4),
+	OPT_XX = (1 << 5),
+	OPT_PIPELINE = (1 << 6),
+	OPT_SCAN = (1 << 7),
+	OPT_COMPRESS = (1 << 8),
+};
+
+enum {
+	OPT_ARG_EXPIRE,
+	OPT_ARG_PEXPIRE,
+	/* This must be the last element */
+	OPT_ARG_ARRAY_SIZE,
+};
+
+AST_APP_OPTIONS(redis_write_options, BEGIN_OPTIONS
+	AST_APP_OPTION('a', OPT_ASYNC),
+	AST_APP_OPTION('s', OPT_SYNC),
+	AST_APP_OPTION_ARG('e', OPT_EXPIRE, OPT_ARG_EXPIRE),
+	AST_APP_OPTION_ARG('p', OPT_PEXPIRE, OPT_ARG_PEXPIRE),
+	AST_APP_OPTION('n', OPT_NX),
+	AST_APP_OPTION('x', OPT_XX),
+	AST_APP_OPTION('z', OPT_COMPRESS),
+END_OPTIONS);
+
+AST_APP_OPTIONS(redis_begin_options, BEGIN_OPTIONS
+	AST_APP_OPTION('p', OPT_PIPELINE),
+END_OPTIONS);
+
+AST_APP_OPTIONS(redis_hgetall_options, BEGIN_OPTIONS
+	AST_APP_OPTION('s', OPT_SCAN),
+END_OPTIONS);
+
+static void redis_write_parse_options(char *options, struct ast_flags *flags, char **opts)
+{
+	if (!ast_strlen_zero(options)) {
+		ast_app_parse_options(redis_write_options, flags, opts, options);
+	}
+}
+
+/*!
+ * \brief Decide whether a write should go through the async writer.
+ *
+ * The a and s options override the async_writes setting.
+ */
+static int redis_write_use_async(const struct redis_keyspace *space, const struct ast_flags *flags)
+{
+	int use_async = space->async_writes;
+
+	if (ast_test_flag(flags, OPT_ASYNC)) {
+		use_async = 1;
+	} else if (ast_test_flag(flags, OPT_SYNC)) {
+		use_async = 0;
+	}
+
+	return use_async;
+}
+
+static int redis_write_is_async(const struct redis_keyspace *space, char *options)
+{
+	struct ast_flags flags = { 0 };
+	char *opts[OPT_ARG_ARRAY_SIZE] = { NULL, };
+
+	redis_write_parse_options(options, &flags, opts);
+
+	return redis_write_use_async(space, &flags);
+}
+
+/*! \brief Check that an expiry option is a positive number of seconds or milliseconds */
+static int redis_ttl_valid(const char *ttl)
+{
+	long long value;
+	char extra;
+
+	return !ast_strlen_zero(ttl) && sscanf(ttl, "%30lld%c", &value, &extra) == 1 && value > 0;
+}
+
+static void redis_set_status(struct ast_channel *chan, enum redis_status status)
+{
+	if ((status == REDIS_STATUS_ERROR || status == REDIS_STATUS_UNAVAILABLE) && redis_deadline_expired()) {
+		status = REDIS_STATUS_TIMEOUT;
+	}
+	if (chan) {
+		pbx_builtin_setvar_helper(chan, "REDIS_STATUS", redis_status_names[status]);
+	}
+}
+
+/*!
+ * \brief Read a key, or a field of a hash, into out and REDIS_RESULT.
+ *
+ * \param name the key as given, with an optional <profile>: in front
+ * \param hash the field, or NULL for a plain key
+ */
+static int redis_read_key(struct ast_channel *chan, const char *name, const char *hash, struct redis_output *out)
+{
+	struct redis_profile *profile;
+	struct redis_keyspace space;
+	struct redis_conn *conn;
+	redisReply *reply = NULL;
+	struct redis_args cmd;
+	struct redis_flight *flight;
+	enum redis_status status;
+	const char *key;
+	const char *field;
+	const char *value = NULL;
+	size_t value_len = 0;
+	unsigned int epoch;
+	int leader;
+	int hit;
+
+	key = name;
+	profile = redis_profile_find(&key, &space);
+	if (redis_args_init_key(&cmd, hash ? "HGET" : "GET", &space, key)) {
+		return -1;
+	}
+	if (hash) {
+		redis_args_addstr(&cmd, hash);
+	}
+	/* The cache only holds keys of [general], whose database the listener tracks */
+	key = cmd.argv[1];
+	field = hash;
+
+	if (!profile && (hit = redis_cache_get(key, field, out))) {
+		if (hit > 0) {
+			pbx_builtin_setvar_helper(chan, "REDIS_RESULT", redis_output_buffer(out));
+		}
+		redis_set_status(chan, hit > 0 ? REDIS_STATUS_OK : REDIS_STATUS_NOT_FOUND);
+		return 0;
+	}
+
+	while ((flight = redis_flight_join(profile, key, field, &leader)) && !leader) {
+		status = redis_flight_wait(flight, out);
+		if (status == REDIS_STATUS_TIMEOUT && !redis_deadline_expired()) {
+			/* Join the next read of the key, or lead it */
+			continue;
+		}
+		if (status == REDIS_STATUS_OK) {
+			pbx_builtin_setvar_helper(chan, "REDIS_RESULT", redis_output_buffer(out));
+		}
+		redis_set_status(chan, status);
+		return 0;
+	}
+
+	if (!(conn = redis_key_acquire(profile, key, 1))) {
+		if (flight) {
+			redis_flight_finish(flight, REDIS_STATUS_UNAVAILABLE, NULL, 0);
+		}
+		redis_set_status(chan, REDIS_STATUS_UNAVAILABLE);
+		return 0;
+	}
+
+	epoch = redis_cache_epoch();
+
+	reply = redis_routed_command(&conn, &cmd);
+
+	if (reply == NULL || conn->ctx->err != 0) {
+		ast_log(LOG_WARNING, "REDIS: Error reading key %s from database. Reason: %s\n", name, conn->ctx->errstr);
+		status = REDIS_STATUS_ERROR;
+	} else if (reply->type == REDIS_REPLY_NIL) {
+		ast_debug(1, "REDIS: Key %s not found in database.\n", name);
+		status = REDIS_STATUS_NOT_FOUND;
+		if (!profile) {
+			redis_cache_put(conn, epoch, key, field, NULL, 0);
+		}
+	} else if (reply->type != REDIS_REPLY_STRING) {
+		ast_log(LOG_WARNING, "REDIS: Unexpected reply reading key %s. Reason: %s\n", name,
+			reply->type == REDIS_REPLY_ERROR ? reply->str : "not a string");
+		status = REDIS_STATUS_ERROR;
+	} else if (redis_reply_value(reply, &value, &value_len)) {
+		ast_log(LOG_WARNING, "REDIS: Unable to decompress the value of key %s\n", name);
+		status = REDIS_STATUS_ERROR;
+	} else {
+		redis_output_set(out, value, value_len);
+		pbx_builtin_setvar_helper(chan, "REDIS_RESULT", value);
+		status = REDIS_STATUS_OK;
+		if (!profile) {
+			redis_cache_put(conn, epoch, key, field, value, value_len);
+		}
+	}
+	redis_set_status(chan, status);
+	if (flight) {
+		redis_flight_finish(flight, status, status == REDIS_STATUS_OK ? value : NULL,
+			status == REDIS_STATUS_OK ? value_len : 0);
+	}
+
+	redis_reply_free(reply);
+	redis_pool_release(conn);
+
+	return 0;
+}
+
+/*!
+ * \brief Shared implementation of the REDIS() read callbacks.
+ */
+static int redis_read(struct ast_channel *chan, char *parse, struct redis_output *out)
+{
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(key);
+		AST_APP_ARG(hash);
+	);
+
+	if (ast_strlen_zero(parse)) {
+		ast_log(LOG_WARNING, "REDIS requires an argument, REDIS(<key>) or REDIS(<key>,<hash>)\n");
+		return -1;
+	}
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	if (args.argc < 1 || args.argc > 2) {
+		ast_log(LOG_WARNING, "REDIS requires an argument, REDIS(<key>) or REDIS(<key>,<hash>)\n");
+		return -1;
+	}
+
+	return redis_read_key(chan, args.key, args.argc == 2 ? args.hash : NULL, out);
+}
+
+static int function_redis_read(struct ast_channel *chan, const char *cmd,
+			    char *parse, char *buf, size_t len)
+{
+	struct redis_output out = { .buf = buf, .len = len, };
+
+	int res;
+
+	buf[0] = '\0';
+
+	redis_deadline_begin(chan);
+	res = redis_read(chan, parse, &out);
+	redis_deadline_end();
+
+	return res;
+}
+
+/*!
+ * \brief Read into a dynamic string, so large values aren't truncated to the workspace size.
+ */
+static int function_redis_read2(struct ast_channel *chan, const char *cmd,
+			    char *parse, struct ast_str **buf, ssize_t len)
+{
+	struct redis_output out = { .str = buf, .maxlen = len, };
+
+	int res;
+
+	ast_str_reset(*buf);
+
+	redis_deadline_begin(chan);
+	res = redis_read(chan, parse, &out);
+	redis_deadline_end();
+
+	return res;
+}
+
+/*!
+ * \brief Write a key, or a field of a hash, as REDIS() does.
+ *
+ * \param name the key as given, with an optional <profile>: in front
+ * \param hash the field, or NULL or empty for a plain key
+ * \param options the write options, parsed in place
+ */
+static int redis_write_key(struct ast_channel *chan, const char *name, const char *hash, char *options,
+	const char *value)
+{
+	struct ast_flags flags = { 0 };
+	char *opts[OPT_ARG_ARRAY_SIZE] = { NULL, };
+	struct redis_profile *profile;
+	struct redis_keyspace space;
+	struct redis_conn *conn;
+	redisReply *reply = NULL;
+	struct redis_args command;
+	struct redis_args expire;
+	enum redis_codec codec;
+	const char *key;
+	size_t value_len;
+	int threshold;
+	int has_expire = 0;
+	int res;
+
+	redis_write_parse_options(options, &flags, opts);
+
+	if ((ast_test_flag(&flags, OPT_EXPIRE) && !redis_ttl_valid(opts[OPT_ARG_EXPIRE]))
+		|| (ast_test_flag(&flags, OPT_PEXPIRE) && !redis_ttl_valid(opts[OPT_ARG_PEXPIRE]))) {
+		ast_log(LOG_WARNING, "REDIS: The e and p options require a positive number, e(<seconds>) or p(<milliseconds>)\n");
+		return -1;
+	}
+	if (ast_test_flag(&flags, OPT_NX) && ast_test_flag(&flags, OPT_XX)) {
+		ast_log(LOG_WARNING, "REDIS: The n and x options can't be used together\n");
+		return -1;
+	}
+
+	key = name;
+	profile = redis_profile_find(&key, &space);
+
+	value_len = strlen(value);
+	codec = redis_codec_get(&space, ast_test_flag(&flags, OPT_COMPRESS), &threshold);
+	if (codec == REDIS_CODEC_NONE && ast_test_flag(&flags, OPT_COMPRESS)) {
+		ast_log(LOG_WARNING, "REDIS: The z option needs func_redis built against lz4 or zstd, writing %s as is\n",
+			name);
+	} else if (value_len >= threshold) {
+		redis_value_compress(codec, &value, &value_len);
+	}
+
+	if (ast_strlen_zero(hash)) {
+		if (redis_args_init_key(&command, "SET", &space, key)) {
+			return -1;
+		}
+		redis_args_add(&command, value, value_len);
+		if (ast_test_flag(&flags, OPT_EXPIRE)) {
+			redis_args_addstr(&command, "EX");
+			redis_args_addstr(&command, opts[OPT_ARG_EXPIRE]);
+		} else if (ast_test_flag(&flags, OPT_PEXPIRE)) {
+			redis_args_addstr(&command, "PX");
+			redis_args_addstr(&command, opts[OPT_ARG_PEXPIRE]);
+		}
+		if (ast_test_flag(&flags, OPT_NX)) {
+			redis_args_addstr(&command, "NX");
+		} else if (ast_test_flag(&flags, OPT_XX)) {
+			redis_args_addstr(&command, "XX");
+		}
+	} else {
+		if (ast_test_flag(&flags, OPT_XX)) {
+			ast_log(LOG_WARNING, "REDIS: The x option is not supported for hash fields\n");
+			return -1;
+		}
+		if (redis_args_init_key(&command, ast_test_flag(&flags, OPT_NX) ? "HSETNX" : "HSET", &space, key)) {
+			return -1;
+		}
+		redis_args_addstr(&command, hash);
+		redis_args_add(&command, value, value_len);
+		/* Redis only expires whole keys, so the hash gets a separate EXPIRE */
+		if (ast_test_flag(&flags, OPT_EXPIRE) || ast_test_flag(&flags, OPT_PEXPIRE)) {
+			redis_args_init(&expire, ast_test_flag(&flags, OPT_EXPIRE) ? "EXPIRE" : "PEXPIRE",
+				command.argv[1], ast_test_flag(&flags, OPT_EXPIRE) ? opts[OPT_ARG_EXPIRE] : opts[OPT_ARG_PEXPIRE],
+				NULL);
+			has_expire = 1;
+		}
+	}
+	key = command.argv[1];
+	redis_cache_evict(profile, key);
+
+	if ((res = redis_batch_add(chan, &command, 1, profile))) {
+		if (res > 0 && has_expire) {
+			res = redis_batch_add(chan, &expire, 1, profile);
+		}
+		redis_set_status(chan, res > 0 ? REDIS_STATUS_OK : REDIS_STATUS_ERROR);
+		return 0;
+	}
+
+	if (redis_write_use_async(&space, &flags)) {
+		res = redis_async_enqueue(&command, 1, profile);
+		if (!res && has_expire) {
+			res = redis_async_enqueue(&expire, 1, profile);
+		}
+		redis_set_status(chan, res ? REDIS_STATUS_UNAVAILABLE : REDIS_STATUS_OK);
+		return 0;
+	}
+
+	if (!(conn = redis_key_acquire(profile, key, 0))) {
+		redis_set_status(chan, REDIS_STATUS_UNAVAILABLE);
+		return 0;
+	}
+
+	reply = redis_routed_command(&conn, &command);
+
+	if (reply == NULL || conn->ctx->err != 0) {
+		ast_log(LOG_WARNING, "REDIS: Error writing value to database. Reason: %s\n", conn->ctx->errstr);
+		redis_set_status(chan, REDIS_STATUS_ERROR);
+	} else if (reply->type == REDIS_REPLY_ERROR) {
+		ast_log(LOG_WARNING, "REDIS: Error writing key %s. Reason: %s\n", key, reply->str);
+		redis_set_status(chan, REDIS_STATUS_ERROR);
+	} else if (reply->type == REDIS_REPLY_NIL
+		|| (ast_test_flag(&flags, OPT_NX) && reply->type == REDIS_REPLY_INTEGER && !reply->integer)) {
+		/* SET NX/XX replies nil and HSETNX replies 0 when nothing was written */
+		ast_debug(1, "REDIS: Key %s not written, condition not met.\n", key);
+		redis_set_status(chan, REDIS_STATUS_NOT_SET);
+	} else {
+		if (has_expire) {
+			redis_reply_free(reply);
+			reply = redis_routed_command(&conn, &expire);
+			if (reply == NULL || reply->type == REDIS_REPLY_ERROR) {
+				ast_log(LOG_WARNING, "REDIS: Unable to set the expiry of %s. Reason: %s\n", key,
+					reply ? reply->str : conn->ctx->errstr);
+			}
+		}
+		redis_set_status(chan, REDIS_STATUS_OK);
+	}
+	redis_cache_evict(profile, key);
+
+	redis_reply_free(reply);
+	redis_pool_release(conn);
+
+	return 0;
+}
+
+static int redis_write(struct ast_channel *chan, const char *cmd, char *parse,
+			     const char *value)
+{
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(key);
+		AST_APP_ARG(hash);
+		AST_APP_ARG(options);
+	);
+
+	if (ast_strlen_zero(parse)) {
+		ast_log(LOG_WARNING, "REDIS requires an argument, REDIS(<key>)=<value> or REDIS(<key>,<hash>)=<value>\n");
+		return -1;
+	}
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	if (args.argc < 1 || args.argc > 3) {
+		ast_log(LOG_WARNING, "REDIS requires an argument, REDIS(<key>)=<value> or REDIS(<key>,<hash>)=<value>\n");
+		return -1;
+	}
+
+	return redis_write_key(chan, args.key, args.hash, args.options, value);
+}
+
+static int function_redis_write(struct ast_channel *chan, const char *cmd, char *parse,
+			     const char *value)
+{
+	int res;
+
+	redis_deadline_begin(chan);
+	res = redis_write(chan, cmd, parse, value);
+	redis_deadline_end();
+
+	return res;
+}
+
+static struct ast_custom_function redis_function = {
+	.name = "REDIS",
+	.read = function_redis_read,
+	.read2 = function_redis_read2,
+	.write = function_redis_write,
+};
+
+/*!
+ * \brief Count how many of the keys exist with one EXISTS.
+ *
+ * In cluster mode the keys must share a slot.
+ *
+ * \param keys the keys as sent, with their prefix
+ */
+static enum redis_status redis_exists_count(struct redis_profile *profile, const char * const *keys, int count,
+	long long *found)
+{
+	enum redis_status status = REDIS_STATUS_OK;
+	struct redis_conn *conn;
+	redisReply *reply;
+	struct redis_args command;
+	int i;
+
+	if (!(conn = redis_key_acquire(profile, keys[0], 1))) {
+		return REDIS_STATUS_UNAVAILABLE;
+	}
+
+	redis_args_init(&command, "EXISTS", NULL);
+	for (i = 0; i < count; i++) {
+		redis_args_addstr(&command, keys[i]);
+	}
+	reply = redis_routed_command(&conn, &command);
+
+	if (reply == NULL || conn->ctx->err != 0) {
+		ast_log(LOG_WARNING, "REDIS_EXISTS: Error checking keys. Reason: %s\n", conn->ctx->errstr);
+		status = REDIS_STATUS_ERROR;
+	} else if (reply->type != REDIS_REPLY_INTEGER) {
+		ast_log(LOG_WARNING, "REDIS_EXISTS: Error checking keys. Reason: %s\n",
+			reply->type == REDIS_REPLY_ERROR ? reply->str : "unexpected reply");
+		status = REDIS_STATUS_ERROR;
+	} else {
+		*found += reply->integer;
+	}
+
+	redis_reply_free(reply);
+	redis_pool_release(conn);
+
+	return status;
+}
+
+static int redis_exists(struct ast_channel *chan, const char *cmd,
+			      char *parse, char *buf, size_t len)
+{
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(keys)[MAX_BATCH_KEYS];
+	);
+	enum redis_status status = REDIS_STATUS_OK;
+	struct redis_profile *profile;
+	struct redis_keyspace space;
+	struct redis_args keys;
+	long long found = 0;
+	const char *key;
+	int one_slot = 1;
+	int slot;
+	int i;
+
+	buf[0] = '\0';
+
+	if (ast_strlen_zero(parse)) {
+		ast_log(LOG_WARNING, "REDIS_EXISTS requires at least one argument, REDIS_EXISTS(<key>[,<key>...])\n");
+		return -1;
+	}
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	for (i = 0; i < args.argc; i++) {
+		if (ast_strlen_zero(args.keys[i])) {
+			ast_log(LOG_WARNING, "REDIS_EXISTS requires at least one argument, REDIS_EXISTS(<key>[,<key>...])\n");
+			return -1;
+		}
+	}
+
+	/* The profile of the first key applies to all of them */
+	key = args.keys[0];
+	profile = redis_profile_find(&key, &space);
+	redis_args_init(&keys, NULL);
+	for (i = 0; i < args.argc; i++) {
+		if (redis_args_addkey(&keys, &space, i ? args.keys[i] : key)) {
+			return -1;
+		}
+	}
+
+	/* A cluster refuses a multi-key EXISTS across slots, so those are checked one by one */
+	if (keys.argc > 1 && redis_cluster_enabled()) {
+		slot = redis_cluster_slot(keys.argv[0], keys.argvlen[0]);
+		for (i = 1; i < keys.argc && one_slot; i++) {
+			one_slot = redis_cluster_slot(keys.argv[i], keys.argvlen[i]) == slot;
+		}
+	}
+
+	if (one_slot) {
+		status = redis_exists_count(profile, keys.argv, keys.argc, &found);
+	} else {
+		for (i = 0; i < keys.argc && status == REDIS_STATUS_OK; i++) {
+			status = redis_exists_count(profile, &keys.argv[i], 1, &found);
+		}
+	}
+
+	redis_set_status(chan, status);
+	snprintf(buf, len, "%lld", status == REDIS_STATUS_OK ? found : 0);
+
+	return 0;
+}
+
+static int function_redis_exists(struct ast_channel *chan, const char *cmd,
+			      char *parse, char *buf, size_t len)
+{
+	int res;
+
+	redis_deadline_begin(chan);
+	res = redis_exists(chan, cmd, parse, buf, len);
+	redis_deadline_end();
+
+	return res;
+}
+
+static struct ast_custom_function redis_exists_function = {
+	.name = "REDIS_EXISTS",
+	.read = function_redis_exists,
+};
+
+/*!
+ * \brief INCRBY of a counter with a ttl, run with EVALSHA.
+ *
+ * The expiry is set in the same atomic step as the increment that creates the
+ * counter, and a counter found without one gets it back.
+ */
+static const char redis_incr_ttl_script[] =
+	"local v = redis.call('INCRBY', KEYS[1], ARGV[1]) "
+	"if redis.call('TTL', KEYS[1]) == -1 then redis.call('EXPIRE', KEYS[1], ARGV[2]) end "
+	"return v";
+
+/*! \brief SHA1 of redis_incr_ttl_script, set on load */
+static char redis_incr_ttl_sha1[41];
+
+/*!
+ * \brief Shared implementation of REDIS_INCR and REDIS_DECR.
+ */
+static int redis_incr(struct ast_channel *chan, const char *fn_name, const char *redis_cmd, char *parse,
+	char *buf, size_t len, int allow_ttl)
+{
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(key);
+		AST_APP_ARG(by);
+		AST_APP_ARG(ttl);
+	);
+	struct redis_profile *profile;
+	struct redis_keyspace space;
+	struct redis_conn *conn;
+	redisReply *reply;
+	struct redis_args command;
+	const char *key;
+	const char *by;
+	long long step;
+	char extra;
+
+	buf[0] = '\0';
+
+	if (ast_strlen_zero(parse)) {
+		ast_log(LOG_WARNING, "%s requires an argument, %s(<key>[,<by>%s])\n", fn_name, fn_name,
+			allow_ttl ? "[,<ttl>]" : "");
+		return -1;
+	}
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	if (args.argc < 1 || args.argc > (allow_ttl ? 3 : 2) || ast_strlen_zero(args.key)) {
+		ast_log(LOG_WARNING, "%s requires an argument, %s(<key>[,<by>%s])\n", fn_name, fn_name,
+			allow_ttl ? "[,<ttl>]" : "");
+		return -1;
+	}
+
+	by = ast_strlen_zero(args.by) ? "1" : args.by;
+	if (sscanf(by, "%30lld%c", &step, &extra) != 1) {
+		ast_log(LOG_WARNING, "%s: '%s' is not an integer\n", fn_name, by);
+		return -1;
+	}
+	if (!ast_strlen_zero(args.ttl) && !redis_ttl_valid(args.ttl)) {
+		ast_log(LOG_WARNING, "%s: The ttl must be a positive number of seconds\n", fn_name);
+		return -1;
+	}
+
+	key = args.key;
+	profile = redis_profile_find(&key, &space);
+	if (ast_strlen_zero(args.ttl)) {
+		if (redis_args_init_key(&command, redis_cmd, &space, key)) {
+			return -1;
+		}
+		redis_args_addstr(&command, by);
+		key = command.argv[1];
+	} else {
+		redis_args_init(&command, "EVALSHA", redis_incr_ttl_sha1, "1", NULL);
+		if (redis_args_addkey(&command, &space, key)) {
+			return -1;
+		}
+		redis_args_addstr(&command, by);
+		redis_args_addstr(&command, args.ttl);
+		key = command.argv[3];
+	}
+	redis_cache_evict(profile, key);
+
+	if (!(conn = redis_key_acquire(profile, key, 0))) {
+		redis_set_status(chan, REDIS_STATUS_UNAVAILABLE);
+		return 0;
+	}
+
+	reply = redis_routed_command(&conn, &command);
+	if (!ast_strlen_zero(args.ttl) && reply && reply->type == REDIS_REPLY_ERROR
+		&& !strncmp(reply->str, "NOSCRIPT", 8)) {
+		/* Not cached on this server yet, EVAL sends it once and caches it */
+		redis_reply_free(reply);
+		command.argv[0] = "EVAL";
+		command.argvlen[0] = 4;
+		command.argv[1] = redis_incr_ttl_script;
+		command.argvlen[1] = strlen(redis_incr_ttl_script);
+		reply = redis_routed_command(&conn, &command);
+	}
+
+	if (reply == NULL || conn->ctx->err != 0) {
+		ast_log(LOG_WARNING, "%s: Error updating key %s. Reason: %s\n", fn_name, args.key, conn->ctx->errstr);
+		redis_set_status(chan, REDIS_STATUS_ERROR);
+	} else if (reply->type != REDIS_REPLY_INTEGER) {
+		ast_log(LOG_WARNING, "%s: Error updating key %s. Reason: %s\n", fn_name, args.key,
+			reply->type == REDIS_REPLY_ERROR ? reply->str : "unexpected reply");
+		redis_set_status(chan, REDIS_STATUS_ERROR);
+	} else {
+		snprintf(buf, len, "%lld", reply->integer);
+		redis_set_status(chan, REDIS_STATUS_OK);
+	}
+	redis_cache_evict(profile, key);
+
+	redis_reply_free(reply);
+	redis_pool_release(conn);
+
+	return 0;
+}
+
+static int function_redis_incr(struct ast_channel *chan, const char *cmd,
+			      char *parse, char *buf, size_t len)
+{
+	int res;
+
+	redis_deadline_begin(chan);
+	res = redis_incr(chan, "REDIS_INCR", "INCRBY", parse, buf, len, 1);
+	redis_deadline_end();
+
+	return res;
+}
+
+static struct ast_custom_function redis_incr_function = {
+	.name = "REDIS_INCR",
+	.read = function_redis_incr,
+};
+
+static int function_redis_decr(struct ast_channel *chan, const char *cmd,
+			      char *parse, char *buf, size_t len)
+{
+	int res;
+
+	redis_deadline_begin(chan);
+	res = redis_incr(chan, "REDIS_DECR", "DECRBY", parse, buf, len, 0);
+	redis_deadline_end();
+
+	return res;
+}
+
+static struct ast_custom_function redis_decr_function = {
+	.name = "REDIS_DECR",
+	.read = function_redis_decr,
+};
+
+static int redis_expire_read(struct ast_channel *chan, const char *cmd,
+			      char *parse, char *buf, size_t len)
+{
+	struct redis_profile *profile;
+	struct redis_keyspace space;
+	struct redis_conn *conn;
+	redisReply *reply;
+	struct redis_args command;
+	const char *key = parse;
+
+	buf[0] = '\0';
+
+	if (ast_strlen_zero(parse)) {
+		ast_log(LOG_WARNING, "REDIS_EXPIRE requires an argument, REDIS_EXPIRE(<key>)\n");
+		return -1;
+	}
+
+	profile = redis_profile_find(&key, &space);
+	if (redis_args_init_key(&command, "TTL", &space, key)) {
+		return -1;
+	}
+
+	if (!(conn = redis_key_acquire(profile, command.argv[1], 1))) {
+		redis_set_status(chan, REDIS_STATUS_UNAVAILABLE);
+		return 0;
+	}
+
+	reply = redis_routed_command(&conn, &command);
+
+	if (reply == NULL || reply->type != REDIS_REPLY_INTEGER) {
+		ast_log(LOG_WARNING, "REDIS_EXPIRE: Error reading the expiry of %s. Reason: %s\n", parse,
+			reply && reply->type == REDIS_REPLY_ERROR ? reply->str : conn->ctx->errstr);
+		redis_set_status(chan, REDIS_STATUS_ERROR);
+	} else if (reply->integer == -2) {
+		redis_set_status(chan, REDIS_STATUS_NOT_FOUND);
+	} else {
+		snprintf(buf, len, "%lld", reply->integer);
+		redis_set_status(chan, REDIS_STATUS_OK);
+	}
+
+	redis_reply_free(reply);
+	redis_pool_release(conn);
+
+	return 0;
+}
+
+static int function_redis_expire_read(struct ast_channel *chan, const char *cmd,
+			      char *parse, char *buf, size_t len)
+{
+	int res;
+
+	redis_deadline_begin(chan);
+	res = redis_expire_read(chan, cmd, parse, buf, len);
+	redis_deadline_end();
+
+	return res;
+}
+
+static int redis_expire_write(struct ast_channel *chan, const char *cmd, char *parse,
+	const char *value)
+{
+	struct redis_profile *profile;
+	struct redis_keyspace space;
+	struct redis_conn *conn;
+	redisReply *reply;
+	struct redis_args command;
+	const char *key = parse;
+	int res;
+
+	if (ast_strlen_zero(parse)) {
+		ast_log(LOG_WARNING, "REDIS_EXPIRE requires an argument, REDIS_EXPIRE(<key>)=<seconds>\n");
+		return -1;
+	}
+
+	if (!ast_strlen_zero(value) && !redis_ttl_valid(value)) {
+		ast_log(LOG_WARNING, "REDIS_EXPIRE: '%s' is not a positive number of seconds\n", value);
+		return -1;
+	}
+
+	profile = redis_profile_find(&key, &space);
+	if (redis_args_init_key(&command, ast_strlen_zero(value) ? "PERSIST" : "EXPIRE", &space, key)) {
+		return -1;
+	}
+	if (!ast_strlen_zero(value)) {
+		redis_args_addstr(&command, value);
+	}
+	/* An expiry changes when the cached value stops being true */
+	redis_cache_evict(profile, command.argv[1]);
+
+	if ((res = redis_batch_add(chan, &command, 1, profile))) {
+		redis_set_status(chan, res > 0 ? REDIS_STATUS_OK : REDIS_STATUS_ERROR);
+		return 0;
+	}
+
+	if (!(conn = redis_key_acquire(profile, command.argv[1], 0))) {
+		redis_set_status(chan, REDIS_STATUS_UNAVAILABLE);
+		return 0;
+	}
+
+	reply = redis_routed_command(&conn, &command);
+
+	if (reply == NULL || reply->type != REDIS_REPLY_INTEGER) {
+		ast_log(LOG_WARNING, "REDIS_EXPIRE: Error setting the expiry of %s. Reason: %s\n", parse,
+			reply && reply->type == REDIS_REPLY_ERROR ? reply->str : conn->ctx->errstr);
+		redis_set_status(chan, REDIS_STATUS_ERROR);
+	} else if (!reply->integer && !ast_strlen_zero(value)) {
+		/* PERSIST also replies 0 for a key without an expiry, which is fine */
+		redis_set_status(chan, REDIS_STATUS_NOT_FOUND);
+	} else {
+		redis_set_status(chan, REDIS_STATUS_OK);
+	}
+	redis_cache_evict(profile, command.argv[1]);
+
+	redis_reply_free(reply);
+	redis_pool_release(conn);
+
+	return 0;
+}
+
+static int function_redis_expire_write(struct ast_channel *chan, const char *cmd, char *parse,
+	const char *value)
+{
+	int res;
+
+	redis_deadline_begin(chan);
+	res = redis_expire_write(chan, cmd, parse, value);
+	redis_deadline_end();
+
+	return res;
+}
+
+static struct ast_custom_function redis_expire_function = {
+	.name = "REDIS_EXPIRE",
+	.read = function_redis_expire_read,
+	.write = function_redis_expire_write,
+};
+
+static int redis_delete(struct ast_channel *chan, const char *cmd,
+			      char *parse, char *buf, size_t len)
+{
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(key);
+	);
+	struct redis_profile *profile;
+	struct redis_keyspace space;
+	struct redis_conn *conn;
+	redisReply *reply;
+	struct redis_args command;
+	const char *key;
+	int res;
+
+	buf[0] = '\0';
+
+	if (ast_strlen_zero(parse)) {
+		ast_log(LOG_WARNING, "REDIS_DELETE requires an argument, REDIS_DELETE(<key>)\n");
+		return -1;
+	}
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	if (args.argc != 1) {
+		ast_log(LOG_WARNING, "REDIS_DELETE requires an argument, REDIS_DELETE(<key>)\n");
+		return -1;
+	}
+
+	key = args.key;
+	profile = redis_profile_find(&key, &space);
+	if (redis_args_init_key(&command, "DEL", &space, key)) {
+		return -1;
+	}
+	redis_cache_evict(profile, command.argv[1]);
+
+	if ((res = redis_batch_add(chan, &command, 1, profile))) {
+		redis_set_status(chan, res > 0 ? REDIS_STATUS_OK : REDIS_STATUS_ERROR);
+		return 0;
+	}
+
+	if (!(conn = redis_key_acquire(profile, command.argv[1], 0))) {
+		redis_set_status(chan, REDIS_STATUS_UNAVAILABLE);
+		return 0;
+	}
+
+	reply = redis_routed_command(&conn, &command);
+
+	if (conn->ctx->err != 0) {
+		ast_debug(1, "REDIS_DELETE: Key %s not found in database.\n", args.key);
+		redis_set_status(chan, REDIS_STATUS_ERROR);
+	} else {
+		redis_set_status(chan, REDIS_STATUS_OK);
+	}
+	redis_cache_evict(profile, command.argv[1]);
+
+	redis_reply_free(reply);
+	redis_pool_release(conn);
+
+	return 0;
+}
+
+static int function_redis_delete(struct ast_channel *chan, const char *cmd,
+			      char *parse, char *buf, size_t len)
+{
+	int res;
+
+	redis_deadline_begin(chan);
+	res = redis_delete(chan, cmd, parse, buf, len);
+	redis_deadline_end();
+
+	return res;
+}
+
+/*!
+ * \brief Wrapper to execute REDIS_DELETE from a write operation. Allows execution
+ * even if live_dangerously is disabled.
+ */
+static int function_redis_delete_write(struct ast_channel *chan, const char *cmd, char *parse,
+	const char *value)
+{
+	/* Throwaway to hold the result from the read */
+	char buf[128];
+	return function_redis_delete(chan, cmd, parse, buf, sizeof(buf));
+}
+
+static struct ast_custom_function redis_delete_function = {
+	.name = "REDIS_DELETE",
+	.read = function_redis_delete,
+	.write = function_redis_delete_write,
+};
+
+/*!
+ * \brief Publish a message, as REDIS_PUBLISH() does.
+ *
+ * \param options the options, parsed in place
+ */
+static int redis_publish_message(struct ast_channel *chan, const char *channel, char *options,
+	const char *value)
+{
+	struct redis_conn *conn;
+	redisReply *reply;
+	struct redis_args command;
+	struct redis_keyspace space;
+	int res;
+
+	redis_args_init(&command, "PUBLISH", channel, value, NULL);
+
+	if ((res = redis_batch_add(chan, &command, 0, NULL))) {
+		redis_set_status(chan, res > 0 ? REDIS_STATUS_OK : REDIS_STATUS_ERROR);
+		return 0;
+	}
+
+	/* Channels aren't prefixed, only async_writes applies */
+	redis_keyspace_general(&space);
+	if (redis_write_is_async(&space, options)) {
+		/* The subscriber count is unknown, so REDIS_PUBLISH_RESULT is left alone */
+		res = redis_async_enqueue(&command, 0, NULL);
+		redis_set_status(chan, res ? REDIS_STATUS_UNAVAILABLE : REDIS_STATUS_OK);
+		return 0;
+	}
+
+	if (!(conn = redis_pool_acquire(&pool))) {
+		redis_set_status(chan, REDIS_STATUS_UNAVAILABLE);
+		return 0;
+	}
+
+	reply = redis_logged_command(conn, &command);
+
+	if (conn->ctx->err != 0) {
+		ast_log(LOG_ERROR, "REDIS_PUBLISH: Error publishing message. Reason: %s\n", conn->ctx->errstr);
+		redis_set_status(chan, REDIS_STATUS_ERROR);
+	} else {
+		redis_set_status(chan, REDIS_STATUS_OK);
+        char str_int[21];
+        snprintf(str_int, 21, "%lld", reply->integer);
+        pbx_builtin_setvar_helper(chan, "REDIS_PUBLISH_RESULT", str_int);
+    }
+
+	redis_reply_free(reply);
+	redis_pool_release(conn);
+
+	return 0;
+}
+
+static int redis_publish(struct ast_channel *chan, const char *cmd, char *parse,
+								const char *value)
+{
+	AST_DECLARE_APP_ARGS(args,
+						 AST_APP_ARG(redis_channel);
+						 AST_APP_ARG(options);
+	);
+
+	if (ast_strlen_zero(parse)) {
+		ast_log(LOG_WARNING, "REDIS_PUBLISH requires one argument, REDIS_PUBLISH(<channel>)=<message>\n");
+		return -1;
+	}
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	if (args.argc < 1 || args.argc > 2) {
+		ast_log(LOG_WARNING, "REDIS_PUBLISH requires one argument, REDIS_PUBLISH(<channel>)=<message>\n");
+		return -1;
+	}
+
+	return redis_publish_message(chan, args.redis_channel, args.options, value);
+}
+
+static int function_redis_publish(struct ast_channel *chan, const char *cmd, char *parse,
+								const char *value)
+{
+	int res;
+
+	redis_deadline_begin(chan);
+	res = redis_publish(chan, cmd, parse, value);
+	redis_deadline_end();
+
+	return res;
+}
+
+static struct ast_custom_function redis_publish_function = {
+		.name = "REDIS_PUBLISH",
+		.write = function_redis_publish,
+};
+
+static int redis_xadd(struct ast_channel *chan, const char *cmd, char *parse,
+	const char *value)
+{
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(stream);
+		AST_APP_ARG(maxlen);
+		AST_APP_ARG(options);
+	);
+	AST_DECLARE_APP_ARGS(fields,
+		AST_APP_ARG(pairs)[MAX_BATCH_KEYS];
+	);
+	struct redis_profile *profile;
+	struct redis_keyspace space;
+	struct redis_conn *conn;
+	redisReply *reply;
+	struct redis_args command;
+	const char *stream;
+	char *entry;
+	int i;
+	int res;
+
+	if (ast_strlen_zero(parse)) {
+		ast_log(LOG_WARNING, "REDIS_XADD requires an argument, REDIS_XADD(<stream>[,<maxlen>[,<options>]])=<field>,<value>[,...]\n");
+		return -1;
+	}
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	if (args.argc < 1 || args.argc > 3 || ast_strlen_zero(args.stream)) {
+		ast_log(LOG_WARNING, "REDIS_XADD requires an argument, REDIS_XADD(<stream>[,<maxlen>[,<options>]])=<field>,<value>[,...]\n");
+		return -1;
+	}
+	if (!ast_strlen_zero(args.maxlen) && !redis_ttl_valid(args.maxlen)) {
+		ast_log(LOG_WARNING, "REDIS_XADD: maxlen must be a positive number, not '%s'\n", args.maxlen);
+		return -1;
+	}
+
+	entry = ast_strdupa(S_OR(value, ""));
+	AST_STANDARD_APP_ARGS(fields, entry);
+
+	if (ast_strlen_zero(value) || fields.argc % 2) {
+		ast_log(LOG_WARNING, "REDIS_XADD: The value must be field/value pairs, <field>,<value>[,...]\n");
+		return -1;
+	}
+
+	stream = args.stream;
+	profile = redis_profile_find(&stream, &space);
+	if (redis_args_init_key(&command, "XADD", &space, stream)) {
+		return -1;
+	}
+	if (!ast_strlen_zero(args.maxlen)) {
+		redis_args_addstr(&command, "MAXLEN");
+		redis_args_addstr(&command, "~");
+		redis_args_addstr(&command, args.maxlen);
+	}
+	redis_args_addstr(&command, "*");
+	for (i = 0; i < fields.argc; i++) {
+		redis_args_addstr(&command, fields.pairs[i]);
+	}
+
+	if ((res = redis_batch_add(chan, &command, 1, profile))) {
+		redis_set_status(chan, res > 0 ? REDIS_STATUS_OK : REDIS_STATUS_ERROR);
+		return 0;
+	}
+
+	if (redis_write_is_async(&space, args.options)) {
+		/* The entry id is unknown, so REDIS_XADD_ID is left alone */
+		res = redis_async_enqueue(&command, 1, profile);
+		redis_set_status(chan, res ? REDIS_STATUS_UNAVAILABLE : REDIS_STATUS_OK);
+		return 0;
+	}
+
+	if (!(conn = redis_key_acquire(profile, command.argv[1], 0))) {
+		redis_set_status(chan, REDIS_STATUS_UNAVAILABLE);
+		return 0;
+	}
+
+	reply = redis_routed_command(&conn, &command);
+
+	if (reply == NULL || conn->ctx->err != 0) {
+		ast_log(LOG_WARNING, "REDIS_XADD: Error adding to stream %s. Reason: %s\n", args.stream, conn->ctx->errstr);
+		redis_set_status(chan, REDIS_STATUS_ERROR);
+	} else if (reply->type != REDIS_REPLY_STRING) {
+		ast_log(LOG_WARNING, "REDIS_XADD: Error adding to stream %s. Reason: %s\n", args.stream,
+			reply->type == REDIS_REPLY_ERROR ? reply->str : "unexpected reply");
+		redis_set_status(chan, REDIS_STATUS_ERROR);
+	} else {
+		pbx_builtin_setvar_helper(chan, "REDIS_XADD_ID", reply->str);
+		redis_set_status(chan, REDIS_STATUS_OK);
+	}
+
+	redis_reply_free(reply);
+	redis_pool_release(conn);
+
+	return 0;
+}
+
+static int function_redis_xadd(struct ast_channel *chan, const char *cmd, char *parse,
+	const char *value)
+{
+	int res;
+
+	redis_deadline_begin(chan);
+	res = redis_xadd(chan, cmd, parse, value);
+	redis_deadline_end();
+
+	return res;
+}
+
+static struct ast_custom_function redis_xadd_function = {
+	.name = "REDIS_XADD",
+	.write = function_redis_xadd,
+};
+
+/*!
+ * \brief REDIS_MGET in cluster mode, where the keys may live on several nodes.
+ *
+ * \return the number of keys found
+ */
+static int redis_read_cluster_mget(struct ast_channel *chan, const char *fn_name,
+	const char * const *names, const int *pending, int npending)
+{
+	struct redis_slot_batch *batches;
+	redisReply *values[MAX_BATCH_KEYS];
+	const char *keys[MAX_BATCH_KEYS];
+	const char *value;
+	size_t value_len;
+	char var[32];
+	int nbatches;
+	int failed = 0;
+	int found = 0;
+	int i;
+
+	for (i = 0; i < npending; i++) {
+		keys[i] = names[pending[i]];
+	}
+	if ((nbatches = redis_cluster_mget(keys, npending, values, &batches)) < 0) {
+		redis_set_status(chan, REDIS_STATUS_ERROR);
+		return 0;
+	}
+
+	for (i = 0; i < npending; i++) {
+		if (!values[i]) {
+			failed++;
+		} else if (values[i]->type == REDIS_REPLY_STRING) {
+			if (redis_reply_value(values[i], &value, &value_len)) {
+				ast_log(LOG_WARNING, "%s: Unable to decompress the value of key %s\n", fn_name, keys[i]);
+				continue;
+			}
+			snprintf(var, sizeof(var), "REDIS_RESULT_%d", pending[i] + 1);
+			pbx_builtin_setvar_helper(chan, var, value);
+			found++;
+		}
+	}
+	redis_slot_batches_free(batches, nbatches);
+
+	if (failed) {
+		ast_log(LOG_WARNING, "%s: Unable to read %d of %d keys from the cluster.\n", fn_name, failed, npending);
+	}
+	redis_set_status(chan, failed ? REDIS_STATUS_ERROR : REDIS_STATUS_OK);
+
+	return found;
+}
+
+/*!
+ * \brief Shared implementation of REDIS_MGET and REDIS_HMGET.
+ *
+ * Values found in the local cache are used as is, and everything else is
+ * fetched with a single MGET or HMGET.
+ *
+ * The profile of the hash, or of the first key, applies to all of them.
+ *
+ * \param hash the hash for HMGET, or NULL for MGET of the names
+ * \param names keys (MGET) or fields (HMGET)
+ * \param count number of names
+ */
+static int redis_read_multiple(struct ast_channel *chan, const char *fn_name,
+	const char *hash, char **names, int count, char *buf, size_t len)
+{
+	struct redis_profile *profile;
+	struct redis_keyspace space;
+	/* The hash, if any, and then the names as sent */
+	struct redis_args keys;
+	const char **sent;
+	const char *first = hash ? hash : names[0];
+	struct redis_args cmd;
+	/* Index into names of each name sent to the server */
+	int pending[MAX_BATCH_KEYS];
+	signed char cached[MAX_BATCH_KEYS];
+	struct ast_str *value;
+	struct redis_output out = { .str = &value, .maxlen = 0, };
+	char var[32];
+	struct redis_conn *conn;
+	redisReply *reply;
+	const char *element_value;
+	size_t element_len;
+	unsigned int epoch;
+	int npending = 0;
+	int found = 0;
+	int i;
+
+	/* Cache hits are as long as what the server would return */
+	if (!(value = ast_str_thread_get(&redis_mget_storage, REDIS_CMDBUF_SZ))) {
+		return -1;
+	}
+
+	profile = redis_profile_find(&first, &space);
+	redis_args_init(&keys, NULL);
+	if (hash) {
+		if (redis_args_addkey(&keys, &space, first)) {
+			return -1;
+		}
+		hash = keys.argv[0];
+		for (i = 0; i < count; i++) {
+			redis_args_addstr(&keys, names[i]);
+		}
+	} else {
+		for (i = 0; i < count; i++) {
+			if (redis_args_addkey(&keys, &space, i ? names[i] : first)) {
+				return -1;
+			}
+		}
+	}
+	sent = keys.argv + (hash ? 1 : 0);
+
+	for (i = 0; i < count; i++) {
+		snprintf(var, sizeof(var), "REDIS_RESULT_%d", i + 1);
+		/* The cache only holds keys of [general] */
+		cached[i] = profile ? 0 : redis_cache_get(hash ? hash : sent[i], hash ? sent[i] : NULL, &out);
+		if (cached[i] > 0) {
+			pbx_builtin_setvar_helper(chan, var, ast_str_buffer(value));
+			found++;
+		} else {
+			pbx_builtin_setvar_helper(chan, var, "");
+		}
+	}
+	snprintf(var, sizeof(var), "%d", count);
+	pbx_builtin_setvar_helper(chan, "REDIS_RESULT_COUNT", var);
+
+	redis_args_init(&cmd, hash ? "HMGET" : "MGET", hash, NULL);
+	for (i = 0; i < count; i++) {
+		if (!cached[i]) {
+			pending[npending++] = i;
+			redis_args_addstr(&cmd, sent[i]);
+		}
+	}
+
+	if (!npending) {
+		redis_set_status(chan, REDIS_STATUS_OK);
+		snprintf(buf, len, "%d", found);
+		return 0;
+	}
+
+	if (!hash && redis_cluster_enabled()) {
+		found += redis_read_cluster_mget(chan, fn_name, sent, pending, npending);
+		snprintf(buf, len, "%d", found);
+		return 0;
+	}
+
+	if (!(conn = redis_key_acquire(profile, hash ? hash : sent[pending[0]], 1))) {
+		redis_set_status(chan, REDIS_STATUS_UNAVAILABLE);
+		snprintf(buf, len, "%d", found);
+		return 0;
+	}
+
+	epoch = redis_cache_epoch();
+	reply = redis_routed_command(&conn, &cmd);
+
+	if (reply == NULL || conn->ctx->err != 0 || reply->type != REDIS_REPLY_ARRAY
+		|| reply->elements != npending) {
+		ast_log(LOG_WARNING, "%s: Error reading from database. Reason: %s\n", fn_name,
+			reply && reply->type == REDIS_REPLY_ERROR ? reply->str : conn->ctx->errstr);
+		redis_set_status(chan, REDIS_STATUS_ERROR);
+	} else {
+		for (i = 0; i < npending; i++) {
+			redisReply *element = reply->element[i];
+
+			if (element->type == REDIS_REPLY_NIL && !profile) {
+				redis_cache_put(conn, epoch, hash ? hash : sent[pending[i]], hash ? sent[pending[i]] : NULL,
+					NULL, 0);
+			}
+			if (element->type != REDIS_REPLY_STRING) {
+				continue;
+			}
+			if (redis_reply_value(element, &element_value, &element_len)) {
+				ast_log(LOG_WARNING, "%s: Unable to decompress the value of %s\n", fn_name, sent[pending[i]]);
+				continue;
+			}
+			snprintf(var, sizeof(var), "REDIS_RESULT_%d", pending[i] + 1);
+			pbx_builtin_setvar_helper(chan, var, element_value);
+			if (!profile) {
+				redis_cache_put(conn, epoch, hash ? hash : sent[pending[i]], hash ? sent[pending[i]] : NULL,
+					element_value, element_len);
+			}
+			found++;
+		}
+		redis_set_status(chan, REDIS_STATUS_OK);
+	}
+
+	redis_reply_free(reply);
+	redis_pool_release(conn);
+
+	snprintf(buf, len, "%d", found);
+
+	return 0;
+}
+
+static int function_redis_mget(struct ast_channel *chan, const char *cmd,
+			    char *parse, char *buf, size_t len)
+{
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(keys)[MAX_BATCH_KEYS];
+	);
+	int res;
+
+	buf[0] = '\0';
+
+	if (ast_strlen_zero(parse)) {
+		ast_log(LOG_WARNING, "REDIS_MGET requires at least one argument, REDIS_MGET(<key1>[,<key2>...])\n");
+		return -1;
+	}
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	redis_deadline_begin(chan);
+	res = redis_read_multiple(chan, "REDIS_MGET", NULL, args.keys, args.argc, buf, len);
+	redis_deadline_end();
+
+	return res;
+}
+
+static struct ast_custom_function redis_mget_function = {
+	.name = "REDIS_MGET",
+	.read = function_redis_mget,
+};
+
+static int function_redis_hmget(struct ast_channel *chan, const char *cmd,
+			    char *parse, char *buf, size_t len)
+{
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(key);
+		AST_APP_ARG(fields)[MAX_BATCH_KEYS];
+	);
+	int res;
+
+	buf[0] = '\0';
+
+	if (ast_strlen_zero(parse)) {
+		ast_log(LOG_WARNING, "REDIS_HMGET requires at least two arguments, REDIS_HMGET(<key>,<field1>[,<field2>...])\n");
+		return -1;
+	}
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	if (args.argc < 2) {
+		ast_log(LOG_WARNING, "REDIS_HMGET requires at least two arguments, REDIS_HMGET(<key>,<field1>[,<field2>...])\n");
+		return -1;
+	}
+
+	redis_deadline_begin(chan);
+	res = redis_read_multiple(chan, "REDIS_HMGET", args.key, args.fields, args.argc - 1, buf, len);
+	redis_deadline_end();
+
+	return res;
+}
+
+static struct ast_custom_function redis_hmget_function = {
+	.name = "REDIS_HMGET",
+	.read = function_redis_hmget,
+};
+
+/*!
+ * \brief Check that a reply looks like [ cursor, [ elements ] ] from SCAN or HSCAN.
+ */
+static int redis_scan_reply_valid(const redisReply *reply)
+{
+	return reply && reply->type == REDIS_REPLY_ARRAY && reply->elements == 2
+		&& reply->element[0]->type == REDIS_REPLY_STRING
+		&& reply->element[1]->type == REDIS_REPLY_ARRAY;
+}
+
+/*!
+ * \brief Set a channel variable for each field of a flat field/value list.
+ *
+ * \param key the hash to cache the fields under, or NULL to not cache them
+ *
+ * \return the number of fields set
+ */
+static int redis_hash_setvars(struct ast_channel *chan, const char *prefix, const redisReply *fields,
+	struct redis_conn *conn, unsigned int epoch, const char *key)
+{
+	const redisReply *name;
+	const char *value;
+	size_t value_len;
+	char var[256];
+	int count = 0;
+	int i;
+
+	for (i = 0; i + 1 < fields->elements; i += 2) {
+		name = fields->element[i];
+		if (name->type != REDIS_REPLY_STRING || fields->element[i + 1]->type != REDIS_REPLY_STRING) {
+			continue;
+		}
+		if (redis_reply_value(fields->element[i + 1], &value, &value_len)) {
+			ast_log(LOG_WARNING, "REDIS_HGETALL: Unable to decompress field %s\n", name->str);
+			continue;
+		}
+		snprintf(var, sizeof(var), "%s%.*s", prefix, (int) name->len, name->str);
+		pbx_builtin_setvar_helper(chan, var, value);
+		if (key) {
+			redis_cache_put(conn, epoch, key, name->str, value, value_len);
+		}
+		count++;
+	}
+
+	return count;
+}
+
+static int redis_hgetall(struct ast_channel *chan, const char *cmd,
+			    char *parse, char *buf, size_t len)
+{
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(key);
+		AST_APP_ARG(prefix);
+		AST_APP_ARG(options);
+	);
+	struct ast_flags flags = { 0 };
+	struct redis_profile *profile;
+	struct redis_keyspace space;
+	struct redis_conn *conn;
+	redisReply *reply;
+	struct redis_args command;
+	const char *prefix;
+	const char *key;
+	char cursor[32] = "0";
+	char count[16];
+	unsigned int epoch;
+	int found = 0;
+	int failed = 0;
+
+	buf[0] = '\0';
+
+	if (ast_strlen_zero(parse)) {
+		ast_log(LOG_WARNING, "REDIS_HGETALL requires an argument, REDIS_HGETALL(<key>[,<prefix>[,<options>]])\n");
+		return -1;
+	}
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	if (args.argc > 3 || ast_strlen_zero(args.key)) {
+		ast_log(LOG_WARNING, "REDIS_HGETALL requires an argument, REDIS_HGETALL(<key>[,<prefix>[,<options>]])\n");
+		return -1;
+	}
+	/* An empty prefix is allowed, and sets the fields under their own names */
+	prefix = args.argc > 1 ? args.prefix : "HASH_";
+	if (!ast_strlen_zero(args.options)) {
+		ast_app_parse_options(redis_hgetall_options, &flags, NULL, args.options);
+	}
+
+	key = args.key;
+	profile = redis_profile_find(&key, &space);
+	if (redis_args_init_key(&command, "HGETALL", &space, key)) {
+		return -1;
+	}
+	/* The prefixed key outlives the command being rebuilt for each HSCAN */
+	key = command.argv[1];
+
+	if (!(conn = redis_key_acquire(profile, key, 1))) {
+		redis_set_status(chan, REDIS_STATUS_UNAVAILABLE);
+		return 0;
+	}
+
+	epoch = redis_cache_epoch();
+
+	if (!ast_test_flag(&flags, OPT_SCAN)) {
+		reply = redis_routed_command(&conn, &command);
+		if (reply == NULL || conn->ctx->err != 0) {
+			failed = 1;
+		} else if (reply->type == REDIS_REPLY_ERROR) {
+			ast_log(LOG_WARNING, "REDIS_HGETALL: Error reading %s. Reason: %s\n", key, reply->str);
+			failed = 1;
+		} else if (redis_reply_is_array(reply)
+#ifdef REDIS_REPLY_PUSH
+			|| reply->type == REDIS_REPLY_MAP
+#endif
+			) {
+			/* A RESP3 map has the same flat layout as the RESP2 array */
+			found = redis_hash_setvars(chan, prefix, reply, conn, epoch, profile ? NULL : key);
+		}
+		redis_reply_free(reply);
+	} else {
+		/* Several round trips, but the server isn't blocked by a large hash */
+		snprintf(count, sizeof(count), "%d", SCAN_COUNT);
+		do {
+			redis_args_init(&command, "HSCAN", key, cursor, "COUNT", count, NULL);
+			reply = redis_routed_command(&conn, &command);
+			if (!redis_scan_reply_valid(reply)) {
+				ast_log(LOG_WARNING, "REDIS_HGETALL: Error scanning %s. Reason: %s\n", key,
+					reply && reply->type == REDIS_REPLY_ERROR ? reply->str : conn->ctx->errstr);
+				redis_reply_free(reply);
+				failed = 1;
+				break;
+			}
+			ast_copy_string(cursor, reply->element[0]->str, sizeof(cursor));
+			found += redis_hash_setvars(chan, prefix, reply->element[1], conn, epoch, profile ? NULL : key);
+			redis_reply_free(reply);
+		} while (strcmp(cursor, "0"));
+	}
+
+	if (failed) {
+		if (conn->ctx->err != 0) {
+			ast_log(LOG_WARNING, "REDIS_HGETALL: Error reading %s. Reason: %s\n", key, conn->ctx->errstr);
+		}
+		redis_set_status(chan, REDIS_STATUS_ERROR);
+	} else {
+		/* A hash with no fields doesn't exist */
+		redis_set_status(chan, found ? REDIS_STATUS_OK : REDIS_STATUS_NOT_FOUND);
+	}
+	redis_pool_release(conn);
+
+	snprintf(buf, len, "%d", found);
+
+	return 0;
+}
+
+static int function_redis_hgetall(struct ast_channel *chan, const char *cmd,
+			    char *parse, char *buf, size_t len)
+{
+	int res;
+
+	redis_deadline_begin(chan);
+	res = redis_hgetall(chan, cmd, parse, buf, len);
+	redis_deadline_end();
+
+	return res;
+}
+
+static struct ast_custom_function redis_hgetall_function = {
+	.name = "REDIS_HGETALL",
+	.read = function_redis_hgetall,
+};
+
+static int redis_preload_stopping(void)
+{
+	int stop;
+
+	ast_mutex_lock(&preload.lock);
+	stop = preload.stop;
+	ast_mutex_unlock(&preload.lock);
+
+	return stop;
+}
+
+/*! \brief Whether conn is still tracked by the cache listener, which a reload may restart */
+static int redis_preload_tracked(const struct redis_conn *conn)
+{
+	int tracked;
+
+	ast_mutex_lock(&cache.lock);
+	tracked = conn->tracking_id == cache.tracking_id;
+	ast_mutex_unlock(&cache.lock);
+
+	return tracked;
+}
+
+static void redis_preload_finish(enum redis_preload_state state)
+{
+	ast_mutex_lock(&preload.lock);
+	preload.finished = ast_tvnow();
+	preload.state = state;
+	ast_mutex_unlock(&preload.lock);
+}
+
+static int redis_preload_full(void)
+{
+	int size;
+	int full;
+
+	ast_mutex_lock(&redis_lock);
+	size = cache_size;
+	ast_mutex_unlock(&redis_lock);
+
+	ast_mutex_lock(&cache.lock);
+	full = ao2_container_count(cache.entries) >= size;
+	ast_mutex_unlock(&cache.lock);
+
+	return full;
+}
+
+/*! \brief Cache the string keys of one SCAN page, with one MGET */
+static int redis_preload_values(struct redis_conn *conn, redisReply **keys, int count)
+{
+	struct redis_args command;
+	redisReply *values;
+	const char *value;
+	size_t value_len;
+	unsigned int epoch;
+	unsigned int stored = 0;
+	int i;
+
+	redis_args_init(&command, "MGET", NULL);
+	for (i = 0; i < count; i++) {
+		redis_args_add(&command, keys[i]->str, keys[i]->len);
+	}
+	epoch = redis_cache_epoch();
+	values = redis_logged_command(conn, &command);
+
+	if (values == NULL || values->type != REDIS_REPLY_ARRAY || values->elements != count) {
+		redis_reply_free(values);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		if (values->element[i]->type == REDIS_REPLY_STRING
+			&& !redis_reply_value(values->element[i], &value, &value_len)
+			&& !redis_cache_put(conn, epoch, keys[i]->str, NULL, value, value_len)) {
+			stored++;
+		}
+	}
+	redis_reply_free(values);
+
+	ast_mutex_lock(&preload.lock);
+	preload.keys += stored;
+	ast_mutex_unlock(&preload.lock);
+
+	return 0;
+}
+
+/*! \brief Cache the hashes of one SCAN page, with their HGETALLs pipelined */
+static int redis_preload_hashes(struct redis_conn *conn, redisReply **keys, int count)
+{
+	struct redis_args *cmds;
+	redisReply **replies;
+	redisReply *fields;
+	const char *value;
+	size_t value_len;
+	unsigned int epoch;
+	unsigned int stored = 0;
+	int fields_stored;
+	int res;
+	int i;
+	size_t j;
+
+	if (!(cmds = ast_calloc(count, sizeof(*cmds)))
+		|| !(replies = ast_calloc(count, sizeof(*replies)))) {
+		ast_free(cmds);
+		return -1;
+	}
+	for (i = 0; i < count; i++) {
+		redis_args_init(&cmds[i], "HGETALL", NULL);
+		redis_args_add(&cmds[i], keys[i]->str, keys[i]->len);
+	}
+	epoch = redis_cache_epoch();
+	res = redis_logged_pipeline(conn, cmds, count, replies);
+	ast_free(cmds);
+
+	for (i = 0; i < count; i++) {
+		if ((fields = replies[i]) && (redis_reply_is_array(fields)
+#ifdef REDIS_REPLY_PUSH
+			|| fields->type == REDIS_REPLY_MAP
+#endif
+			)) {
+			fields_stored = 0;
+			for (j = 0; j + 1 < fields->elements; j += 2) {
+				if (fields->element[j]->type == REDIS_REPLY_STRING
+					&& fields->element[j + 1]->type == REDIS_REPLY_STRING
+					&& !redis_reply_value(fields->element[j + 1], &value, &value_len)
+					&& !redis_cache_put(conn, epoch, keys[i]->str, fields->element[j]->str, value, value_len)) {
+					fields_stored++;
+				}
+			}
+			stored += fields_stored > 0;
+		}
+		redis_reply_free(replies[i]);
+	}
+	ast_free(replies);
+
+	ast_mutex_lock(&preload.lock);
+	preload.hashes += stored;
+	ast_mutex_unlock(&preload.lock);
+
+	return res;
+}
+
+/*!
+ * \brief Load the keys of one type matching a pattern into the cache.
+ *
+ * \param type SCAN TYPE filter, "string" or "hash"
+ */
+static int redis_preload_scan(struct redis_conn *conn, const char *pattern, const char *type)
+{
+	struct redis_args command;
+	struct redis_keyspace space;
+	redisReply *reply;
+	redisReply *keys;
+	char cursor[32] = "0";
+	char count[16];
+	int batch;
+	int res = 0;
+	int i;
+
+	redis_keyspace_general(&space);
+	snprintf(count, sizeof(count), "%d", SCAN_COUNT);
+	do {
+		redis_args_init(&command, "SCAN", cursor, NULL);
+		redis_args_addstr(&command, "MATCH");
+		if (redis_args_addkey(&command, &space, pattern)) {
+			return -1;
+		}
+		redis_args_addstr(&command, "COUNT");
+		redis_args_addstr(&command, count);
+		redis_args_addstr(&command, "TYPE");
+		redis_args_addstr(&command, type);
+		reply = redis_logged_command(conn, &command);
+
+		if (!redis_scan_reply_valid(reply)) {
+			ast_log(LOG_WARNING, "REDIS: Preload of '%s' failed. Reason: %s\n", pattern,
+				reply && reply->type == REDIS_REPLY_ERROR ? reply->str : conn->ctx->errstr);
+			redis_reply_free(reply);
+			return -1;
+		}
+		ast_copy_string(cursor, reply->element[0]->str, sizeof(cursor));
+		keys = reply->element[1];
+
+		/* COUNT is only a hint, so split what came back into batches of at most SCAN_COUNT */
+		for (i = 0; !res && i < keys->elements; i += batch) {
+			batch = MIN(keys->elements - i, SCAN_COUNT);
+			res = !strcmp(type, "hash") ? redis_preload_hashes(conn, keys->element + i, batch)
+				: redis_preload_values(conn, keys->element + i, batch);
+		}
+		redis_reply_free(reply);
+		if (!res && !redis_preload_tracked(conn)) {
+			/* Nothing read on conn can be cached any more, a new run refills the cache */
+			ast_log(LOG_NOTICE, "REDIS: Preload stopped, the cache listener was restarted.\n");
+			res = -1;
+		}
+	} while (!res && !redis_preload_stopping() && strcmp(cursor, "0") && !redis_preload_full());
+
+	return res;
+}
+
+static void *redis_preload_thread(void *data)
+{
+	char patterns[SUBSCRIBE_CONF_SZ];
+	struct redis_conn *conn = NULL;
+	unsigned int generation;
+	char *pattern;
+	char *next;
+	int waited;
+	int res = 0;
+
+	ast_mutex_lock(&redis_lock);
+	ast_copy_string(patterns, preload_patterns, sizeof(patterns));
+	ast_mutex_unlock(&redis_lock);
+
+	/* Values are only cached from connections tracked by the current listener */
+	for (waited = 0; !redis_preload_stopping() && waited < PRELOAD_WAIT_MS; waited += 100) {
+		ast_mutex_lock(&cache.lock);
+		res = cache.tracking_id != 0;
+		ast_mutex_unlock(&cache.lock);
+		if (res) {
+			break;
+		}
+		usleep(100000);
+	}
+	if (redis_preload_stopping()) {
+		return NULL;
+	}
+
+	ast_mutex_lock(&pool.lock);
+	generation = pool.generation;
+	ast_mutex_unlock(&pool.lock);
+
+	/* A connection of its own, so the warm-up doesn't hold a pooled one for long */
+	if (!res || !(conn = redis_conn_open(&pool, generation, 1)) || !conn->tracking_id) {
+		ast_log(LOG_WARNING, "REDIS: Cache not preloaded, %s.\n",
+			res ? "no tracked connection could be opened" : "the cache listener isn't subscribed");
+		if (conn) {
+			redis_conn_close(conn);
+		}
+		redis_preload_finish(PRELOAD_FAILED);
+		return NULL;
+	}
+
+	ast_mutex_lock(&preload.lock);
+	preload.state = PRELOAD_RUNNING;
+	ast_mutex_unlock(&preload.lock);
+	res = 0;
+	for (next = patterns; !res && !redis_preload_stopping() && (pattern = strsep(&next, ","));) {
+		pattern = ast_strip(pattern);
+		if (!ast_strlen_zero(pattern) && !redis_preload_full()) {
+			res = redis_preload_scan(conn, pattern, "string") || redis_preload_scan(conn, pattern, "hash");
+		}
+	}
+	redis_conn_close(conn);
+
+	redis_preload_finish(res ? PRELOAD_FAILED : PRELOAD_DONE);
+	ast_mutex_lock(&preload.lock);
+	ast_log(LOG_NOTICE, "REDIS: Preloaded %u keys and %u hashes into the cache in %lld ms.\n",
+		preload.keys, preload.hashes, (long long) ast_tvdiff_ms(preload.finished, preload.started));
+	ast_mutex_unlock(&preload.lock);
+
+	return NULL;
+}
+
+static void redis_preload_stop(void)
+{
+	if (preload.thread == AST_PTHREADT_NULL) {
+		return;
+	}
+	ast_mutex_lock(&preload.lock);
+	preload.stop = 1;
+	ast_mutex_unlock(&preload.lock);
+	pthread_join(preload.thread, NULL);
+	preload.thread = AST_PTHREADT_NULL;
+}
+
+/*!
+ * \brief Start filling the cache with the preload keys, without holding up the caller.
+ *
+ * Called by the cache listener whenever it subscribes, on start and after it
+ * reconnected, so only that thread starts and stops the preload. A run still
+ * going is stopped first, since what it reads on a connection tracked by the
+ * previous listener can't be cached any more.
+ */
+static void redis_preload_start(void)
+{
+	int enabled;
+
+	ast_mutex_lock(&redis_lock);
+	enabled = cache_enabled && !ast_strlen_zero(preload_patterns);
+	ast_mutex_unlock(&redis_lock);
+
+	redis_preload_stop();
+
+	ast_mutex_lock(&preload.lock);
+	if (!enabled) {
+		preload.state = PRELOAD_OFF;
+		ast_mutex_unlock(&preload.lock);
+		return;
+	}
+	preload.stop = 0;
+	preload.keys = 0;
+	preload.hashes = 0;
+	preload.started = ast_tvnow();
+	preload.state = PRELOAD_WAITING;
+	ast_mutex_unlock(&preload.lock);
+
+	if (ast_pthread_create_background(&preload.thread, NULL, redis_preload_thread, NULL)) {
+		ast_log(LOG_ERROR, "Unable to start Redis preload thread.\n");
+		preload.thread = AST_PTHREADT_NULL;
+		redis_preload_finish(PRELOAD_FAILED);
+	}
+}
+
+/*!
+ * \brief Return the reply of a script or function to the dialplan.
+ *
+ * Arrays, sets and pushes are flattened one level into REDIS_RESULT_n. A
+ * RESP3 map sets REDIS_FIELD_n and REDIS_RESULT_n to each field and value.
+ */
+static void redis_script_result(struct ast_channel *chan, const char *fn_name, redisReply *reply,
+	char *buf, size_t len)
+{
+	struct redis_output out = { .buf = buf, .len = len, };
+	char var[32];
+	char num[32];
+	int is_map = 0;
+	int count;
+	int i;
+
+	switch (reply->type) {
+	case REDIS_REPLY_STRING:
+	case REDIS_REPLY_STATUS:
+		redis_output_set(&out, reply->str, reply->len);
+		break;
+	case REDIS_REPLY_NIL:
+		redis_set_status(chan, REDIS_STATUS_NOT_FOUND);
+		return;
+	case REDIS_REPLY_ERROR:
+		ast_log(LOG_WARNING, "%s: Failed. Reason: %s\n", fn_name, reply->str);
+		redis_set_status(chan, REDIS_STATUS_ERROR);
+		return;
+#ifdef REDIS_REPLY_PUSH
+	case REDIS_REPLY_MAP:
+		/* Elements alternate field and value */
+		is_map = 1;
+		/* Fall through */
+	case REDIS_REPLY_SET:
+	case REDIS_REPLY_PUSH:
+#endif
+	case REDIS_REPLY_ARRAY:
+		count = is_map ? reply->elements / 2 : reply->elements;
+		for (i = 0; i < count; i++) {
+			if (is_map) {
+				snprintf(var, sizeof(var), "REDIS_FIELD_%d", i + 1);
+				redis_reply_setvar(chan, var, reply->element[i * 2]);
+			}
+			snprintf(var, sizeof(var), "REDIS_RESULT_%d", i + 1);
+			redis_reply_setvar(chan, var, reply->element[is_map ? i * 2 + 1 : i]);
+		}
+		snprintf(num, sizeof(num), "%d", count);
+		pbx_builtin_setvar_helper(chan, "REDIS_RESULT_COUNT", num);
+		ast_copy_string(buf, num, len);
+		break;
+	default:
+		/* Integers, and under RESP3 doubles, booleans, big numbers and verbatim strings */
+		if (redis_reply_scalar(reply, buf, len)) {
+			ast_log(LOG_WARNING, "%s: Failed. Reason: unexpected reply\n", fn_name);
+			redis_set_status(chan, REDIS_STATUS_ERROR);
+			return;
+		}
+		break;
+	}
+	redis_set_status(chan, REDIS_STATUS_OK);
+}
+
+/*!
+ * \brief Shared implementation of REDIS_EVAL and REDIS_FCALL.
+ *
+ * \param is_eval non-zero to EVALSHA a registered script, zero to FCALL a server function
+ */
+static int redis_call(struct ast_channel *chan, const char *fn_name, char *parse, char *buf, size_t len,
+	int is_eval)
+{
+	AST_DECLARE_APP_ARGS(args,
+		AST_APP_ARG(name);
+		AST_APP_ARG(numkeys);
+		AST_APP_ARG(params)[MAX_BATCH_KEYS];
+	);
+	struct redis_profile *profile = NULL;
+	struct redis_keyspace space;
+	struct redis_script *script;
+	struct redis_conn *conn;
+	struct redis_args command;
+	redisReply *reply;
+	const char *first = NULL;
+	char sha1[41] = "";
+	char *source = NULL;
+	int numkeys;
+	int i;
+
+	buf[0] = '\0';
+
+	if (ast_strlen_zero(parse)) {
+		ast_log(LOG_WARNING, "%s requires at least two arguments, %s(<name>,<numkeys>[,<key>...][,<arg>...])\n",
+			fn_name, fn_name);
+		return -1;
+	}
+
+	AST_STANDARD_APP_ARGS(args, parse);
+
+	if (args.argc < 2 || sscanf(args.numkeys, "%30d", &numkeys) != 1
+		|| numkeys < 0 || numkeys > args.argc - 2) {
+		ast_log(LOG_WARNING, "%s requires at least two arguments, %s(<name>,<numkeys>[,<key>...][,<arg>...])\n",
+			fn_name, fn_name);
+		return -1;
+	}
+
+	/* The profile of the first key applies to all of them */
+	if (numkeys) {
+		first = args.params[0];
+		profile = redis_profile_find(&first, &space);
+	}
+
+	if (is_eval) {
+		ast_mutex_lock(&redis_lock);
+		AST_LIST_TRAVERSE(&scripts, script, list) {
+			if (!strcmp(script->name, args.name)) {
+				ast_copy_string(sha1, script->sha1, sizeof(sha1));
+				source = ast_strdup(script->source);
+				break;
+			}
+		}
+		ast_mutex_unlock(&redis_lock);
+
+		if (!source) {
+			ast_log(LOG_WARNING, "%s: No script named '%s' in %s.\n", fn_name, args.name, REDIS_CONF);
+			redis_set_status(chan, REDIS_STATUS_ERROR);
+			return 0;
+		}
+		redis_args_init(&command, "EVALSHA", sha1, args.numkeys, NULL);
+	} else {
+		redis_args_init(&command, "FCALL", args.name, args.numkeys, NULL);
+	}
+	for (i = 0; i < args.argc - 2; i++) {
+		if (i >= numkeys) {
+			redis_args_addstr(&command, args.params[i]);
+		} else if (redis_args_addkey(&command, &space, i ? args.params[i] : first)) {
+			ast_free(source);
+			return -1;
+		}
+	}
+
+	/* A cluster runs the script on the node of its first key */
+	if (!(conn = numkeys ? redis_key_acquire(profile, command.argv[2], 0) : redis_pool_acquire(&pool))) {
+		ast_free(source);
+		redis_set_status(chan, REDIS_STATUS_UNAVAILABLE);
+		return 0;
+	}
+
+	reply = redis_routed_command(&conn, &command);
+	if (source && reply && reply->type == REDIS_REPLY_ERROR && !strncmp(reply->str, "NOSCRIPT", 8)) {
+		/* Not cached on this server yet, EVAL sends it once and caches it */
+		redis_reply_free(reply);
+		command.argv[0] = "EVAL";
+		command.argvlen[0] = 4;
+		command.argv[1] = source;
+		command.argvlen[1] = strlen(source);
+		reply = redis_routed_command(&conn, &command);
+	}
+
+	if (reply == NULL) {
+		ast_log(LOG_WARNING, "%s: Error running %s. Reason: %s\n", fn_name, args.name, conn->ctx->errstr);
+		redis_set_status(chan, REDIS_STATUS_ERROR);
+	} else {
+		redis_script_result(chan, fn_name, reply, buf, len);
+	}
+
+	redis_reply_free(reply);
+	redis_pool_release(conn);
+	ast_free(source);
+
+	return 0;
+}
+
+static int function_redis_eval(struct ast_channel *chan, const char *cmd,
+			    char *parse, char *buf, size_t len)
+{
+	int res;
+
+	redis_deadline_begin(chan);
+	res = redis_call(chan, "REDIS_EVAL", parse, buf, len, 1);
+	redis_deadline_end();
+
+	return res;
+}
+
+static struct ast_custom_function redis_eval_function = {
+	.name = "REDIS_EVAL",
+	.read = function_redis_eval,
+};
+
+static int function_redis_fcall(struct ast_channel *chan, const char *cmd,
+			    char *parse, char *buf, size_t len)
+{
+	int res;
+
+	redis_deadline_begin(chan);
+	res = redis_call(chan, "REDIS_FCALL", parse, buf, len, 0);
+	redis_deadline_end();
+
+	return res;
+}
+
+static struct ast_custom_function redis_fcall_function = {
+	.name = "REDIS_FCALL",
+	.read = function_redis_fcall,
+};
+
+static int function_redis_begin(struct ast_channel *chan, const char *cmd,
+			      char *parse, char *buf, size_t len)
+{
+	struct ast_flags flags = { 0 };
+	struct ast_datastore *datastore;
+	struct redis_batch *batch;
+
+	buf[0] = '\0';
+
+	if (!chan) {
+		ast_log(LOG_WARNING, "REDIS_BEGIN requires a channel\n");
+		return -1;
+	}
+	if (!ast_strlen_zero(parse)) {
+		ast_app_parse_options(redis_begin_options, &flags, NULL, parse);
+	}
+
+	ast_channel_lock(chan);
+	if ((datastore = ast_channel_datastore_find(chan, &redis_batch_info, NULL))) {
+		ast_channel_unlock(chan);
+		ast_log(LOG_WARNING, "REDIS_BEGIN: A batch is already open on %s, adding to it.\n",
+			ast_channel_name(chan));
+		redis_set_status(chan, REDIS_STATUS_OK);
+		return 0;
+	}
+	if (!(batch = ast_calloc(1, sizeof(*batch)))) {
+		ast_channel_unlock(chan);
+		return -1;
+	}
+	if (!(datastore = ast_datastore_alloc(&redis_batch_info, NULL))) {
+		ast_channel_unlock(chan);
+		ast_free(batch);
+		return -1;
+	}
+	batch->pipeline = ast_test_flag(&flags, OPT_PIPELINE);
+	datastore->data = batch;
+	ast_channel_datastore_add(chan, datastore);
+	ast_channel_unlock(chan);
+
+	redis_set_status(chan, REDIS_STATUS_OK);
+
+	return 0;
+}
+
+static int function_redis_begin_write(struct ast_channel *chan, const char *cmd, char *parse,
+	const char *value)
+{
+	char buf[16];
+	return function_redis_begin(chan, cmd, parse, buf, sizeof(buf));
+}
+
+static struct ast_custom_function redis_begin_function = {
+	.name = "REDIS_BEGIN",
+	.read = function_redis_begin,
+	.write = function_redis_begin_write,
+};
+
+static int redis_commit(struct ast_channel *chan, const char *cmd,
+			      char *parse, char *buf, size_t len)
+{
+	struct redis_async_batch node = AST_LIST_HEAD_NOLOCK_INIT_VALUE;
+	struct ast_datastore *datastore;
+	struct redis_batch *batch;
+	struct redis_async_cmd *item;
+	struct redis_conn *conn;
+	struct redis_pool *p;
+	unsigned int written = 0;
+	unsigned int errors = 0;
+	int unavailable = 0;
+	int clustered;
+	int failed = 0;
+	int count;
+	int slot;
+
+	buf[0] = '\0';
+
+	if (!chan) {
+		ast_log(LOG_WARNING, "REDIS_COMMIT requires a channel\n");
+		return -1;
+	}
+
+	ast_channel_lock(chan);
+	if ((datastore = ast_channel_datastore_find(chan, &redis_batch_info, NULL))) {
+		ast_channel_datastore_remove(chan, datastore);
+	}
+	ast_channel_unlock(chan);
+
+	if (!datastore) {
+		ast_log(LOG_WARNING, "REDIS_COMMIT: No REDIS_BEGIN on %s.\n", ast_channel_name(chan));
+		redis_set_status(chan, REDIS_STATUS_ERROR);
+		return 0;
+	}
+	batch = datastore->data;
+	clustered = redis_cluster_enabled();
+
+	/* A cluster refuses MULTI/EXEC over several slots with CROSSSLOT, even on one node */
+	if (clustered && !batch->pipeline) {
+		slot = -1;
+		AST_LIST_TRAVERSE(&batch->cmds, item, list) {
+			if (item->slot < 0) {
+				continue;
+			}
+			if (slot >= 0 && item->slot != slot) {
+				break;
+			}
+			slot = item->slot;
+		}
+		if (item) {
+			ast_log(LOG_WARNING, "REDIS_COMMIT: The keys hash to more than one cluster slot, which a "
+				"transaction can't. Give them a common hash tag, such as {call}:, or use REDIS_BEGIN(p) "
+				"for a pipeline.\n");
+			snprintf(buf, len, "0");
+			redis_set_status(chan, REDIS_STATUS_ERROR);
+			ast_datastore_free(datastore);
+			return 0;
+		}
+	}
+
+	/* A transaction runs on one connection, a pipeline is split like the async writer's batches */
+	while (!AST_LIST_EMPTY(&batch->cmds)) {
+		p = redis_async_pool(AST_LIST_FIRST(&batch->cmds), clustered);
+		count = redis_async_take(&batch->cmds, &node, p, clustered);
+
+		if (!batch->pipeline && !AST_LIST_EMPTY(&batch->cmds)) {
+			ast_log(LOG_WARNING, "REDIS_COMMIT: The writes span more than one %s, which a transaction can't. "
+				"Use REDIS_BEGIN(p) for a pipeline.\n", clustered ? "cluster node" : "profile");
+			failed = batch->count;
+			AST_LIST_APPEND_LIST(&batch->cmds, &node, list);
+			break;
+		}
+		if (!(conn = redis_pool_acquire(p))) {
+			unavailable = 1;
+			failed += count;
+			while ((item = AST_LIST_REMOVE_HEAD(&node, list))) {
+				redis_async_cmd_free(item);
+			}
+			continue;
+		}
+		if (batch->pipeline) {
+			redis_async_send(conn, &node, &written, &errors);
+		} else {
+			failed += redis_batch_exec(conn, &node, count);
+			redis_pool_release(conn);
+		}
+	}
+	failed += errors;
+
+	snprintf(buf, len, "%d", batch->count - failed);
+	if (!failed) {
+		redis_set_status(chan, REDIS_STATUS_OK);
+	} else {
+		redis_set_status(chan, unavailable ? REDIS_STATUS_UNAVAILABLE : REDIS_STATUS_ERROR);
+	}
+	ast_datastore_free(datastore);
+
+	return 0;
+}
+
+static int function_redis_commit(struct ast_channel *chan, const char *cmd,
+			      char *parse, char *buf, size_t len)
+{
+	int res;
+
+	redis_deadline_begin(chan);
+	res = redis_commit(chan, cmd, parse, buf, len);
+	redis_deadline_end();
+
+	return res;
+}
+
+static int function_redis_commit_write(struct ast_channel *chan, const char *cmd, char *parse,
+	const char *value)
+{
+	char buf[16];
+	return function_redis_commit(chan, cmd, parse, buf, sizeof(buf));
+}
+
+static struct ast_custom_function redis_commit_function = {
+	.name = "REDIS_COMMIT",
+	.read = function_redis_commit,
+	.write = function_redis_commit_write,
+};
+
+static char *handle_cli_redis_set(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct redis_conn *conn;
+	redisReply *reply = NULL;
+	struct redis_args command;
+
+	switch (cmd) {
+		case CLI_INIT:
+			e->command = "redis set";
+			e->usage =
+					"Usage: redis set <key> <value>\n"
+							"       Creates an entry in the Redis database for a given key and value.\n"
+							"redis set <key> <hash> <value>\n"
+							"		Creates an entry in the Redis database for a given key, hash and value\n";
+			return NULL;
+		case CLI_GENERATE:
+			return NULL;
+	}
+
+	if (a->argc < 4 || a->argc > 5)
+		return CLI_SHOWUSAGE;
+
+	if (!(conn = redis_key_acquire(NULL, a->argv[2], 0))) {
+		ast_cli(a->fd, "Redis database error.\n");
+		return CLI_FAILURE;
+	}
+
+	if (a->argc == 4) {
+		redis_args_init(&command, "SET", a->argv[2], a->argv[3], NULL);
+	} else {
+		redis_args_init(&command, "HSET", a->argv[2], a->argv[3], a->argv[4], NULL);
+	}
+	reply = redis_routed_command(&conn, &command);
+
+	if (conn->ctx->err != 0) {
+		ast_cli(a->fd, "Redis database error.\n");
+	} else {
+		ast_cli(a->fd, "Redis database entry created.\n");
+	}
+	redis_reply_free(reply);
+	redis_pool_release(conn);
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_redis_del(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct redis_conn *conn;
+	redisReply *reply;
+	struct redis_args command;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "redis del";
+		e->usage =
+			"Usage: redis del <key>\n"
+			"       Deletes an entry in the Redis database for a given key.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3)
+		return CLI_SHOWUSAGE;
+
+	if (!(conn = redis_key_acquire(NULL, a->argv[2], 0))) {
+		ast_cli(a->fd, "Redis database error.\n");
+		return CLI_FAILURE;
+	}
+
+	redis_args_init(&command, "DEL", a->argv[2], NULL);
+	reply = redis_routed_command(&conn, &command);
+	
+	if (conn->ctx->err != 0) {
+		ast_cli(a->fd, "Redis database entry does not exist.\n");
+	} else {
+		ast_cli(a->fd, "Redis database entry removed.\n");
+	}
+	redis_reply_free(reply);
+	redis_pool_release(conn);
+	return CLI_SUCCESS;
+}
+
+/*!
+ * \brief Print the values of a batch of keys returned by SCAN.
+ *
+ * String values come from one MGET per batch, or in cluster mode, where keys
+ * of different slots can't share an MGET, from a pipeline of GETs. Keys of
+ * other types are then shown by type, from a single pipeline of TYPE commands.
+ */
+static int redis_show_keys(int fd, struct redis_conn *conn, redisReply **keys, int count)
+{
+	struct redis_args command;
+	struct redis_args *types = NULL;
+	struct redis_args *gets = NULL;
+	redisReply **type_replies = NULL;
+	redisReply **get_replies = NULL;
+	redisReply **vals;
+	redisReply *values = NULL;
+	const char *value;
+	size_t value_len;
+	int *others = NULL;
+	int nothers = 0;
+	int res = 0;
+	int i;
+
+	if (redis_cluster_enabled()) {
+		if (!(gets = ast_calloc(count, sizeof(*gets)))
+			|| !(get_replies = ast_calloc(count, sizeof(*get_replies)))) {
+			ast_free(gets);
+			return -1;
 		}
-		ast_log(LOG_WARNING, "Database %s selected.\n", database);
-		freeReplyObject(reply);
+		for (i = 0; i < count; i++) {
+			redis_args_init(&gets[i], "GET", NULL);
+			redis_args_add(&gets[i], keys[i]->str, keys[i]->len);
+		}
+		res = redis_logged_pipeline(conn, gets, count, get_replies);
+		ast_free(gets);
+		for (i = 0; !res && i < count; i++) {
+			res = get_replies[i] ? 0 : -1;
+		}
+		if (res) {
+			for (i = 0; i < count; i++) {
+				redis_reply_free(get_replies[i]);
+			}
+			ast_free(get_replies);
+			return -1;
+		}
+		vals = get_replies;
+	} else {
+		redis_args_init(&command, "MGET", NULL);
+		for (i = 0; i < count; i++) {
+			redis_args_add(&command, keys[i]->str, keys[i]->len);
+		}
+		values = redis_logged_command(conn, &command);
+
+		if (values == NULL || values->type != REDIS_REPLY_ARRAY || values->elements != count) {
+			redis_reply_free(values);
+			return -1;
+		}
+		vals = values->element;
 	}
 
-	return 1;
+	for (i = 0; i < count; i++) {
+		if (vals[i]->type == REDIS_REPLY_STRING && redis_reply_value(vals[i], &value, &value_len)) {
+			ast_cli(fd, "%-50.*s: <corrupt compressed value>\n", (int) keys[i]->len, keys[i]->str);
+		} else if (vals[i]->type == REDIS_REPLY_STRING) {
+			ast_cli(fd, "%-50.*s: %-25.*s\n", (int) keys[i]->len, keys[i]->str, (int) value_len, value);
+		} else {
+			nothers++;
+		}
+	}
+
+	if (nothers) {
+		if (!(types = ast_calloc(nothers, sizeof(*types)))
+			|| !(type_replies = ast_calloc(nothers, sizeof(*type_replies)))
+			|| !(others = ast_calloc(nothers, sizeof(*others)))) {
+			res = -1;
+			goto done;
+		}
+		nothers = 0;
+		for (i = 0; i < count; i++) {
+			if (vals[i]->type != REDIS_REPLY_STRING) {
+				redis_args_init(&types[nothers], "TYPE", NULL);
+				redis_args_add(&types[nothers], keys[i]->str, keys[i]->len);
+				others[nothers++] = i;
+			}
+		}
+		res = redis_logged_pipeline(conn, types, nothers, type_replies);
+		for (i = 0; i < nothers; i++) {
+			if (type_replies[i] && type_replies[i]->type == REDIS_REPLY_STATUS) {
+				ast_cli(fd, "%-50.*s: <%s>\n", (int) keys[others[i]]->len, keys[others[i]]->str,
+					type_replies[i]->str);
+			}
+			redis_reply_free(type_replies[i]);
+		}
+	}
+
+done:
+	ast_free(others);
+	ast_free(type_replies);
+	ast_free(types);
+	if (get_replies) {
+		for (i = 0; i < count; i++) {
+			redis_reply_free(get_replies[i]);
+		}
+		ast_free(get_replies);
+	}
+	redis_reply_free(values);
+
+	return res;
 }
 
-static int function_redis_read(struct ast_channel *chan, const char *cmd,
-			    char *parse, char *buf, size_t len)
+/*!
+ * \brief Parse the optional limit argument of the show commands.
+ *
+ * \retval 0 on success
+ * \retval -1 the argument is not a number
+ */
+static int redis_show_limit(const char *arg, int *limit)
 {
-	AST_DECLARE_APP_ARGS(args,
-		AST_APP_ARG(key);
-		AST_APP_ARG(hash);
-	);
+	*limit = DEFAULT_SHOW_LIMIT;
+	if (!arg) {
+		return 0;
+	}
+	if (sscanf(arg, "%30d", limit) != 1 || *limit < 0) {
+		return -1;
+	}
+	return 0;
+}
 
-	buf[0] = '\0';
+/*!
+ * \brief Print the keys of one server matching a pattern.
+ *
+ * \param shown number of keys printed so far, updated
+ *
+ * \retval 0 every matching key was printed
+ * \retval 1 stopped at the limit
+ * \retval -1 a database error
+ */
+static int redis_show_scan(int fd, struct redis_pool *p, const char *pattern, int limit, int *shown)
+{
+	struct redis_conn *conn;
+	redisReply *reply;
+	redisReply *keys;
+	struct redis_args command;
+	char cursor[32] = "0";
+	char count[16];
+	/* Keys of a page that the limit left out */
+	int truncated = 0;
+	int res = 0;
+	int batch;
+	int i;
 
-	if (ast_strlen_zero(parse)) {
-		ast_log(LOG_WARNING, "REDIS requires an argument, REDIS(<key>) or REDIS(<key>,<hash>)\n");
+	if (limit && *shown >= limit) {
+		/* Another node may still have keys to show */
+		return 1;
+	}
+	if (!(conn = redis_pool_acquire(p))) {
 		return -1;
 	}
 
-	AST_STANDARD_APP_ARGS(args, parse);
+	snprintf(count, sizeof(count), "%d", SCAN_COUNT);
+	do {
+		redis_args_init(&command, "SCAN", cursor, "MATCH", pattern, "COUNT", count, NULL);
+		reply = redis_logged_command(conn, &command);
+
+		if (!redis_scan_reply_valid(reply)) {
+			redis_reply_free(reply);
+			res = -1;
+			break;
+		}
+		ast_copy_string(cursor, reply->element[0]->str, sizeof(cursor));
+		keys = reply->element[1];
+
+		/* COUNT is only a hint, so split what came back into MGET sized batches */
+		for (i = 0; i < keys->elements && (!limit || *shown < limit); i += batch) {
+			batch = MIN(keys->elements - i, SCAN_COUNT);
+			if (limit) {
+				batch = MIN(batch, limit - *shown);
+			}
+			if (redis_show_keys(fd, conn, keys->element + i, batch)) {
+				res = -1;
+				break;
+			}
+			*shown += batch;
+		}
+		truncated = i < keys->elements;
+		redis_reply_free(reply);
+	} while (!res && strcmp(cursor, "0") && (!limit || *shown < limit));
+
+	redis_pool_release(conn);
+
+	return res ? res : truncated || strcmp(cursor, "0") ? 1 : 0;
+}
+
+static char *handle_cli_redis_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct redis_pool *pools[MAX_CLUSTER_NODES] = { &pool };
+	const char *pattern;
+	int npools = 1;
+	int limit;
+	int shown = 0;
+	int res = 0;
+	int i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "redis show";
+		e->usage =
+			"Usage: redis show\n"
+			"   OR: redis show [pattern [limit]]\n"
+			"       Shows Redis database contents, optionally restricted\n"
+			"       to a pattern.\n"
+			"\n"
+			"		[pattern] pattern to match keys\n"
+			"		Examples :\n"
+			"			- h?llo matches hello, hallo and hxllo\n"
+			"			- h*llo matches hllo and heeeello\n"
+			"			- h[ae]llo matches hello and hallo, but not hillo\n"
+			"		[limit] stop after this many keys, 0 for no limit\n"
+			"		(default 1000)\n"
+			"\n"
+			"       Keys are found incrementally with SCAN, so the server is\n"
+			"       never blocked for long. Keys that aren't strings are shown\n"
+			"       with their type.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+	
+	if (a->argc < 2 || a->argc > 4) {
+		return CLI_SHOWUSAGE;
+	}
+	pattern = a->argc > 2 ? a->argv[2] : "*";
+	if (redis_show_limit(a->argc > 3 ? a->argv[3] : NULL, &limit)) {
+		return CLI_SHOWUSAGE;
+	}
+
+	/* Each cluster node only knows its own keys */
+	if (redis_cluster_enabled()) {
+		npools = redis_cluster_masters(pools, ARRAY_LEN(pools));
+	}
+
+	for (i = 0; i < npools && !res; i++) {
+		if ((res = redis_show_scan(a->fd, pools[i], pattern, limit, &shown)) < 0) {
+			ast_cli(a->fd, "Redis database error.\n");
+		}
+	}
+
+	if (res > 0) {
+		ast_cli(a->fd, "Stopped after %d results, raise the limit to see more.\n", shown);
+	}
+	ast_cli(a->fd, "%d results found.\n", shown);
+
+	return res < 0 && !shown ? CLI_FAILURE : CLI_SUCCESS;
+}
+
+static char *handle_cli_redis_hshow(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct redis_conn *conn;
+	redisReply *reply;
+	redisReply *fields;
+	struct redis_args command;
+	const char *value;
+	size_t value_len;
+	char cursor[32] = "0";
+	char count[16];
+	int limit;
+	int shown = 0;
+	/* Fields of a page that the limit left out */
+	int truncated = 0;
+	int i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "redis hshow";
+		e->usage =
+			"Usage: redis hshow <hash> [limit]\n"
+			"       Shows Redis hash contents, iterating with HSCAN.\n"
+			"\n"
+			"		[limit] stop after this many fields, 0 for no limit\n"
+			"		(default 1000)\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+	
+	if (a->argc < 3 || a->argc > 4) {
+		return CLI_SHOWUSAGE;
+	}
+	if (redis_show_limit(a->argc > 3 ? a->argv[3] : NULL, &limit)) {
+		return CLI_SHOWUSAGE;
+	}
+
+	if (!(conn = redis_key_acquire(NULL, a->argv[2], 0))) {
+		ast_cli(a->fd, "Redis database error.\n");
+		return CLI_FAILURE;
+	}
+
+	snprintf(count, sizeof(count), "%d", SCAN_COUNT);
+	do {
+		redis_args_init(&command, "HSCAN", a->argv[2], cursor, "COUNT", count, NULL);
+		reply = redis_routed_command(&conn, &command);
+
+		if (!redis_scan_reply_valid(reply)) {
+			ast_cli(a->fd, "Redis database error.\n");
+			redis_reply_free(reply);
+			break;
+		}
+		ast_copy_string(cursor, reply->element[0]->str, sizeof(cursor));
+		fields = reply->element[1];
+
+		/* Field names and values alternate */
+		for (i = 0; i + 1 < fields->elements && (!limit || shown < limit); i += 2) {
+			if (redis_reply_value(fields->element[i + 1], &value, &value_len)) {
+				ast_cli(a->fd, "%-50.*s: <corrupt compressed value>\n",
+					(int) fields->element[i]->len, fields->element[i]->str);
+			} else {
+				ast_cli(a->fd, "%-50.*s: %-25.*s\n",
+					(int) fields->element[i]->len, fields->element[i]->str, (int) value_len, value);
+			}
+			shown++;
+		}
+		truncated = i + 1 < fields->elements;
+		redis_reply_free(reply);
+	} while (strcmp(cursor, "0") && (!limit || shown < limit));
+
+	if (truncated || strcmp(cursor, "0")) {
+		ast_cli(a->fd, "Stopped after %d results, raise the limit to see more.\n", shown);
+	}
+	ast_cli(a->fd, "%d results found.\n", shown);
+	redis_pool_release(conn);
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_redis_show_cache(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	unsigned int lookups;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "redis show cache";
+		e->usage =
+			"Usage: redis show cache\n"
+			"       Shows the settings and hit/miss counters of the local read cache.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_mutex_lock(&redis_lock);
+	ast_cli(a->fd, "Enabled:       %s\n", cache_enabled ? "Yes" : "No");
+	ast_cli(a->fd, "Max entries:   %d\n", cache_size);
+	ast_cli(a->fd, "TTL:           %d ms\n", cache_ttl_ms);
+	ast_cli(a->fd, "Negative TTL:  %d ms\n", cache_negative_ttl_ms);
+	ast_mutex_unlock(&redis_lock);
+
+	ast_mutex_lock(&cache.lock);
+	lookups = cache.hits + cache.misses;
+	ast_cli(a->fd, "Tracking:      %s\n", cache.tracking_id ? "Subscribed" : "Not subscribed");
+	ast_cli(a->fd, "Entries:       %d\n", ao2_container_count(cache.entries));
+	ast_cli(a->fd, "Hits:          %u (%.1f%%)\n", cache.hits,
+		lookups ? 100.0 * cache.hits / lookups : 0.0);
+	ast_cli(a->fd, "Misses:        %u\n", cache.misses);
+	ast_cli(a->fd, "Evictions:     %u\n", cache.evictions);
+	ast_cli(a->fd, "Invalidations: %u\n", cache.invalidations);
+	ast_mutex_unlock(&cache.lock);
+
+	ast_mutex_lock(&flights.lock);
+	ast_cli(a->fd, "Coalesced:     %u\n", flights.coalesced);
+	ast_mutex_unlock(&flights.lock);
+
+	ast_mutex_lock(&preload.lock);
+	ast_cli(a->fd, "Preload:       %s\n", redis_preload_state_names[preload.state]);
+	if (preload.state == PRELOAD_RUNNING || preload.state == PRELOAD_DONE || preload.state == PRELOAD_FAILED) {
+		ast_cli(a->fd, "Preloaded:     %u keys, %u hashes in %lld ms\n", preload.keys, preload.hashes,
+			(long long) ast_tvdiff_ms(preload.state == PRELOAD_RUNNING ? ast_tvnow() : preload.finished,
+				preload.started));
+	}
+	ast_mutex_unlock(&preload.lock);
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_redis_show_async(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "redis show async";
+		e->usage =
+			"Usage: redis show async\n"
+			"       Shows the queue length and counters of the async writer.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_mutex_lock(&redis_lock);
+	ast_cli(a->fd, "Default:       %s\n", async_writes ? "Async" : "Sync");
+	ast_cli(a->fd, "Queue limit:   %d\n", async_queue_size);
+	ast_mutex_unlock(&redis_lock);
+
+	ast_mutex_lock(&async.lock);
+	ast_cli(a->fd, "Queued:        %d\n", async.queued);
+	ast_cli(a->fd, "Written:       %u\n", async.written);
+	ast_cli(a->fd, "Errors:        %u\n", async.errors);
+	ast_cli(a->fd, "Dropped:       %u\n", async.dropped);
+	ast_mutex_unlock(&async.lock);
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_redis_show_subscriptions(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "redis show subscriptions";
+		e->usage =
+			"Usage: redis show subscriptions\n"
+			"       Shows the channels and patterns raised as RedisMessage\n"
+			"       events and how many messages have arrived.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
+
+	ast_mutex_lock(&redis_lock);
+	ast_cli(a->fd, "Channels:      %s\n", S_OR(subscribe_channels, "(none)"));
+	ast_cli(a->fd, "Patterns:      %s\n", S_OR(subscribe_patterns, "(none)"));
+	ast_cli(a->fd, "Update cache:  %s\n", subscribe_cache && cache_enabled ? "Yes" : "No");
+	ast_mutex_unlock(&redis_lock);
+
+	ast_cli(a->fd, "Running:       %s\n", subscriber.thread != AST_PTHREADT_NULL ? "Yes" : "No");
+	ast_cli(a->fd, "Messages:      %u\n", subscriber.messages);
+
+	return CLI_SUCCESS;
+}
+
+static char *handle_cli_redis_show_stats(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+{
+	struct redis_stats_snapshot snap;
+	int i;
+
+	switch (cmd) {
+	case CLI_INIT:
+		e->command = "redis show stats";
+		e->usage =
+			"Usage: redis show stats\n"
+			"       Shows call counts, errors, timeouts and latencies of\n"
+			"       Redis commands since the module was loaded. Latency\n"
+			"       percentiles are accurate to within a factor of two.\n";
+		return NULL;
+	case CLI_GENERATE:
+		return NULL;
+	}
+
+	if (a->argc != 3) {
+		return CLI_SHOWUSAGE;
+	}
 
-	if (args.argc < 1 || args.argc > 2) {
-		ast_log(LOG_WARNING, "REDIS requires an argument, REDIS(<key>) or REDIS(<key>,<hash>)\n");
-		return -1;
-	} else if (args.argc == 1) {
-		reply = redisLoggedCommand(redis,"GET %s", args.key);
-	} else if (args.argc == 2) {
-		reply = redisLoggedCommand(redis,"HGET %s %s", args.key, args.hash);
+	ast_cli(a->fd, "%-10s %12s %10s %10s %10s %10s %10s\n",
+		"Command", "Count", "Errors", "Timeouts", "p50 (us)", "p99 (us)", "Max (us)");
+	for (i = 0; i < REDIS_STAT_MAX; i++) {
+		redis_stats_snapshot(i, &snap);
+		ast_cli(a->fd, "%-10s %12d %10d %10d %10d %10d %10d\n", redis_stat_names[i],
+			snap.count, snap.errors, snap.timeouts, snap.p50_us, snap.p99_us, snap.max_us);
 	}
 
+	return CLI_SUCCESS;
+}
+
+static int manager_redis_stats(struct mansession *s, const struct message *m)
+{
+	const char *id = astman_get_header(m, "ActionID");
+	char id_text[256] = "";
+	struct redis_stats_snapshot snap;
+	int i;
 
-	if (reply == NULL || redis->err != 0 || reply->type == REDIS_REPLY_NIL) {
-		ast_log(LOG_DEBUG, "REDIS: Key %s not found in database.\n", args.key);
-	} else {
-		strcpy(buf, reply->str);
-		pbx_builtin_setvar_helper(chan, "REDIS_RESULT", reply->str);
+	if (!ast_strlen_zero(id)) {
+		snprintf(id_text, sizeof(id_text), "ActionID: %s\r\n", id);
 	}
 
-	freeReplyObject(reply);
+	astman_send_listack(s, m, "Redis statistics will follow", "start");
+	for (i = 0; i < REDIS_STAT_MAX; i++) {
+		redis_stats_snapshot(i, &snap);
+		astman_append(s,
+			"Event: RedisStatsEntry\r\n"
+			"%s"
+			"Command: %s\r\n"
+			"Count: %d\r\n"
+			"Errors: %d\r\n"
+			"Timeouts: %d\r\n"
+			"P50: %d\r\n"
+			"P99: %d\r\n"
+			"Max: %d\r\n"
+			"\r\n",
+			id_text, redis_stat_names[i], snap.count, snap.errors, snap.timeouts,
+			snap.p50_us, snap.p99_us, snap.max_us);
+	}
+	astman_send_list_complete_start(s, m, "RedisStatsComplete", REDIS_STAT_MAX);
+	astman_send_list_complete_end(s);
 
 	return 0;
 }
 
-static int function_redis_write(struct ast_channel *chan, const char *cmd, char *parse,
-			     const char *value)
+/*!
+ * \brief Set up the channel an AMI action runs the dialplan callbacks on.
+ *
+ * The actions call the same function bodies as the dialplan, with the header
+ * values passed as already parsed arguments, so they share its pools, cache,
+ * async writer and statistics. A dummy channel holds the
+ * variables the callbacks set, and REDIS_TIMEOUT_MS from the Timeout header.
+ */
+static struct ast_channel *redis_manager_channel(struct mansession *s, const struct message *m)
 {
-	AST_DECLARE_APP_ARGS(args,
-		AST_APP_ARG(key);
-		AST_APP_ARG(hash);
-	);
+	const char *timeout = astman_get_header(m, "Timeout");
+	struct ast_channel *chan;
 
-	if (ast_strlen_zero(parse)) {
-		ast_log(LOG_WARNING, "REDIS requires an argument, REDIS(<key>)=<value> or REDIS(<key>,<hash>)=<value>\n");
-		return -1;
+	if (!(chan = ast_dummy_channel_alloc())) {
+		astman_send_error(s, m, "Unable to allocate a channel");
+		return NULL;
+	}
+	if (!ast_strlen_zero(timeout)) {
+		pbx_builtin_setvar_helper(chan, "REDIS_TIMEOUT_MS", timeout);
 	}
 
-	AST_STANDARD_APP_ARGS(args, parse);
+	return chan;
+}
 
-	if (args.argc < 1 || args.argc > 2) {
-		ast_log(LOG_WARNING, "REDIS requires an argument, REDIS(<key>)=<value> or REDIS(<key>,<hash>)=<value>\n");
-		return -1;
-	} else if (args.argc == 1) {
-		reply = redisLoggedCommand(redis,"SET %s %s", args.key, value);
-	} else if (args.argc == 2) {
-		reply = redisLoggedCommand(redis,"HSET %s %s %s", args.key, args.hash, value);
-	}
+/*!
+ * \brief Get the outcome of a callback run for an AMI action.
+ *
+ * \return REDIS_STATUS if the call succeeded, or only found nothing to read or
+ *         write; NULL once the error has been sent
+ */
+static const char *redis_manager_status(struct mansession *s, const struct message *m,
+	struct ast_channel *chan, int res)
+{
+	const char *status = pbx_builtin_getvar_helper(chan, "REDIS_STATUS");
 
-	if (redis == NULL || redis->err != 0) {
-		ast_log(LOG_WARNING, "REDIS: Error writing value to database. Reason: %s\n", redis->errstr);
+	if (res || ast_strlen_zero(status)) {
+		astman_send_error(s, m, "Invalid arguments");
+		return NULL;
+	}
+	if (strcmp(status, "OK") && strcmp(status, "NOT_FOUND") && strcmp(status, "NOT_SET")) {
+		astman_send_error(s, m, ast_strdupa(status));
+		return NULL;
 	}
 
-	freeReplyObject(reply);
-
-	return 0;
+	return status;
 }
 
-static struct ast_custom_function redis_function = {
-	.name = "REDIS",
-	.read = function_redis_read,
-	.write = function_redis_write,
-};
-
-static int function_redis_exists(struct ast_channel *chan, const char *cmd,
-			      char *parse, char *buf, size_t len)
+/*!
+ * \brief Append a value as a header.
+ *
+ * A header can't span lines, so backslashes, carriage returns and line feeds
+ * are escaped.
+ */
+static void redis_manager_append_value(struct mansession *s, const char *header, const char *value)
 {
-	AST_DECLARE_APP_ARGS(args,
-		AST_APP_ARG(key);
-	);
+	char *escaped;
+	char *dst;
 
-	buf[0] = '\0';
-
-	if (ast_strlen_zero(parse)) {
-		ast_log(LOG_WARNING, "REDIS_EXISTS requires one argument, REDIS(<key>)\n");
-		return -1;
+	if (!strpbrk(value, "\\\r\n") || !(escaped = ast_malloc(strlen(value) * 2 + 1))) {
+		astman_append(s, "%s: %s\r\n", header, value);
+		return;
 	}
+	for (dst = escaped; *value; value++) {
+		switch (*value) {
+		case '\\':
+			*dst++ = '\\';
+			*dst++ = '\\';
+			break;
+		case '\r':
+			*dst++ = '\\';
+			*dst++ = 'r';
+			break;
+		case '\n':
+			*dst++ = '\\';
+			*dst++ = 'n';
+			break;
+		default:
+			*dst++ = *value;
+		}
+	}
+	*dst = '\0';
+	astman_append(s, "%s: %s\r\n", header, escaped);
+	ast_free(escaped);
+}
 
-	AST_STANDARD_APP_ARGS(args, parse);
+static int manager_redis_get(struct mansession *s, const struct message *m)
+{
+	const char *key = astman_get_header(m, "Key");
+	const char *field = astman_get_header(m, "Field");
+	struct ast_channel *chan;
+	struct ast_str *value;
+	struct redis_output out = { .str = &value, .maxlen = 0, };
+	const char *status;
+	int res;
 
-	if (args.argc != 1) {
-		ast_log(LOG_WARNING, "REDIS_EXISTS requires one argument, REDIS(<key>)\n");
-		return -1;
+	if (ast_strlen_zero(key)) {
+		astman_send_error(s, m, "Key is required");
+		return 0;
+	}
+	if (!(value = ast_str_create(REDIS_CMDBUF_SZ))) {
+		astman_send_error(s, m, "Out of memory");
+		return 0;
+	}
+	if (!(chan = redis_manager_channel(s, m))) {
+		ast_free(value);
+		return 0;
 	}
 
+	redis_deadline_begin(chan);
+	res = redis_read_key(chan, key, S_OR(field, NULL), &out);
+	redis_deadline_end();
 
-	reply = redisLoggedCommand(redis,"EXISTS %s", args.key);
-
-	if (redis == NULL || redis->err != 0) {
-		strcpy(buf, "0");
-	} else {
-		pbx_builtin_setvar_helper(chan, "REDIS_RESULT", buf);
-		strcpy(buf, "1");
+	if ((status = redis_manager_status(s, m, chan, res))) {
+		astman_start_ack(s, m);
+		astman_append(s, "Status: %s\r\n", status);
+		if (!strcmp(status, "OK")) {
+			redis_manager_append_value(s, "Value", ast_str_buffer(value));
+		}
+		astman_append(s, "\r\n");
 	}
 
+	ast_channel_unref(chan);
+	ast_free(value);
+
 	return 0;
 }
 
-static struct ast_custom_function redis_exists_function = {
-	.name = "REDIS_EXISTS",
-	.read = function_redis_exists,
-	.read_max = 2,
-};
-
-static int function_redis_delete(struct ast_channel *chan, const char *cmd,
-			      char *parse, char *buf, size_t len)
+static int manager_redis_set(struct mansession *s, const struct message *m)
 {
-	AST_DECLARE_APP_ARGS(args,
-		AST_APP_ARG(key);
-	);
-
-	buf[0] = '\0';
+	const char *key = astman_get_header(m, "Key");
+	const char *field = astman_get_header(m, "Field");
+	const char *value = astman_get_header(m, "Value");
+	const char *options = astman_get_header(m, "Options");
+	struct ast_channel *chan;
+	const char *status;
+	int res;
 
-	if (ast_strlen_zero(parse)) {
-		ast_log(LOG_WARNING, "REDIS_DELETE requires an argument, REDIS_DELETE(<key>)\n");
-		return -1;
+	if (ast_strlen_zero(key)) {
+		astman_send_error(s, m, "Key is required");
+		return 0;
 	}
-
-	AST_STANDARD_APP_ARGS(args, parse);
-
-	if (args.argc != 1) {
-		ast_log(LOG_WARNING, "REDIS_DELETE requires an argument, REDIS_DELETE(<key>)\n");
-		return -1;
+	if (!(chan = redis_manager_channel(s, m))) {
+		return 0;
 	}
 
-	reply = redisLoggedCommand(redis,"DEL %s", args.key);
+	redis_deadline_begin(chan);
+	res = redis_write_key(chan, key, field, ast_strdupa(options), value);
+	redis_deadline_end();
 
-	if (redis == NULL || redis->err != 0) {
-		ast_log(LOG_DEBUG, "REDIS_DELETE: Key %s not found in database.\n", args.key);
+	if ((status = redis_manager_status(s, m, chan, res))) {
+		astman_start_ack(s, m);
+		astman_append(s, "Status: %s\r\n\r\n", status);
 	}
 
-	freeReplyObject(reply);
+	ast_channel_unref(chan);
 
 	return 0;
 }
 
-/*!
- * \brief Wrapper to execute REDIS_DELETE from a write operation. Allows execution
- * even if live_dangerously is disabled.
- */
-static int function_redis_delete_write(struct ast_channel *chan, const char *cmd, char *parse,
-	const char *value)
+static int manager_redis_mget(struct mansession *s, const struct message *m)
 {
-	/* Throwaway to hold the result from the read */
-	char buf[128];
-	return function_redis_delete(chan, cmd, parse, buf, sizeof(buf));
-}
+	const char *keys = astman_get_header(m, "Keys");
+	const char *id = astman_get_header(m, "ActionID");
+	char id_text[256] = "";
+	struct ast_channel *chan;
+	char *names[MAX_BATCH_KEYS];
+	const char *value;
+	char *next;
+	char found[16];
+	char var[32];
+	int count = 0;
+	int res;
+	int i;
 
-static struct ast_custom_function redis_delete_function = {
-	.name = "REDIS_DELETE",
-	.read = function_redis_delete,
-	.write = function_redis_delete_write,
-};
+	if (ast_strlen_zero(keys)) {
+		astman_send_error(s, m, "Keys is required");
+		return 0;
+	}
+	/* Split here rather than by the dialplan parser, which would treat quotes and parentheses specially */
+	for (next = ast_strdupa(keys); next && count < MAX_BATCH_KEYS;) {
+		names[count++] = strsep(&next, ",");
+	}
+	if (next) {
+		snprintf(var, sizeof(var), "At most %d keys", MAX_BATCH_KEYS);
+		astman_send_error(s, m, var);
+		return 0;
+	}
+	if (!ast_strlen_zero(id)) {
+		snprintf(id_text, sizeof(id_text), "ActionID: %s\r\n", id);
+	}
+	if (!(chan = redis_manager_channel(s, m))) {
+		return 0;
+	}
 
-static int function_redis_publish(struct ast_channel *chan, const char *cmd, char *parse,
-								const char *value)
-{
-	AST_DECLARE_APP_ARGS(args,
-						 AST_APP_ARG(redis_channel);
-	);
+	redis_deadline_begin(chan);
+	res = redis_read_multiple(chan, "RedisMGet", NULL, names, count, found, sizeof(found));
+	redis_deadline_end();
 
-	if (ast_strlen_zero(parse)) {
-		ast_log(LOG_WARNING, "REDIS_PUBLISH requires one argument, REDIS_PUBLISH(<channel>)=<message>\n");
-		return -1;
+	if (!redis_manager_status(s, m, chan, res)) {
+		ast_channel_unref(chan);
+		return 0;
 	}
 
-	AST_STANDARD_APP_ARGS(args, parse);
+	astman_send_listack(s, m, "Redis values will follow", "start");
+	for (i = 0; i < count; i++) {
+		snprintf(var, sizeof(var), "REDIS_RESULT_%d", i + 1);
+		value = pbx_builtin_getvar_helper(chan, var);
+		astman_append(s,
+			"Event: RedisMGetEntry\r\n"
+			"%s"
+			"Key: %s\r\n",
+			id_text, names[i]);
+		redis_manager_append_value(s, "Value", S_OR(value, ""));
+		astman_append(s, "\r\n");
+	}
+	astman_send_list_complete_start(s, m, "RedisMGetComplete", count);
+	astman_append(s, "Found: %s\r\n", found);
+	astman_send_list_complete_end(s);
 
-	if (args.argc != 1) {
-		ast_log(LOG_WARNING, "REDIS_PUBLISH requires one argument, REDIS_PUBLISH(<channel>)=<message>\n");
-		return -1;
+	ast_channel_unref(chan);
+
+	return 0;
+}
+
+static int manager_redis_publish(struct mansession *s, const struct message *m)
+{
+	const char *channel = astman_get_header(m, "Channel");
+	const char *message = astman_get_header(m, "Message");
+	const char *options = astman_get_header(m, "Options");
+	struct ast_channel *chan;
+	const char *receivers;
+	const char *status;
+	int res;
+
+	if (ast_strlen_zero(channel)) {
+		astman_send_error(s, m, "Channel is required");
+		return 0;
+	}
+	if (!(chan = redis_manager_channel(s, m))) {
+		return 0;
 	}
 
-	reply = redisLoggedCommand(redis,"PUBLISH %s %s", args.redis_channel, value);
+	redis_deadline_begin(chan);
+	res = redis_publish_message(chan, channel, ast_strdupa(options), message);
+	redis_deadline_end();
 
-	if (redis == NULL || redis->err != 0) {
-		ast_log(LOG_ERROR, "REDIS_PUBLISH: Error publishing message. Reason: %s\n", redis->errstr);
-	} else {
-        char str_int[21];
-        snprintf(str_int, 21, "%lld", reply->integer);
-        pbx_builtin_setvar_helper(chan, "REDIS_PUBLISH_RESULT", str_int);
-    }
+	if ((status = redis_manager_status(s, m, chan, res))) {
+		astman_start_ack(s, m);
+		astman_append(s, "Status: %s\r\n", status);
+		if (!ast_strlen_zero(receivers = pbx_builtin_getvar_helper(chan, "REDIS_PUBLISH_RESULT"))) {
+			astman_append(s, "Receivers: %s\r\n", receivers);
+		}
+		astman_append(s, "\r\n");
+	}
 
-	freeReplyObject(reply);
+	ast_channel_unref(chan);
 
 	return 0;
 }
 
-static struct ast_custom_function redis_publish_function = {
-		.name = "REDIS_PUBLISH",
-		.write = function_redis_publish,
+enum redis_bench_op {
+	REDIS_BENCH_GET,
+	REDIS_BENCH_SET,
+	REDIS_BENCH_EXISTS,
+	REDIS_BENCH_DELETE,
+	REDIS_BENCH_PUBLISH,
 };
 
-static char *handle_cli_redis_set(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
-{
-	switch (cmd) {
-		case CLI_INIT:
-			e->command = "redis set";
-			e->usage =
-					"Usage: redis set <key> <value>\n"
-							"       Creates an entry in the Redis database for a given key and value.\n"
-							"redis set <key> <hash> <value>\n"
-							"		Creates an entry in the Redis database for a given key, hash and value\n";
-			return NULL;
-		case CLI_GENERATE:
-			return NULL;
-	}
+static const char * const redis_bench_ops[] = {
+	[REDIS_BENCH_GET] = "get",
+	[REDIS_BENCH_SET] = "set",
+	[REDIS_BENCH_EXISTS] = "exists",
+	[REDIS_BENCH_DELETE] = "delete",
+	[REDIS_BENCH_PUBLISH] = "publish",
+};
 
-	if (a->argc < 4 || a->argc > 5)
-		return CLI_SHOWUSAGE;
+/*! \brief One run of redis bench, shared by its threads */
+struct redis_bench {
+	enum redis_bench_op op;
+	/*! Write options, s to wait for the server or a to queue for the async writer */
+	const char *options;
+	int calls;
+	/*! Calls handed out to the threads so far */
+	int next;
+	/*! Calls that failed or didn't leave REDIS_STATUS at OK or NOT_FOUND */
+	int failed;
+	struct redis_cmd_stats stats;
+};
 
-	if (a->argc == 4) {
-		reply = redisLoggedCommand(redis,"SET %s %s", a->argv[2], a->argv[3]);
-	} else if (a->argc == 5){
-		reply = redisLoggedCommand(redis,"HSET %s %s %s", a->argv[2], a->argv[3], a->argv[4]);
-	}
+/*!
+ * \brief Make one call through the dialplan function callbacks.
+ *
+ * \retval 0 the call succeeded
+ */
+static int redis_bench_call(struct redis_bench *bench, struct ast_channel *chan, int n)
+{
+	char parse[64];
+	char buf[256];
+	const char *status;
+	int res;
 
-	if (redis == NULL || redis->err != 0) {
-		ast_cli(a->fd, "Redis database error.\n");
-	} else {
-		ast_cli(a->fd, "Redis database entry created.\n");
+	switch (bench->op) {
+	case REDIS_BENCH_GET:
+		snprintf(parse, sizeof(parse), "bench:%d", n % BENCH_KEYS);
+		res = redis_function.read(chan, redis_function.name, parse, buf, sizeof(buf));
+		break;
+	case REDIS_BENCH_SET:
+		snprintf(parse, sizeof(parse), "bench:%d,,%s", n % BENCH_KEYS, bench->options);
+		res = redis_function.write(chan, redis_function.name, parse, "func_redis bench");
+		break;
+	case REDIS_BENCH_EXISTS:
+		snprintf(parse, sizeof(parse), "bench:%d", n % BENCH_KEYS);
+		res = redis_exists_function.read(chan, redis_exists_function.name, parse, buf, sizeof(buf));
+		break;
+	case REDIS_BENCH_DELETE:
+		snprintf(parse, sizeof(parse), "bench:%d", n % BENCH_KEYS);
+		res = redis_delete_function.read(chan, redis_delete_function.name, parse, buf, sizeof(buf));
+		break;
+	case REDIS_BENCH_PUBLISH:
+	default:
+		snprintf(parse, sizeof(parse), "bench,%s", bench->options);
+		res = redis_publish_function.write(chan, redis_publish_function.name, parse, "func_redis bench");
+		break;
 	}
-	freeReplyObject(reply);
-	return CLI_SUCCESS;
+
+	status = pbx_builtin_getvar_helper(chan, "REDIS_STATUS");
+	return res || !status || (strcmp(status, "OK") && strcmp(status, "NOT_FOUND"));
 }
 
-static char *handle_cli_redis_del(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+static void *redis_bench_thread(void *data)
 {
-	switch (cmd) {
-	case CLI_INIT:
-		e->command = "redis del";
-		e->usage =
-			"Usage: redis del <key>\n"
-			"       Deletes an entry in the Redis database for a given key.\n";
-		return NULL;
-	case CLI_GENERATE:
+	struct redis_bench *bench = data;
+	struct ast_channel *chan;
+	struct timeval start;
+	int n;
+
+	/* A channel without a technology, just for the variables the functions set */
+	if (!(chan = ast_dummy_channel_alloc())) {
 		return NULL;
 	}
 
-	if (a->argc != 3)
-		return CLI_SHOWUSAGE;
-	reply = redisLoggedCommand(redis,"DEL %s", a->argv[2]);
-	
-	if (redis == NULL || redis->err != 0) {
-		ast_cli(a->fd, "Redis database entry does not exist.\n");
-	} else {
-		ast_cli(a->fd, "Redis database entry removed.\n");
+	while ((n = ast_atomic_fetchadd_int(&bench->next, 1)) < bench->calls) {
+		start = ast_tvnow();
+		if (redis_bench_call(bench, chan, n)) {
+			ast_atomic_fetchadd_int(&bench->failed, 1);
+		}
+		redis_stats_add(&bench->stats, start);
 	}
-	freeReplyObject(reply);
-	return CLI_SUCCESS;
+
+	ast_channel_unref(chan);
+
+	return NULL;
 }
 
-static char *handle_cli_redis_show(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
+static char *handle_cli_redis_bench(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
 {
+	struct redis_bench bench = { .options = "s", .calls = DEFAULT_BENCH_CALLS, };
+	pthread_t threads[BENCH_MAX_THREADS];
+	struct timeval start;
+	long long elapsed_ms;
+	int nthreads = 1;
+	int started;
+	int which = 0;
+	int cached;
+	int size;
+	int i;
+
 	switch (cmd) {
 	case CLI_INIT:
-		e->command = "redis show";
+		e->command = "redis bench";
 		e->usage =
-			"Usage: redis show\n"
-			"   OR: redis show [pattern]\n"
-			"       Shows Redis database contents, optionally restricted\n"
-			"       to a pattern.\n"
-			"\n"
-			"		[pattern] pattern to match keys\n"
-			"		Examples :\n"
-			"			- h?llo matches hello, hallo and hxllo\n"
-			"			- h*llo matches hllo and heeeello\n"
-			"			- h[ae]llo matches hello and hallo, but not hillo\n";
+			"Usage: redis bench <get|set|exists|delete|publish> [<threads> [<calls> [sync|async]]]\n"
+			"       Runs the REDIS, REDIS_EXISTS, REDIS_DELETE or REDIS_PUBLISH\n"
+			"       callbacks on dummy channels from <threads> threads (default 1)\n"
+			"       and reports calls per second and latency percentiles over\n"
+			"       <calls> calls (default 10000) spread across the keys bench:0\n"
+			"       to bench:999. Set and publish wait for the server unless async\n"
+			"       is given, which queues them for the pipelining async writer.\n"
+			"       More threads than pool_size measure the pool under contention,\n"
+			"       and get measures the local cache when cache=yes. Percentiles\n"
+			"       are accurate to within a factor of two.\n"
+			"       Set and delete overwrite the bench: keys.\n";
 		return NULL;
 	case CLI_GENERATE:
+		if (a->pos == 2) {
+			for (i = 0; i < ARRAY_LEN(redis_bench_ops); i++) {
+				if (!strncasecmp(a->word, redis_bench_ops[i], strlen(a->word)) && ++which > a->n) {
+					return ast_strdup(redis_bench_ops[i]);
+				}
+			}
+		}
 		return NULL;
 	}
-	
-	if (a->argc == 3) {
-		/* key */
-		reply = redisLoggedCommand(redis,"KEYS %s", a->argv[2]);
-	} else if (a->argc == 2) {
-		/* show all */
-		reply = redisLoggedCommand(redis,"KEYS *");
-	} else {
+
+	if (a->argc < 3 || a->argc > 6) {
 		return CLI_SHOWUSAGE;
 	}
-	
-	int i = 0;
-	redisReply * get_reply;
-
-	for(i = 0; i < reply->elements; i++){
-		get_reply = redisLoggedCommand(redis,"GET %s", reply->element[i]->str);
-	    if(get_reply != NULL)
-	    {
-			ast_cli(a->fd, "%-50s: %-25s\n", reply->element[i]->str, get_reply->str);
-	    }
-		freeReplyObject(get_reply);
+	for (i = 0; i < ARRAY_LEN(redis_bench_ops) && strcasecmp(a->argv[2], redis_bench_ops[i]); i++) {
+	}
+	if (i == ARRAY_LEN(redis_bench_ops)) {
+		return CLI_SHOWUSAGE;
+	}
+	bench.op = i;
+	if (a->argc > 3 && (sscanf(a->argv[3], "%30d", &nthreads) != 1
+		|| nthreads < 1 || nthreads > BENCH_MAX_THREADS)) {
+		ast_cli(a->fd, "The number of threads must be between 1 and %d.\n", BENCH_MAX_THREADS);
+		return CLI_SHOWUSAGE;
+	}
+	if (a->argc > 4 && (sscanf(a->argv[4], "%30d", &bench.calls) != 1 || bench.calls < 1)) {
+		return CLI_SHOWUSAGE;
+	}
+	if (a->argc > 5) {
+		if (!strcasecmp(a->argv[5], "async")) {
+			bench.options = "a";
+		} else if (strcasecmp(a->argv[5], "sync")) {
+			return CLI_SHOWUSAGE;
+		}
 	}
 
-	ast_cli(a->fd, "%d results found.\n", (int)reply->elements);
-	freeReplyObject(reply);
-
-	return CLI_SUCCESS;
-}
+	ast_mutex_lock(&redis_lock);
+	cached = cache_enabled;
+	size = pool_size;
+	ast_mutex_unlock(&redis_lock);
 
-static char *handle_cli_redis_hshow(struct ast_cli_entry *e, int cmd, struct ast_cli_args *a)
-{
-	switch (cmd) {
-	case CLI_INIT:
-		e->command = "redis hshow";
-		e->usage =
-			"Usage: redis hshow <hash>\n"
-			"       Shows Redis hash contents\n";
-		return NULL;
-	case CLI_GENERATE:
-		return NULL;
+	start = ast_tvnow();
+	for (started = 0; started < nthreads; started++) {
+		if (ast_pthread_create_background(&threads[started], NULL, redis_bench_thread, &bench)) {
+			ast_cli(a->fd, "Unable to start more than %d threads.\n", started);
+			break;
+		}
 	}
-	
-	if (a->argc == 3) {
-		/* key */
-		reply = redisLoggedCommand(redis,"HKEYS %s", a->argv[2]);
-	} else {
-		return CLI_SHOWUSAGE;
+	for (i = 0; i < started; i++) {
+		pthread_join(threads[i], NULL);
 	}
-	
-	int i = 0;
-	redisReply * get_reply;
+	elapsed_ms = ast_tvdiff_ms(ast_tvnow(), start);
 
-	for(i = 0; i < reply->elements; i++){
-		get_reply = redisLoggedCommand(redis,"HGET %s %s", a->argv[2], reply->element[i]->str);
-	    if(get_reply != NULL)
-	    {
-			ast_cli(a->fd, "%-50s: %-25s\n", reply->element[i]->str, get_reply->str);
-	    }
-		freeReplyObject(get_reply);
+	if (!bench.stats.count) {
+		ast_cli(a->fd, "No calls were made.\n");
+		return CLI_FAILURE;
 	}
 
-	ast_cli(a->fd, "%d results found.\n", (int)reply->elements);
-	freeReplyObject(reply);
+	ast_cli(a->fd, "Function:      %s%s\n", redis_bench_ops[bench.op],
+		bench.op == REDIS_BENCH_SET || bench.op == REDIS_BENCH_PUBLISH
+			? (*bench.options == 'a' ? " (async)" : " (sync)") : "");
+	ast_cli(a->fd, "Threads:       %d (pool_size %d)\n", started, size);
+	ast_cli(a->fd, "Cache:         %s\n", cached ? "Yes" : "No");
+	ast_cli(a->fd, "Calls:         %d in %lld ms\n", bench.stats.count, elapsed_ms);
+	ast_cli(a->fd, "Calls/s:       %lld\n", bench.stats.count * 1000LL / MAX(elapsed_ms, 1));
+	ast_cli(a->fd, "Failed:        %d\n", bench.failed);
+	ast_cli(a->fd, "p50 (us):      %d\n", redis_stats_percentile(bench.stats.buckets, 50));
+	ast_cli(a->fd, "p90 (us):      %d\n", redis_stats_percentile(bench.stats.buckets, 90));
+	ast_cli(a->fd, "p99 (us):      %d\n", redis_stats_percentile(bench.stats.buckets, 99));
+	ast_cli(a->fd, "Max (us):      %d\n", bench.stats.max_us);
 
 	return CLI_SUCCESS;
 }
@@ -607,6 +9245,11 @@ static char *handle_cli_redis_hshow(struct ast_cli_entry *e, int cmd, struct ast
 static struct ast_cli_entry cli_func_redis[] = {
 	AST_CLI_DEFINE(handle_cli_redis_show, "Get all Redis values or by pattern in key"),
 	AST_CLI_DEFINE(handle_cli_redis_hshow, "Get all hash values in key"),
+	AST_CLI_DEFINE(handle_cli_redis_show_cache, "Show local read cache statistics"),
+	AST_CLI_DEFINE(handle_cli_redis_show_async, "Show async writer statistics"),
+	AST_CLI_DEFINE(handle_cli_redis_show_subscriptions, "Show subscribed channels"),
+	AST_CLI_DEFINE(handle_cli_redis_show_stats, "Show Redis command counters and latencies"),
+	AST_CLI_DEFINE(handle_cli_redis_bench, "Measure the throughput and latency of the Redis functions"),
 	AST_CLI_DEFINE(handle_cli_redis_del, "Delete a key - value in Redis"),
 	AST_CLI_DEFINE(handle_cli_redis_set, "Creates a new key - value in Redis")
 };
@@ -614,43 +9257,190 @@ static struct ast_cli_entry cli_func_redis[] = {
 static int unload_module(void)
 {
 	int res = 0;
-	if (ast_true(bgsave)) {
+	struct redis_conn *conn;
+	struct redis_pool *node;
+	struct redis_profile *profile;
+	struct redis_script *script;
+	redisReply *reply;
+	struct redis_args cmd;
+
+	if (ast_true(bgsave) && (conn = redis_pool_acquire(&pool))) {
 		ast_log(LOG_WARNING, "Sending BGSAVE before closing connection.\n");
-		reply = redisLoggedCommand(redis, "BGSAVE");
+		redis_args_init(&cmd, "BGSAVE", NULL);
+		reply = redis_logged_command(conn, &cmd);
 		ast_log(LOG_WARNING, "Closing connection.\n");
-		freeReplyObject(reply);
+		redis_reply_free(reply);
+		redis_pool_release(conn);
 	}
-	redisFree(redis);
 	
 	ast_cli_unregister_multiple(cli_func_redis, ARRAY_LEN(cli_func_redis));
+	res |= ast_manager_unregister("RedisStats");
+	res |= ast_manager_unregister("RedisGet");
+	res |= ast_manager_unregister("RedisSet");
+	res |= ast_manager_unregister("RedisMGet");
+	res |= ast_manager_unregister("RedisPublish");
 	res |= ast_custom_function_unregister(&redis_function);
 	res |= ast_custom_function_unregister(&redis_exists_function);
 	res |= ast_custom_function_unregister(&redis_delete_function);
 	res |= ast_custom_function_unregister(&redis_publish_function);
+	res |= ast_custom_function_unregister(&redis_xadd_function);
+	res |= ast_custom_function_unregister(&redis_mget_function);
+	res |= ast_custom_function_unregister(&redis_hmget_function);
+	res |= ast_custom_function_unregister(&redis_hgetall_function);
+	res |= ast_custom_function_unregister(&redis_eval_function);
+	res |= ast_custom_function_unregister(&redis_incr_function);
+	res |= ast_custom_function_unregister(&redis_decr_function);
+	res |= ast_custom_function_unregister(&redis_expire_function);
+	res |= ast_custom_function_unregister(&redis_fcall_function);
+	res |= ast_custom_function_unregister(&redis_begin_function);
+	res |= ast_custom_function_unregister(&redis_commit_function);
+
+	redis_async_stop();
+	/* Also stops the preload */
+	redis_cache_stop();
+	redis_sentinel_stop();
+	redis_subscriber_stop();
+	redis_monitor_stop();
+	redis_pool_drain(&pool);
+	redis_pool_drain(&replica_pool);
+	while ((node = AST_LIST_REMOVE_HEAD(&cluster.nodes, list))) {
+		redis_pool_drain(node);
+		redis_pool_destroy(node);
+		ast_free(node);
+	}
+	ast_rwlock_destroy(&cluster.lock);
+	while ((script = AST_LIST_REMOVE_HEAD(&scripts, list))) {
+		redis_script_free(script);
+	}
+	while ((profile = AST_LIST_REMOVE_HEAD(&profiles, list))) {
+		redis_pool_drain(&profile->pool);
+		redis_pool_destroy(&profile->pool);
+		ast_free(profile);
+	}
+	ao2_cleanup(cache.entries);
+#ifdef HAVE_HIREDIS_SSL
+	ao2_cleanup(tls_context);
+	tls_context = NULL;
+#endif
+	ast_mutex_destroy(&cache.lock);
+	ast_cond_destroy(&flights.cond);
+	ast_mutex_destroy(&flights.lock);
+	ast_mutex_destroy(&preload.lock);
+	ast_cond_destroy(&async.cond);
+	ast_mutex_destroy(&async.lock);
+	ast_cond_destroy(&monitor.cond);
+	ast_mutex_destroy(&monitor.lock);
+	redis_pool_destroy(&replica_pool);
+	redis_pool_destroy(&pool);
 
 	return res;
 }
 
 static int load_module(void)
 {
-	if(load_config() == -1 || redis_connect() == -1)
+	redis_pool_init(&pool);
+	redis_pool_init(&replica_pool);
+	ast_rwlock_init(&cluster.lock);
+	AST_LIST_HEAD_INIT_NOLOCK(&cluster.nodes);
+	ast_mutex_init(&monitor.lock);
+	ast_cond_init(&monitor.cond, NULL);
+	ast_mutex_init(&cache.lock);
+	AST_DLLIST_HEAD_INIT_NOLOCK(&cache.lru);
+	ast_mutex_init(&flights.lock);
+	ast_cond_init(&flights.cond, NULL);
+	AST_LIST_HEAD_INIT_NOLOCK(&flights.list);
+	ast_mutex_init(&preload.lock);
+	ast_mutex_init(&async.lock);
+	ast_cond_init(&async.cond, NULL);
+	AST_LIST_HEAD_INIT_NOLOCK(&async.queue);
+	ast_sha1_hash(redis_incr_ttl_sha1, redis_incr_ttl_script);
+
+	if (!(cache.entries = ao2_container_alloc_hash(AO2_ALLOC_OPT_LOCK_NOLOCK, 0, CACHE_BUCKETS,
+		redis_cache_hash_fn, NULL, redis_cache_cmp_fn))
+		|| load_config() == -1 || redis_monitor_start() == -1 || redis_async_start() == -1) {
+		redis_monitor_stop();
+		ao2_cleanup(cache.entries);
+#ifdef HAVE_HIREDIS_SSL
+		ao2_cleanup(tls_context);
+		tls_context = NULL;
+#endif
+		ast_mutex_destroy(&cache.lock);
+		ast_cond_destroy(&flights.cond);
+		ast_mutex_destroy(&flights.lock);
+		ast_mutex_destroy(&preload.lock);
+		ast_cond_destroy(&async.cond);
+		ast_mutex_destroy(&async.lock);
+		ast_cond_destroy(&monitor.cond);
+		ast_mutex_destroy(&monitor.lock);
+		redis_pool_destroy(&replica_pool);
+		redis_pool_destroy(&pool);
+		ast_rwlock_destroy(&cluster.lock);
 		return AST_MODULE_LOAD_DECLINE;
+	}
+
+	/* An unreachable server is not fatal, the monitor thread keeps retrying */
+	if (redis_connect() == -1) {
+		ast_log(LOG_WARNING, "Redis server unreachable, will keep trying in the background.\n");
+	}
+	redis_cache_apply_config(1);
+	redis_sentinel_apply_config();
+	redis_subscriber_apply_config();
 	int res = 0;
 	
 	ast_cli_register_multiple(cli_func_redis, ARRAY_LEN(cli_func_redis));
+	res |= ast_manager_register_xml("RedisStats", EVENT_FLAG_SYSTEM | EVENT_FLAG_REPORTING, manager_redis_stats);
+	res |= ast_manager_register_xml("RedisGet", EVENT_FLAG_SYSTEM | EVENT_FLAG_REPORTING, manager_redis_get);
+	res |= ast_manager_register_xml("RedisSet", EVENT_FLAG_SYSTEM, manager_redis_set);
+	res |= ast_manager_register_xml("RedisMGet", EVENT_FLAG_SYSTEM | EVENT_FLAG_REPORTING, manager_redis_mget);
+	res |= ast_manager_register_xml("RedisPublish", EVENT_FLAG_SYSTEM, manager_redis_publish);
 	res |= ast_custom_function_register_escalating(&redis_function, AST_CFE_BOTH);
 	res |= ast_custom_function_register(&redis_exists_function);
 	res |= ast_custom_function_register_escalating(&redis_delete_function, AST_CFE_READ);
 	res |= ast_custom_function_register_escalating(&redis_publish_function, AST_CFE_WRITE);
+	res |= ast_custom_function_register_escalating(&redis_xadd_function, AST_CFE_WRITE);
+	res |= ast_custom_function_register(&redis_mget_function);
+	res |= ast_custom_function_register(&redis_hmget_function);
+	res |= ast_custom_function_register(&redis_hgetall_function);
+	res |= ast_custom_function_register_escalating(&redis_eval_function, AST_CFE_READ);
+	res |= ast_custom_function_register_escalating(&redis_incr_function, AST_CFE_READ);
+	res |= ast_custom_function_register_escalating(&redis_decr_function, AST_CFE_READ);
+	res |= ast_custom_function_register_escalating(&redis_expire_function, AST_CFE_WRITE);
+	res |= ast_custom_function_register_escalating(&redis_fcall_function, AST_CFE_READ);
+	res |= ast_custom_function_register_escalating(&redis_begin_function, AST_CFE_READ);
+	res |= ast_custom_function_register_escalating(&redis_commit_function, AST_CFE_READ);
 
 	return res;
 }
 
 static int reload(void)
 {
+	char patterns[SUBSCRIBE_CONF_SZ];
+	unsigned int generation;
+	int restart;
+
 	ast_log(LOG_WARNING,"Reloading.\n");
-	if(load_config() == -1 || redis_connect() == -1)
+	ast_mutex_lock(&redis_lock);
+	ast_copy_string(patterns, preload_patterns, sizeof(patterns));
+	ast_mutex_unlock(&redis_lock);
+	if(load_config() == -1)
 		return AST_MODULE_LOAD_DECLINE;
+	ast_mutex_lock(&pool.lock);
+	generation = pool.generation;
+	ast_mutex_unlock(&pool.lock);
+	if (redis_connect() == -1) {
+		ast_log(LOG_WARNING, "Redis server unreachable, will keep trying in the background.\n");
+	}
+	ast_mutex_lock(&pool.lock);
+	/* A new server or database invalidates the cache and its listener */
+	restart = generation != pool.generation;
+	ast_mutex_unlock(&pool.lock);
+	/* New preload patterns are read by a new listener, into an emptied cache */
+	ast_mutex_lock(&redis_lock);
+	restart |= strcmp(patterns, preload_patterns) != 0;
+	ast_mutex_unlock(&redis_lock);
+	redis_cache_apply_config(restart);
+	redis_sentinel_apply_config();
+	redis_subscriber_apply_config();
 	int res = 0;
 	return res;
 }